@@ -4,32 +4,44 @@
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <functional>
+#include <mutex>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <QApplication>
 #include <QWidget>
 #include <QtCore/QAbstractEventDispatcher>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QThread>
 
 #include "agent_qtmonkey_communication.hpp"
 #include "common.hpp"
+#include "gui_call_queue.hpp"
+#include "gui_idle_tracker.hpp"
 #include "script.hpp"
 #include "script_api.hpp"
 #include "script_runner.hpp"
 #include "user_events_analyzer.hpp"
+#include "widgets_index.hpp"
 
 using qt_monkey_agent::Agent;
 using qt_monkey_agent::CustomEventAnalyzer;
 using qt_monkey_agent::PopulateScriptContext;
 using qt_monkey_agent::UserEventsAnalyzer;
 using qt_monkey_agent::Private::CommunicationAgentPart;
+using qt_monkey_agent::Private::GuiCallQueue;
+using qt_monkey_agent::Private::GuiIdleTracker;
 using qt_monkey_agent::Private::PacketTypeForMonkey;
 using qt_monkey_agent::Private::Script;
 using qt_monkey_agent::Private::ScriptRunner;
-using qt_monkey_common::Semaphore;
+using qt_monkey_agent::Private::WidgetsIndex;
+using qt_monkey_common::Completion;
 
 Agent *Agent::gAgent_ = nullptr;
 
@@ -49,6 +61,9 @@ Agent *Agent::gAgent_ = nullptr;
 
 namespace
 {
+// the same as fixed delay after script end before
+static constexpr int maxScriptEndIdleWaitMs = 300;
+
 class FuncEvent final : public QEvent
 {
 public:
@@ -86,7 +101,6 @@ class AgentThread final : public QThread
 {
 public:
     AgentThread(QObject *parent) : QThread(parent) {}
-    bool isNotReady() { return !ready_.exchange(false); }
     void run() override
     {
         CommunicationAgentPart client;
@@ -95,6 +109,7 @@ public:
                 "%s",
                 qPrintable(
                     T_("%1: can not connect to qt monkey").arg(Q_FUNC_INFO)));
+            setReady(nullptr, nullptr);
             return;
         }
         connect(&client, SIGNAL(error(const QString &)), parent(),
@@ -106,27 +121,183 @@ public:
             parent(),
             SLOT(onRunScriptCommand(const qt_monkey_agent::Private::Script &)),
             Qt::DirectConnection);
+        connect(&client, SIGNAL(haltScript()), parent(),
+                SLOT(onHaltScriptCommand()), Qt::DirectConnection);
         EventsReciever eventReciever;
-        objInThread_ = &eventReciever;
-        channelWithMonkey_ = &client;
-        ready_ = true;
+        client.sendCommand(
+            PacketTypeForMonkey::AgentReady,
+            QString::number(QDateTime::currentMSecsSinceEpoch()));
+        setReady(&client, &eventReciever);
         exec();
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            channelWithMonkey_ = nullptr;
+            objInThread_ = nullptr;
+        }
+        // client is destroyed after return, sender may wait
+        // until monkey read data, but not forever
+        while (nSenders_ != 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    /**
+     * Send packet to monkey, or queue it until channel become ready.
+     * Lock is taken only before channel is ready, after that
+     * producers do not block each other
+     */
+    void sendCommand(PacketTypeForMonkey pt, QString text)
+    {
+        // register before check of channel, so run() not destroy
+        // channel if we see it
+        ++nSenders_;
+        CommunicationAgentPart *channel = channelWithMonkey_;
+        if (channel == nullptr) {
+            std::lock_guard<std::mutex> lock{mutex_};
+            channel = channelWithMonkey_;
+            if (channel == nullptr) {
+                if (!ready_)
+                    pending_.emplace_back(pt, std::move(text));
+                --nSenders_;
+                return;
+            }
+        }
+        channel->sendCommand(pt, text);
+        --nSenders_;
+    }
+
+    /**
+     * Wait until thread connect to monkey or fail
+     * @return true if channel with monkey is up
+     */
+    bool waitReady()
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        readyCond_.wait(lock, [this] { return ready_; });
+        return channelWithMonkey_ != nullptr;
+    }
+
+    bool hasCloseAck()
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        CommunicationAgentPart *channel = channelWithMonkey_;
+        return channel != nullptr && channel->hasCloseAck();
+    }
+
+    void runInThread(std::function<void()> func)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (objInThread_ == nullptr)
+            return;
+        QCoreApplication::postEvent(
+            objInThread_,
+            new FuncEvent(objInThread_->eventType(), std::move(func)));
     }
 
     CommunicationAgentPart *channelWithMonkey() { return channelWithMonkey_; }
 
+private:
+    std::mutex mutex_;
+    std::condition_variable readyCond_;
+    bool ready_ = false;
+    //! packets sent before channel become ready
+    std::vector<std::pair<PacketTypeForMonkey, QString>> pending_;
+    EventsReciever *objInThread_{nullptr};
+    //! changed under lock, but producers read it without lock
+    std::atomic<CommunicationAgentPart *> channelWithMonkey_{nullptr};
+    //! threads that may use channelWithMonkey_ without lock
+    std::atomic<int> nSenders_{0};
+
+    void setReady(CommunicationAgentPart *channel, EventsReciever *obj)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            objInThread_ = obj;
+            if (channel != nullptr)
+                for (auto &packet : pending_)
+                    channel->sendCommand(packet.first, packet.second);
+            pending_.clear();
+            // after pending packets, so producers without lock
+            // can not send something before them
+            channelWithMonkey_ = channel;
+            ready_ = true;
+        }
+        readyCond_.notify_all();
+    }
+};
+
+/**
+ * Thread to run scripts, so AgentThread can send logs and process
+ * packets from monkey while script is running. There is no event loop,
+ * so scripts can not be reentered via processEvents
+ */
+class ScriptThread final : public QThread
+{
+public:
+    ScriptThread(QObject *parent) : QThread(parent) {}
+    void run() override
+    {
+        EventsReciever eventReciever;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            objInThread_ = &eventReciever;
+        }
+        runTasks();
+        std::lock_guard<std::mutex> lock{mutex_};
+        objInThread_ = nullptr;
+    }
     void runInThread(std::function<void()> func)
     {
-        assert(objInThread_ != nullptr);
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            tasks_.push_back(std::move(func));
+        }
+        cond_.notify_one();
+    }
+    /**
+     * Call function inside running script, when script engine
+     * or script step process events
+     */
+    void interruptScript(std::function<void()> func)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (objInThread_ == nullptr)
+            return;
         QCoreApplication::postEvent(
             objInThread_,
             new FuncEvent(objInThread_->eventType(), std::move(func)));
     }
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            timeToExit_ = true;
+        }
+        cond_.notify_one();
+    }
 
 private:
-    std::atomic<bool> ready_{false};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> tasks_;
+    bool timeToExit_ = false;
     EventsReciever *objInThread_{nullptr};
-    CommunicationAgentPart *channelWithMonkey_{nullptr};
+
+    void runTasks()
+    {
+        for (;;) {
+            std::function<void()> func;
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                cond_.wait(lock,
+                           [this] { return timeToExit_ || !tasks_.empty(); });
+                if (timeToExit_)
+                    return;
+                func = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            func();
+        }
+    }
 };
 
 void saveScreenShot(const QString &path)
@@ -169,8 +340,10 @@ void removeObsolete(const QString &path, unsigned nSteps)
 Agent::Agent(const QKeySequence &showObjectShortcut,
              std::list<CustomEventAnalyzer> customEventAnalyzers,
              PopulateScriptContext psc)
-    : eventAnalyzer_(new UserEventsAnalyzer(
+    : widgetsIndex_(new WidgetsIndex),
+      eventAnalyzer_(new UserEventsAnalyzer(
           *this, showObjectShortcut, std::move(customEventAnalyzers), this)),
+      guiCalls_(new GuiCallQueue), guiIdle_(new GuiIdleTracker),
       populateScriptContextCallback_(std::move(psc)),
       screenshots_(std::make_pair(QString(), -1))
 {
@@ -178,18 +351,21 @@ Agent::Agent(const QKeySequence &showObjectShortcut,
     gAgent_ = this;
     // make sure that type is referenced, fix bug with qt4 and static lib
     qMetaTypeId<qt_monkey_agent::Private::Script>();
-    eventType_ = static_cast<QEvent::Type>(QEvent::registerEventType());
     connect(qApp, SIGNAL(aboutToQuit()), this, SLOT(onAppAboutToQuit()));
     connect(eventAnalyzer_, SIGNAL(userEventInScriptForm(const QString &)),
             this, SLOT(onUserEventInScriptForm(const QString &)));
     connect(eventAnalyzer_, SIGNAL(scriptLog(const QString &)), this,
             SLOT(onScriptLog(const QString &)));
     QCoreApplication::instance()->installEventFilter(eventAnalyzer_);
+    if (QAbstractEventDispatcher *dispatcher
+        = QAbstractEventDispatcher::instance(qApp->thread()))
+        connect(dispatcher, SIGNAL(aboutToBlock()), this,
+                SLOT(onGuiThreadAboutToBlock()), Qt::DirectConnection);
+    scriptThread_ = new ScriptThread(this);
+    scriptThread_->start();
+    // not wait connection, user events are queued until it is ready
     thread_ = new AgentThread(this);
     thread_->start();
-    while (!thread_->isFinished()
-           && static_cast<AgentThread *>(thread_)->isNotReady())
-        ;
 }
 
 void Agent::onCommunicationError(const QString &err)
@@ -200,10 +376,21 @@ void Agent::onCommunicationError(const QString &err)
 
 Agent::~Agent()
 {
+    static_cast<ScriptThread *>(scriptThread_)->stop();
+    // running script may wait for GUI thread, so halt it
+    // and process its calls, instead of waiting forever
+    while (!scriptThread_->wait(10 /*ms*/)) {
+        const uint64_t cur = curScript_.load();
+        if (cur != 0 && haltedScript_.load() != cur)
+            haltScript(cur);
+        guiCalls_->processCalls();
+    }
+
     GET_THREAD(thread)
 
-    thread->runInThread(
-        [thread] { thread->channelWithMonkey()->flushSendData(); });
+    if (thread->waitReady())
+        thread->runInThread(
+            [thread] { thread->channelWithMonkey()->flushSendData(); });
     QCoreApplication::processEvents(QEventLoop::AllEvents, 1000 /*ms*/);
     thread->quit();
     thread->wait();
@@ -214,19 +401,55 @@ void Agent::onUserEventInScriptForm(const QString &script)
     if (script.isEmpty())
         return;
     GET_THREAD(thread)
-    thread->channelWithMonkey()->sendCommand(
-        PacketTypeForMonkey::NewUserAppEvent, script);
+    thread->sendCommand(PacketTypeForMonkey::NewUserAppEvent, script);
 }
 
 void Agent::onRunScriptCommand(const Script &script)
 {
-    GET_THREAD(thread)
     assert(QThread::currentThread() == thread_);
+    DBGPRINT("%s: queue script", Q_FUNC_INFO);
+    const uint64_t scriptNo = ++lastQueuedScript_;
+    static_cast<ScriptThread *>(scriptThread_)
+        ->runInThread(
+            [this, script, scriptNo] { runScript(script, scriptNo); });
+}
+
+void Agent::onHaltScriptCommand()
+{
+    assert(QThread::currentThread() == thread_);
+    // halt the last script that we get, it is running or will be run
+    haltScript(lastQueuedScript_.load());
+}
+
+void Agent::haltScript(uint64_t scriptNo)
+{
+    haltedScript_ = scriptNo;
+    DBGPRINT("%s: halt script %llu", Q_FUNC_INFO,
+             static_cast<unsigned long long>(scriptNo));
+    {
+        auto action = waitingAction_.get();
+        if (*action != nullptr && scriptHalted())
+            cancelAction(**action);
+    }
+    // script may be inside infinite loop without calls of Test API
+    static_cast<ScriptThread *>(scriptThread_)->interruptScript([this] {
+        if (curScriptRunner_ != nullptr && scriptHalted())
+            curScriptRunner_->abort();
+    });
+}
+
+void Agent::runScript(const Script &script, uint64_t scriptNo)
+{
+    GET_THREAD(thread)
+    assert(QThread::currentThread() == scriptThread_);
     DBGPRINT("%s: run script", Q_FUNC_INFO);
+    curScript_ = scriptNo;
     ScriptAPI api{*this};
     ScriptRunner sr{api, populateScriptContextCallback_};
     QString errMsg;
-    {
+    if (scriptHalted()) {
+        errMsg = T_("Script halted");
+    } else {
         CurrentScriptContext context(&sr, curScriptRunner_);
         DBGPRINT("%s: scrit file name %s", Q_FUNC_INFO,
                  qPrintable(script.fileName()));
@@ -234,41 +457,38 @@ void Agent::onRunScriptCommand(const Script &script)
         scriptBaseName_ = fi.baseName();
         sr.runScript(script, errMsg);
     }
+    curScript_ = 0;
     if (!errMsg.isEmpty()) {
         qWarning("AGENT: %s: script return error", Q_FUNC_INFO);
-        thread->channelWithMonkey()->sendCommand(
-            PacketTypeForMonkey::ScriptError, errMsg);
+        thread->sendCommand(PacketTypeForMonkey::ScriptError, errMsg);
     } else {
         DBGPRINT("%s: sync with gui", Q_FUNC_INFO);
         // if all ok, sync with gui, so user recieve all events
         // before script exit, add timeout for special case:
         // if it is short configure script before main, and program
-        // starts with modal dialog
-        runCodeInGuiThreadSyncWithTimeout(
-            [] {
-                qt_monkey_common::processEventsFor(300 /*ms*/);
-                DBGPRINT("%s: wait done", Q_FUNC_INFO);
-                return QString();
-            },
-            10 * 1000);
+        // starts with modal dialog, do not wait longer than before
+        waitForGuiIdle(maxScriptEndIdleWaitMs);
+        DBGPRINT("%s: wait done", Q_FUNC_INFO);
     }
     DBGPRINT("%s: report about script end", Q_FUNC_INFO);
-    thread->channelWithMonkey()->sendCommand(PacketTypeForMonkey::ScriptEnd,
-                                             QString());
+    thread->sendCommand(PacketTypeForMonkey::ScriptEnd, QString());
 }
 
 void Agent::sendToLog(QString msg)
 {
     DBGPRINT("%s: msg %s", Q_FUNC_INFO, qPrintable(msg));
     GET_THREAD(thread)
-    thread->channelWithMonkey()->sendCommand(PacketTypeForMonkey::ScriptLog,
-                                             std::move(msg));
+    thread->sendCommand(PacketTypeForMonkey::ScriptLog, std::move(msg));
 }
 
 void Agent::scriptCheckPoint()
 {
-    assert(QThread::currentThread() == thread_);
+    assert(QThread::currentThread() == scriptThread_);
     assert(curScriptRunner_ != nullptr);
+    if (scriptHalted()) {
+        curScriptRunner_->abort();
+        return;
+    }
     const int lineno = curScriptRunner_->currentLineNum();
     DBGPRINT("%s: lineno %d", Q_FUNC_INFO, lineno);
     if (scriptTracingMode_)
@@ -298,116 +518,147 @@ void Agent::scriptCheckPoint()
 
 QString Agent::runCodeInGuiThreadSync(std::function<QString()> func)
 {
-    assert(QThread::currentThread() == thread_);
-    QString res;
-    QCoreApplication::postEvent(this,
-                                new FuncEvent(eventType_, [func, this, &res] {
-                                    res = func();
-                                    guiRunSem_.release();
-                                }));
-    guiRunSem_.acquire();
-    return res;
-}
-
-void Agent::customEvent(QEvent *event)
-{
-    assert(QThread::currentThread() != thread_);
-    if (event->type() != eventType_)
-        return;
-    static_cast<FuncEvent *>(event)->exec();
+    assert(QThread::currentThread() == scriptThread_);
+    if (scriptHalted())
+        return T_("Script halted");
+    std::shared_ptr<RunningAction> action{new RunningAction};
+    // func is not touched after cancel, so it is safe to use reference
+    guiCalls_->call([&func, action] {
+        if (action->started.exchange(true))
+            return; // canceled
+        action->res = func();
+        action->done = true;
+        action->released.set();
+    });
+    setWaitingAction(action);
+    action->released.wait();
+    setWaitingAction(nullptr);
+    if (!action->done)
+        return T_("Script halted");
+    return action->res;
 }
 
 void Agent::throwScriptError(QString msg)
 {
-    assert(QThread::currentThread() == thread_);
+    assert(QThread::currentThread() == scriptThread_);
     assert(curScriptRunner_ != nullptr);
     curScriptRunner_->throwError(std::move(msg));
 }
 
+struct Agent::RunningAction final {
+    //! set when action started in GUI thread or canceled
+    std::atomic<bool> started{false};
+    //! set when action done
+    std::atomic<bool> done{false};
+    //! set when action done or it starts new event loop
+    Completion released;
+    QString res;
+};
+
 QString Agent::runCodeInGuiThreadSyncWithTimeout(std::function<QString()> func,
                                                  int timeoutSecs)
 {
-    assert(QThread::currentThread() == thread_);
-    QWidget *wasDialog = nullptr;
-    runCodeInGuiThreadSync([&wasDialog] {
-        wasDialog = qApp->activeModalWidget();
-        return QString();
+    assert(QThread::currentThread() == scriptThread_);
+    std::shared_ptr<RunningAction> action{new RunningAction};
+    guiCalls_->call([this, func, action] {
+        if (action->started.exchange(true))
+            return; // canceled
+        runningActions_.push_back(action);
+        QString res = func();
+        assert(!runningActions_.empty() && runningActions_.back() == action);
+        runningActions_.pop_back();
+        action->res = std::move(res);
+        action->done = true;
+        action->released.set();
     });
 
-    std::shared_ptr<Semaphore> waitSem{new Semaphore{0}};
-    std::shared_ptr<QString> res{new QString};
-    qApp->postEvent(this, new FuncEvent(eventType_, [func, waitSem, res] {
-                        *res = func();
-                        waitSem->release();
-                    }));
-
-    // make sure that prev event was handled
-    std::shared_ptr<Semaphore> syncSem{new Semaphore{0}};
-    qApp->postEvent(this, new FuncEvent(eventType_, [this, syncSem] {
-                        syncSem->release();
-                        qApp->sendPostedEvents(this, eventType_);
-                        syncSem->release();
-                    }));
-    syncSem->acquire();
-    const int timeoutMsec = timeoutSecs * 1000;
-    const int waitIntervalMsec = 100;
-    const int N = timeoutMsec / waitIntervalMsec + 1;
-    int attempt;
-    for (attempt = 0; attempt < N / 2; ++attempt) {
-        if (syncSem->tryAcquire(1, std::chrono::milliseconds(waitIntervalMsec)))
-            break;
+    setWaitingAction(action);
+    const auto waitInterval = std::chrono::milliseconds(100);
+    const auto deadline
+        = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSecs);
+    while (!action->released.waitFor(waitInterval)) {
+        if (!action->started
+            && std::chrono::steady_clock::now() >= deadline) {
+            DBGPRINT("%s: timeout occuire", Q_FUNC_INFO);
+            setWaitingAction(nullptr);
+            return QString();
+        }
         qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
     }
-
-    QWidget *nowDialog = nullptr;
-    runCodeInGuiThreadSync([&nowDialog] {
-        nowDialog = qApp->activeModalWidget();
+    setWaitingAction(nullptr);
+    if (!action->done && scriptHalted())
+        return T_("Script halted");
+    if (!action->done) {
+        DBGPRINT("%s: action started new event loop", Q_FUNC_INFO);
         return QString();
-    });
-
-    for (unsigned int iter = 0; nowDialog == wasDialog; ++iter) {
-        if (waitSem->tryAcquire(1,
-                                std::chrono::milliseconds(waitIntervalMsec))) {
-            return *res;
-        }
-        if ((iter % 10) == 0) {
-            nowDialog = nullptr;
-            runCodeInGuiThreadSync([&nowDialog] {
-                nowDialog = qApp->activeModalWidget();
-                return QString();
-            });
-            DBGPRINT("%s: wasDialog %p, nowDialog %p, attempt %d", Q_FUNC_INFO,
-                     wasDialog, nowDialog, attempt);
-        }
     }
+    return action->res;
+}
 
-    for (; attempt < N; ++attempt) {
-        if (waitSem->tryAcquire(1, std::chrono::milliseconds(waitIntervalMsec)))
-            return *res;
-        qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
+void Agent::cancelAction(RunningAction &action)
+{
+    if (!action.started.exchange(true))
+        action.released.set();
+}
+
+void Agent::setWaitingAction(std::shared_ptr<RunningAction> action)
+{
+    assert(QThread::currentThread() == scriptThread_);
+    auto waitingAction = waitingAction_.get();
+    *waitingAction = std::move(action);
+    // halt may happen before we set action
+    if (*waitingAction != nullptr && scriptHalted())
+        cancelAction(**waitingAction);
+}
+
+void Agent::nestedEventLoopStarted()
+{
+    assert(QThread::currentThread() != scriptThread_);
+    for (const std::shared_ptr<RunningAction> &action : runningActions_)
+        action->released.set();
+}
+
+void Agent::onGuiThreadAboutToBlock()
+{
+    guiIdle_->aboutToBlock();
+    // GUI thread is inside action, so it is not the main event loop
+    if (!runningActions_.empty()) {
+        DBGPRINT("%s: new event loop inside action", Q_FUNC_INFO);
+        nestedEventLoopStarted();
     }
-    DBGPRINT("%s: timeout occuire", Q_FUNC_INFO);
-    return QString();
+}
+
+void Agent::guiActivity(QObject *obj, QEvent *event)
+{
+    guiIdle_->eventSeen(obj, event);
+}
+
+void Agent::setIdleWindowMs(int ms) { guiIdle_->setIdleWindowMs(ms); }
+
+bool Agent::waitForGuiIdle(int timeoutMs)
+{
+    return guiIdle_->waitForIdle(timeoutMs,
+                                 [this] { return scriptHalted(); });
 }
 
 void Agent::onAppAboutToQuit()
 {
     qDebug("%s: begin", Q_FUNC_INFO);
-    assert(QThread::currentThread() != thread_);
+    assert(QThread::currentThread() != scriptThread_);
     GET_THREAD(thread)
-    thread->channelWithMonkey()->sendCommand(PacketTypeForMonkey::Close,
-                                             QString());
-    while (!thread->channelWithMonkey()->hasCloseAck()) {
+    if (!thread->waitReady())
+        return;
+    thread->sendCommand(PacketTypeForMonkey::Close, QString());
+    while (!thread->isFinished() && !thread->hasCloseAck()) {
         qt_monkey_common::processEventsFor(300 /*ms*/);
     }
 }
 
 void Agent::onScriptLog(const QString &msg)
 {
-    assert(QThread::currentThread() != thread_);
+    assert(QThread::currentThread() != scriptThread_);
     GET_THREAD(thread)
-    thread->channelWithMonkey()->sendCommand(PacketTypeForMonkey::ScriptLog,
-                                             msg);
+    thread->sendCommand(PacketTypeForMonkey::ScriptLog, msg);
 }
 
 void Agent::saveScreenshots(const QString &path, int nSteps)
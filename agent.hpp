@@ -2,7 +2,10 @@
 
 #include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include <QKeySequence>
 #include <QtCore/QEvent>
@@ -26,6 +29,9 @@ namespace Private
 class Script;
 class ScriptRunner;
 class MacMenuActionWatcher;
+class WidgetsIndex;
+class GuiCallQueue;
+class GuiIdleTracker;
 } // namespace Private
 /**
  * This class is used as agent inside user's program
@@ -61,32 +67,62 @@ public:
     //! called from script code for break point purposes
     void scriptCheckPoint();
 
-    //@{
     /**
      * Run function in GUI thread, and wait it completition
      * @param func function to run inside GUI thread
      * @return error message if error appear or empty string if all ok
      */
     QString runCodeInGuiThreadSync(std::function<QString()> func);
+    /**
+     * Run function in GUI thread, and wait it completition or start of
+     * new event loop inside it (for example modal dialog)
+     * @param func function to run inside GUI thread
+     * @param timeoutSecs how long to wait start of function execution
+     * @return error message if error appear or empty string if all ok
+     * or new event loop started
+     */
     QString runCodeInGuiThreadSyncWithTimeout(std::function<QString()> func,
                                               int timeoutSecs);
-    //@}
     //! throw exception inside script
     void throwScriptError(QString msg);
     void setDemonstrationMode(bool val) { demonstrationMode_ = val; }
     bool demonstrationMode() const { return demonstrationMode_; }
     void setTraceEnabled(bool val) { scriptTracingMode_ = val; }
     void saveScreenshots(const QString &path, int nSteps);
+    /**
+     * Set for how long GUI thread should be without any events
+     * to be considered idle
+     */
+    void setIdleWindowMs(int ms);
+    /**
+     * Wait until GUI thread processed all posted events, timers with zero
+     * interval, paint events and so on, and after that there was
+     * no events except ticks of periodic timers during idle window
+     * @param timeoutMs how long to wait
+     * @return false if GUI was not idle during timeoutMs
+     */
+    bool waitForGuiIdle(int timeoutMs);
+    //! is current script halted by monkey, can be called from any thread
+    bool scriptHalted() const
+    {
+        const uint64_t cur = curScript_.load();
+        return cur != 0 && haltedScript_.load() == cur;
+    }
     static Agent *instance() { return gAgent_; }
+    //! index of application's widgets, should be used only in GUI thread
+    Private::WidgetsIndex &widgetsIndex() { return *widgetsIndex_; }
 private slots:
     void onUserEventInScriptForm(const QString &);
     void onCommunicationError(const QString &);
     void onRunScriptCommand(const qt_monkey_agent::Private::Script &);
+    void onHaltScriptCommand();
     void onAppAboutToQuit();
     void onScriptLog(const QString &);
+    void onGuiThreadAboutToBlock();
 
 private:
     friend class Private::MacMenuActionWatcher;
+    friend class UserEventsAnalyzer;
     friend class ScriptAPI;
 
     struct CurrentScriptContext final {
@@ -103,11 +139,28 @@ private:
         Private::ScriptRunner *&global_;
     };
 
+    std::unique_ptr<Private::WidgetsIndex> widgetsIndex_;
     qt_monkey_agent::UserEventsAnalyzer *eventAnalyzer_ = nullptr;
+    //! thread for communication with monkey
     QThread *thread_ = nullptr;
+    //! thread where scripts are executed
+    QThread *scriptThread_ = nullptr;
     Private::ScriptRunner *curScriptRunner_ = nullptr;
-    QEvent::Type eventType_;
-    qt_monkey_common::Semaphore guiRunSem_{0};
+    std::unique_ptr<Private::GuiCallQueue> guiCalls_;
+    struct RunningAction;
+    //! actions started by runCodeInGuiThreadSyncWithTimeout, used only
+    //! in GUI thread
+    std::vector<std::shared_ptr<RunningAction>> runningActions_;
+    //! action which script thread is waiting now
+    qt_monkey_common::SharedResource<std::shared_ptr<RunningAction>>
+        waitingAction_;
+    //! number of the last script that we get from monkey, starts from 1
+    std::atomic<uint64_t> lastQueuedScript_{0};
+    //! number of script that monkey asks to halt
+    std::atomic<uint64_t> haltedScript_{0};
+    //! number of running script or 0
+    std::atomic<uint64_t> curScript_{0};
+    std::unique_ptr<Private::GuiIdleTracker> guiIdle_;
     PopulateScriptContext populateScriptContextCallback_;
     static Agent *gAgent_;
     std::atomic<bool> demonstrationMode_{false};
@@ -117,6 +170,16 @@ private:
     qt_monkey_common::SharedResource<std::pair<QString, int>> screenshots_;
     QString scriptBaseName_;
 
-    void customEvent(QEvent *event) override;
+    //! called in script thread
+    void runScript(const Private::Script &script, uint64_t scriptNo);
+    //! halt script with such number, if it is running or will be run
+    void haltScript(uint64_t scriptNo);
+    //! release waiter of action, if action not started yet
+    static void cancelAction(RunningAction &action);
+    void setWaitingAction(std::shared_ptr<RunningAction> action);
+    //! release waiters of running actions, called in GUI thread
+    void nestedEventLoopStarted();
+    //! called for every event in GUI thread
+    void guiActivity(QObject *obj, QEvent *event);
 };
 } // namespace qt_monkey_agent
@@ -1,20 +1,29 @@
 //#define DEBUG_AGENT_QTMONKEY_COMMUNICATION
 #include "agent_qtmonkey_communication.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <limits>
 #include <type_traits>
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QMetaObject>
 #include <QtCore/QString>
+#include <QtCore/QStringList>
 #include <QtCore/QThread>
-#include <QtCore/QTimerEvent>
 
 #include "common.hpp"
 #include "script.hpp"
 
 using namespace qt_monkey_agent::Private;
+using qt_monkey_common::ShmRing;
 
 static const char QTMONKEY_PORT_ENV_NAME[] = "QTMONKEY_PORT";
+static const char QTMONKEY_SOCKET_ENV_NAME[] = "QTMONKEY_SOCKET";
+static const char QTMONKEY_TRANSPORT_ENV_NAME[] = "QTMONKEY_TRANSPORT";
 
 #ifdef DEBUG_AGENT_QTMONKEY_COMMUNICATION
 #define DBGPRINT(fmt, ...) qDebug(fmt, __VA_ARGS__)
@@ -31,72 +40,419 @@ static const uint32_t magicNumber = 0x12345678u;
 
 enum class PacketState { Damaged, NotReady, Ready };
 
-static PacketState calcPacketState(const QByteArray &buf)
+static const size_t headerSize
+    = sizeof(magicNumber) + sizeof(uint32_t) + sizeof(uint32_t);
+//! bigger packets treated as damaged
+static const uint32_t maxPacketSize = 1024 * 1024;
+//! bigger messages sent in several packets
+static const uint32_t maxChunkSize = 64 * 1024;
+//! set in type of packet, if next packet continues the same message
+static const uint32_t moreChunksFlag = 0x80000000u;
+
+static PacketState calcPacketState(const RecvBuffer &buf)
 {
-    if (static_cast<size_t>(buf.size()) < sizeof(magicNumber))
+    if (buf.size() < sizeof(magicNumber))
         return PacketState::NotReady;
     std::remove_const<decltype(magicNumber)>::type curMagicNumber;
-    std::memcpy(&curMagicNumber, buf.constData(), sizeof(curMagicNumber));
+    std::memcpy(&curMagicNumber, buf.data(), sizeof(curMagicNumber));
     if (curMagicNumber != magicNumber)
         return PacketState::Damaged;
     uint32_t packetType;
     uint32_t packetSize;
-    const size_t headerSize
-        = sizeof(magicNumber) + sizeof(packetType) + sizeof(packetSize);
-    if (static_cast<size_t>(buf.size()) < headerSize)
+    if (buf.size() < headerSize)
         return PacketState::NotReady;
     std::memcpy(&packetSize,
-                buf.constData() + sizeof(magicNumber) + sizeof(packetType),
+                buf.data() + sizeof(magicNumber) + sizeof(packetType),
                 sizeof(packetSize));
-    if (packetSize > (1024 * 1024))
+    if (packetSize > maxPacketSize)
         return PacketState::Damaged;
-    if (static_cast<size_t>(buf.size()) < (packetSize + headerSize))
+    if (buf.size() < (packetSize + headerSize))
         return PacketState::NotReady;
     return PacketState::Ready;
 }
 
-static QByteArray createPacket(uint32_t packetType, const QString &text)
+static void writePacketHeader(char *dst, uint32_t packetType,
+                              uint32_t packetSize)
+{
+    std::memcpy(dst, &magicNumber, sizeof(magicNumber));
+    std::memcpy(dst + sizeof(magicNumber), &packetType, sizeof(packetType));
+    std::memcpy(dst + sizeof(magicNumber) + sizeof(packetType), &packetSize,
+                sizeof(packetSize));
+}
+
+static bool isHighSurrogate(uint c) { return (c & 0xFC00u) == 0xD800u; }
+static bool isLowSurrogate(uint c) { return (c & 0xFC00u) == 0xDC00u; }
+
+//! size of text in UTF-8, broken surrogate pair takes 3 bytes of U+FFFD
+static size_t utf8Size(const QString &text)
+{
+    size_t res = 0;
+    const ushort *p = text.utf16();
+    const ushort *end = p + text.size();
+    for (; p != end; ++p) {
+        if (*p < 0x80u) {
+            res += 1;
+        } else if (*p < 0x800u) {
+            res += 2;
+        } else if (isHighSurrogate(*p) && p + 1 != end
+                   && isLowSurrogate(p[1])) {
+            res += 4;
+            ++p;
+        } else {
+            res += 3;
+        }
+    }
+    return res;
+}
+
+/**
+ * Encode characters to UTF-8 while they fit to room bytes,
+ * so character never split between two packets
+ * @param p first character to encode, after return points to the first
+ * not encoded one
+ * @return number of written bytes
+ */
+static size_t encodeUtf8(const ushort *&p, const ushort *end, char *dst,
+                         size_t room)
 {
+    char *const begin = dst;
+    for (; p != end; ++p) {
+        uint c = *p;
+        const bool pair
+            = isHighSurrogate(c) && p + 1 != end && isLowSurrogate(p[1]);
+        const size_t n = c < 0x80u ? 1 : c < 0x800u ? 2 : pair ? 4 : 3;
+        if (static_cast<size_t>(dst - begin) + n > room)
+            break;
+        if (n == 1) {
+            *dst++ = static_cast<char>(c);
+        } else if (n == 2) {
+            *dst++ = static_cast<char>(0xC0u | (c >> 6));
+            *dst++ = static_cast<char>(0x80u | (c & 0x3Fu));
+        } else if (n == 4) {
+            ++p;
+            c = 0x10000u + ((c - 0xD800u) << 10) + (*p - 0xDC00u);
+            *dst++ = static_cast<char>(0xF0u | (c >> 18));
+            *dst++ = static_cast<char>(0x80u | ((c >> 12) & 0x3Fu));
+            *dst++ = static_cast<char>(0x80u | ((c >> 6) & 0x3Fu));
+            *dst++ = static_cast<char>(0x80u | (c & 0x3Fu));
+        } else {
+            if (isHighSurrogate(c) || isLowSurrogate(c))
+                c = 0xFFFDu;
+            *dst++ = static_cast<char>(0xE0u | (c >> 12));
+            *dst++ = static_cast<char>(0x80u | ((c >> 6) & 0x3Fu));
+            *dst++ = static_cast<char>(0x80u | (c & 0x3Fu));
+        }
+    }
+    return static_cast<size_t>(dst - begin);
+}
+
+/**
+ * Text encoded to UTF-8 directly inside packets, without intermediate
+ * buffer. Big text split to several packets, all except last one
+ * marked with moreChunksFlag
+ * @param chunkSize maximum size of payload in one packet
+ */
+static QByteArray createPacket(uint32_t packetType, const QString &text,
+                               uint32_t chunkSize = maxPacketSize)
+{
+    assert((packetType & moreChunksFlag) == 0);
+    assert(chunkSize >= 4);
+    const size_t payloadSize = utf8Size(text);
+    // chunk ends on boundary of character, so it may be shorter
+    // then chunkSize up to 3 bytes
+    const size_t maxChunks = std::max<size_t>(
+        1, (payloadSize + chunkSize - 4) / (chunkSize - 3));
     QByteArray res;
-    uint32_t packetSize;
-    const size_t headerSize
-        = sizeof(magicNumber) + sizeof(packetType) + sizeof(packetSize);
-    res.reserve(headerSize + text.length());
-    res.resize(headerSize);
-    res.append(text.toUtf8());
-    packetSize = res.size() - headerSize;
-    std::memcpy(res.data(), &magicNumber, sizeof(magicNumber));
-    std::memcpy(res.data() + sizeof(magicNumber), &packetType,
-                sizeof(packetType));
-    std::memcpy(res.data() + sizeof(magicNumber) + sizeof(packetType),
-                &packetSize, sizeof(packetSize));
+    res.resize(static_cast<int>(maxChunks * headerSize + payloadSize));
+    const ushort *p = text.utf16();
+    const ushort *end = p + text.size();
+    char *dst = res.data();
+    do {
+        const size_t size = encodeUtf8(p, end, dst + headerSize, chunkSize);
+        writePacketHeader(dst, p == end ? packetType
+                                        : packetType | moreChunksFlag,
+                          static_cast<uint32_t>(size));
+        dst += headerSize + size;
+    } while (p != end);
+    res.resize(static_cast<int>(dst - res.constData()));
     return res;
 }
 
-static std::pair<uint32_t, QString> extractFromPacket(QByteArray &buf)
+//! peer without CapChunkedMessages can not receive message bigger
+//! then one packet, so there is no sense to split it to small parts
+static uint32_t chunkSizeFor(uint32_t capabilities)
+{
+    return (capabilities & CapChunkedMessages) != 0 ? maxChunkSize
+                                                    : maxPacketSize;
+}
+
+//! capabilities that this version of agent and monkey supports
+static const uint32_t supportedCapabilities
+    = CapChunkedMessages | CapSharedMemory | CapInternedIds;
+
+static QString createHello(uint32_t capabilities)
+{
+    return QStringLiteral("%1 %2").arg(protocolVersion).arg(capabilities);
+}
+
+static bool parseHello(const QString &text, uint32_t &version,
+                       uint32_t &capabilities)
+{
+    const QStringList parts = text.split(QLatin1Char(' '));
+    if (parts.size() < 2)
+        return false;
+    bool versionOk = false, capabilitiesOk = false;
+    version = parts[0].toUInt(&versionOk);
+    capabilities = parts[1].toUInt(&capabilitiesOk);
+    return versionOk && capabilitiesOk;
+}
+
+//! shorter ids are cheaper to send as is
+static const int minInternedIdSize = 16;
+//! limit memory used for ids on both sides
+static const int maxInternedIds = 4096;
+
+/**
+ * Find widget id in recorded event, like Test.mouseClick('id', ...)
+ * @return false if there is no id
+ */
+static bool findWidgetId(const QString &script, int &begin, int &end)
+{
+    begin = script.indexOf(QLatin1String("('"));
+    if (begin == -1)
+        return false;
+    begin += 2;
+    end = script.indexOf(QLatin1Char('\''), begin);
+    return end != -1;
+}
+
+/**
+ * Agent counts position of id in UTF-16 units of QString
+ * @return offset of the same position in UTF-8 text, or -1
+ * if text is shorter
+ */
+static int utf8Offset(const QByteArray &text, int utf16Pos)
+{
+    if (utf16Pos < 0)
+        return -1;
+    int offset = 0;
+    for (int units = 0; units < utf16Pos; ++offset) {
+        if (offset >= text.size())
+            return -1;
+        const unsigned char c = static_cast<unsigned char>(text[offset]);
+        // characters outside of BMP take two units in UTF-16
+        if ((c & 0xc0) != 0x80)
+            units += c >= 0xf0 ? 2 : 1;
+    }
+    // skip rest of last character
+    while (offset < text.size() && (text[offset] & 0xc0) == 0x80)
+        ++offset;
+    return offset;
+}
+
+//! packet inside RecvBuffer, valid until next change of buffer
+struct PacketView final {
+    uint32_t type;
+    const char *payload;
+    uint32_t size;
+
+    QByteArray bytes() const
+    {
+        return QByteArray(payload, static_cast<int>(size));
+    }
+};
+
+//! buffer should contain ready packet, it is marked as read
+static PacketView extractFromPacket(RecvBuffer &buf)
 {
     assert(calcPacketState(buf) == PacketState::Ready);
-    uint32_t packetType;
-    std::memcpy(&packetType, buf.constData() + sizeof(magicNumber),
-                sizeof(packetType));
-    uint32_t packetSize;
-    std::memcpy(&packetSize,
-                buf.constData() + sizeof(magicNumber) + sizeof(packetType),
-                sizeof(packetSize));
-    const size_t headerSize
-        = sizeof(magicNumber) + sizeof(packetType) + sizeof(packetSize);
-    assert((packetSize + headerSize) <= static_cast<size_t>(buf.size()));
-    std::pair<uint32_t, QString> res{
-        packetType,
-        QString::fromUtf8(buf.constData() + headerSize, packetSize)};
-    buf.remove(0, headerSize + packetSize);
+    PacketView res;
+    std::memcpy(&res.type, buf.data() + sizeof(magicNumber),
+                sizeof(res.type));
+    std::memcpy(&res.size,
+                buf.data() + sizeof(magicNumber) + sizeof(res.type),
+                sizeof(res.size));
+    assert((res.size + headerSize) <= buf.size());
+    res.payload = buf.data() + headerSize;
+    // data is not touched by consume, so view is still valid
+    buf.consume(headerSize + res.size);
     return res;
 }
+
+enum class MessageState { NotReady, Ready, TooBig };
+
+/**
+ * Add packet to message
+ * @param text whole text of message, if it is complete
+ * @return Ready if message is complete, TooBig if message exceeds
+ * maxMessageSize, the rest of such message is skipped
+ */
+static MessageState assembleMessage(const PacketView &packet,
+                                    MessageAssembler &message,
+                                    QByteArray &text)
+{
+    const bool last = (packet.type & moreChunksFlag) == 0;
+    if (last && message.isEmpty()) {
+        text = packet.bytes();
+        return MessageState::Ready;
+    }
+    if (!message.append(packet.payload, packet.size)) {
+        if (last)
+            message.clear();
+        return MessageState::TooBig;
+    }
+    if (!last)
+        return MessageState::NotReady;
+    const bool skipped = message.isSkipped();
+    text = message.take();
+    return skipped ? MessageState::NotReady : MessageState::Ready;
+}
+
+static bool isConnected(const QIODevice &sock)
+{
+    if (auto tcpSock = qobject_cast<const QAbstractSocket *>(&sock))
+        return tcpSock->state() == QAbstractSocket::ConnectedState;
+    assert(qobject_cast<const QLocalSocket *>(&sock) != nullptr);
+    return static_cast<const QLocalSocket &>(sock).state()
+           == QLocalSocket::ConnectedState;
+}
+
+static void flushSocket(QIODevice &sock)
+{
+    if (auto tcpSock = qobject_cast<QAbstractSocket *>(&sock)) {
+        tcpSock->flush();
+    } else {
+        assert(qobject_cast<QLocalSocket *>(&sock) != nullptr);
+        static_cast<QLocalSocket &>(sock).flush();
+    }
+}
+
+//! read all available data from socket to buffer
+static qint64 readToBuffer(QIODevice &dev, RecvBuffer &buf)
+{
+    const qint64 nBytes = dev.bytesAvailable();
+    if (nBytes <= 0) {
+        qWarning("%s: no data availabile: %lld\n", Q_FUNC_INFO,
+                 static_cast<long long>(nBytes));
+        return 0;
+    }
+    const qint64 readBytes
+        = dev.read(buf.prepareWrite(static_cast<size_t>(nBytes)), nBytes);
+    if (readBytes > 0)
+        buf.commitWrite(static_cast<size_t>(readBytes));
+    return readBytes;
+}
+
+//! do not put more data to socket's buffer, see CommunicationAgentPart
+static const qint64 maxSocketWriteBuffer = 256 * 1024;
+//! maximum time to wait until agent's send buffer drained
+static const std::chrono::seconds maxBlockTime{1};
+
+//! size of ring for one direction
+static const uint32_t ringCapacity = 1024 * 1024;
+
+static size_t sharedMemorySize()
+{
+    return 2 * ShmRing::memorySize(ringCapacity);
+}
+
+//! @return ring from monkey to agent and ring from agent to monkey
+static std::pair<ShmRing *, ShmRing *> ringsInSharedMemory(QSharedMemory &shm,
+                                                           bool init)
+{
+    char *mem = static_cast<char *>(shm.data());
+    return {new ShmRing(mem, ringCapacity, init),
+            new ShmRing(mem + ShmRing::memorySize(ringCapacity), ringCapacity,
+                        init)};
+}
+
+//! read all available data from ring to buffer
+//! @return true if writer waits free space in ring
+static bool readToBuffer(ShmRing &ring, RecvBuffer &buf)
+{
+    bool wakeUpWriter = false;
+    for (;;) {
+        const size_t n = std::max<size_t>(ring.available(), 4096);
+        bool wakeUp;
+        const size_t readBytes = ring.read(buf.prepareWrite(n), n, wakeUp);
+        buf.commitWrite(readBytes);
+        wakeUpWriter = wakeUpWriter || wakeUp;
+        if (readBytes < n)
+            return wakeUpWriter;
+    }
+}
 } // namespace
 
+char *RecvBuffer::prepareWrite(size_t n)
+{
+    const size_t capacity = static_cast<size_t>(buf_.size());
+    if (capacity - writePos_ < n) {
+        const size_t unread = size();
+        // move only if read part is bigger then unread, so every byte
+        // moved O(1) times in average
+        if (readPos_ > 0 && readPos_ >= unread && capacity - unread >= n) {
+            std::memmove(buf_.data(), buf_.constData() + readPos_, unread);
+            readPos_ = 0;
+            writePos_ = unread;
+        } else {
+            buf_.resize(static_cast<int>(
+                std::max(capacity * 2, writePos_ + n)));
+        }
+    }
+    return buf_.data() + writePos_;
+}
+
+bool MessageAssembler::append(const char *data, size_t n)
+{
+    started_ = true;
+    if (skipped_)
+        return true;
+    if (static_cast<size_t>(text_.size()) + n > maxMessageSize) {
+        // free memory right now, not when the last chunk comes
+        text_ = QByteArray();
+        skipped_ = true;
+        return false;
+    }
+    text_.append(data, static_cast<int>(n));
+    return true;
+}
+
+QByteArray MessageAssembler::take()
+{
+    QByteArray res;
+    res.swap(text_);
+    started_ = false;
+    skipped_ = false;
+    return res;
+}
+
 CommunicationMonkeyPart::CommunicationMonkeyPart(QObject *parent)
-    : QObject(parent), controlSock_{new QTcpServer}
+    : QObject(parent)
 {
+    if (qgetenv(QTMONKEY_TRANSPORT_ENV_NAME) == "local") {
+        // several monkeys may run at the same time
+        static QAtomicInt serverCounter{0};
+        const QString name
+            = QStringLiteral("qtmonkey-%1-%2")
+                  .arg(QCoreApplication::applicationPid())
+                  .arg(serverCounter.fetchAndAddOrdered(1));
+        QLocalServer::removeServer(name);
+        localServer_.reset(new QLocalServer);
+        connect(localServer_.get(), SIGNAL(newConnection()), this,
+                SLOT(handleNewConnection()));
+        if (!localServer_->listen(name))
+            throw std::runtime_error(
+                qPrintable(T_("start listen of local socket failed: %1")
+                               .arg(localServer_->errorString())));
+        envPrefs_ = {QLatin1String(QTMONKEY_SOCKET_ENV_NAME),
+                     localServer_->fullServerName()};
+        DBGPRINT("%s: we listen %s\n", Q_FUNC_INFO,
+                 qPrintable(localServer_->fullServerName()));
+        return;
+    }
+    if (qgetenv(QTMONKEY_TRANSPORT_ENV_NAME) == "shm")
+        createSharedMemory();
+    controlSock_.reset(new QTcpServer);
     connect(controlSock_.get(), SIGNAL(newConnection()), this,
             SLOT(handleNewConnection()));
     if (!controlSock_->listen(QHostAddress::LocalHost))
@@ -108,74 +464,188 @@ CommunicationMonkeyPart::CommunicationMonkeyPart(QObject *parent)
              static_cast<int>(controlSock_->serverPort()));
 }
 
+void CommunicationMonkeyPart::createSharedMemory()
+{
+    static QAtomicInt shmCounter{0};
+    const QString key = QStringLiteral("qtmonkey-shm-%1-%2")
+                            .arg(QCoreApplication::applicationPid())
+                            .arg(shmCounter.fetchAndAddOrdered(1));
+    shm_.reset(new QSharedMemory(key));
+    if (!shm_->create(static_cast<int>(sharedMemorySize()))) {
+        qWarning("%s: can not create shared memory, use tcp: %s", Q_FUNC_INFO,
+                 qPrintable(shm_->errorString()));
+        shm_.reset(nullptr);
+    }
+}
+
 void CommunicationMonkeyPart::handleNewConnection()
 {
     DBGPRINT("%s: begin", Q_FUNC_INFO);
-    curClient_ = controlSock_->nextPendingConnection();
+    if (localServer_ != nullptr) {
+        curClient_ = localServer_->nextPendingConnection();
+        connect(
+            curClient_, SIGNAL(error(QLocalSocket::LocalSocketError)), this,
+            SLOT(localConnectionError(QLocalSocket::LocalSocketError)));
+    } else {
+        curClient_ = controlSock_->nextPendingConnection();
+        connect(curClient_, SIGNAL(error(QAbstractSocket::SocketError)), this,
+                SLOT(connectionError(QAbstractSocket::SocketError)));
+    }
     connect(curClient_, SIGNAL(readyRead()), this,
             SLOT(readDataFromClientSocket()));
     connect(curClient_, SIGNAL(bytesWritten(qint64)), this,
             SLOT(flushSendData()));
     connect(curClient_, SIGNAL(disconnected()), this,
             SLOT(clientDisconnected()));
-    connect(curClient_, SIGNAL(error(QAbstractSocket::SocketError)), this,
-            SLOT(connectionError(QAbstractSocket::SocketError)));
+    agentVersion_ = 0;
+    commonCaps_ = 0;
+    agentUsedRing_ = false;
+    agentIds_.clear();
+    // old agent can not handle new types of packets, so until Hello
+    // from agent only packets of protocol version 0 are sent,
+    // script can be run right now
     emit agentReadyToRunScript();
 }
 
+void CommunicationMonkeyPart::handleHello(const QString &text)
+{
+    uint32_t version, capabilities;
+    if (!parseHello(text, version, capabilities)) {
+        qWarning("%s: bad hello: %s", Q_FUNC_INFO, qPrintable(text));
+        emit error(T_("bad hello from qtmonkey's agent"));
+        return;
+    }
+    agentVersion_ = std::min(version, protocolVersion);
+    commonCaps_ = capabilities & supportedCapabilities;
+    if (shm_ == nullptr)
+        commonCaps_ &= ~static_cast<uint32_t>(CapSharedMemory);
+    DBGPRINT("%s: agent version %u, common capabilities %x", Q_FUNC_INFO,
+             static_cast<unsigned>(version),
+             static_cast<unsigned>(commonCaps_));
+    sendCommand(PacketTypeForAgent::HelloAck, createHello(commonCaps_));
+    if ((commonCaps_ & CapSharedMemory) != 0)
+        useSharedMemory();
+}
+
+void CommunicationMonkeyPart::handleDefineId(const QByteArray &text)
+{
+    const int sep = text.indexOf(' ');
+    bool ok = false;
+    const uint32_t id = text.left(sep).toUInt(&ok);
+    if (sep == -1 || !ok || id != agentIds_.size()) {
+        qWarning("%s: bad id definition: %s", Q_FUNC_INFO, text.constData());
+        emit error(T_("bad id definition from qtmonkey's agent"));
+        return;
+    }
+    agentIds_.push_back(text.mid(sep + 1));
+}
+
+void CommunicationMonkeyPart::handleUserAppEventWithId(const QByteArray &text)
+{
+    const int sep1 = text.indexOf(' ');
+    const int sep2 = text.indexOf(' ', sep1 + 1);
+    bool idOk = false, posOk = false;
+    const uint32_t id = text.left(sep1).toUInt(&idOk);
+    const int pos = text.mid(sep1 + 1, sep2 - sep1 - 1).toInt(&posOk);
+    QByteArray script = text.mid(sep2 + 1);
+    const int offset = posOk ? utf8Offset(script, pos) : -1;
+    if (sep1 == -1 || sep2 == -1 || !idOk || id >= agentIds_.size()
+        || offset == -1) {
+        qWarning("%s: bad event: %s", Q_FUNC_INFO, text.constData());
+        emit error(T_("bad event from qtmonkey's agent"));
+        return;
+    }
+    script.insert(offset, agentIds_[id]);
+    emit newUserAppEvent(script);
+}
+
+void CommunicationMonkeyPart::useSharedMemory()
+{
+    // previous agent may leave some garbage, so init rings every time
+    const auto rings = ringsInSharedMemory(*shm_, true);
+    sendRing_.reset(rings.first);
+    recvRing_.reset(rings.second);
+    sendCommand(PacketTypeForAgent::UseSharedMemory, shm_->key());
+}
+
 void CommunicationMonkeyPart::readDataFromClientSocket()
 {
     assert(curClient_ != nullptr);
     if (curClient_ == nullptr)
         return;
-    const qint64 nBytes = curClient_->bytesAvailable();
-    if (nBytes <= 0) {
-        qWarning("%s: no data availabile: %lld\n", Q_FUNC_INFO,
-                 static_cast<long long>(nBytes));
-        return;
-    }
-    const auto wasSize = recvBuf_.size();
-    recvBuf_.resize(wasSize + nBytes);
-    const qint64 readBytes
-        = curClient_->read(recvBuf_.data() + wasSize, nBytes);
-    if (readBytes <= 0) {
+    const qint64 readBytes = readToBuffer(*curClient_, recvBuf_);
+    if (readBytes < 0) {
         qWarning("%s: read data error", Q_FUNC_INFO);
-        recvBuf_.resize(wasSize);
         emit error(T_("Can not read data from client"));
         return;
     }
-    if (nBytes != readBytes)
-        recvBuf_.resize(wasSize + readBytes);
+    handlePackets(recvBuf_, recvMessage_);
+}
+
+void CommunicationMonkeyPart::handlePackets(RecvBuffer &buf,
+                                            MessageAssembler &message)
+{
     for (;;) {
-        switch (calcPacketState(recvBuf_)) {
+        switch (calcPacketState(buf)) {
         case PacketState::Damaged:
             qWarning("%s: packet damaged", Q_FUNC_INFO);
-            recvBuf_.clear();
+            buf.clear();
+            message.clear();
             emit error(T_("packet from qmonkey's agent damaged"));
             return;
         case PacketState::NotReady:
             /*nothing*/ return;
         case PacketState::Ready: {
-            auto packet = extractFromPacket(recvBuf_);
-            switch (static_cast<PacketTypeForMonkey>(packet.first)) {
+            const PacketView packet = extractFromPacket(buf);
+            QByteArray text;
+            const MessageState state = assembleMessage(packet, message, text);
+            if (state == MessageState::TooBig) {
+                qWarning("%s: message too big", Q_FUNC_INFO);
+                emit error(T_("message from qmonkey's agent too big"));
+                break;
+            }
+            if (state != MessageState::Ready)
+                break;
+            switch (static_cast<PacketTypeForMonkey>(packet.type)) {
             case PacketTypeForMonkey::NewUserAppEvent:
-                emit newUserAppEvent(std::move(packet.second));
+                emit newUserAppEvent(text);
                 break;
             case PacketTypeForMonkey::ScriptError:
-                emit scriptError(std::move(packet.second));
+                emit scriptError(text);
                 break;
             case PacketTypeForMonkey::ScriptEnd:
                 emit scriptEnd();
                 break;
             case PacketTypeForMonkey::ScriptLog:
-                emit scriptLog(std::move(packet.second));
+                emit scriptLog(text);
                 break;
             case PacketTypeForMonkey::Close:
                 sendCommand(PacketTypeForAgent::CloseAck, QString());
                 break;
+            case PacketTypeForMonkey::AgentReady:
+                emit agentReady(text.toLongLong());
+                break;
+            case PacketTypeForMonkey::SharedMemoryAttached:
+                DBGPRINT("%s: agent uses shared memory", Q_FUNC_INFO);
+                // all packets before this one go through socket
+                flushSendData();
+                agentUsesRing_ = sendRing_ != nullptr;
+                break;
+            case PacketTypeForMonkey::RingDoorbell:
+                readFromRing();
+                break;
+            case PacketTypeForMonkey::Hello:
+                handleHello(QString::fromUtf8(text));
+                break;
+            case PacketTypeForMonkey::DefineId:
+                handleDefineId(text);
+                break;
+            case PacketTypeForMonkey::NewUserAppEventWithId:
+                handleUserAppEventWithId(text);
+                break;
             default:
                 qWarning("%s: unknown type of packet from qtmonkey's agent: %u",
-                         Q_FUNC_INFO, static_cast<unsigned>(packet.first));
+                         Q_FUNC_INFO, static_cast<unsigned>(packet.type));
                 emit error(T_("unknown type of packet from qtmonkey's agent"));
                 break;
             }
@@ -184,8 +654,45 @@ void CommunicationMonkeyPart::readDataFromClientSocket()
     }
 }
 
+void CommunicationMonkeyPart::readFromRing()
+{
+    if (recvRing_ == nullptr) {
+        qWarning("%s: doorbell without shared memory", Q_FUNC_INFO);
+        return;
+    }
+    const bool wakeUpWriter = readToBuffer(*recvRing_, ringRecvBuf_);
+    agentUsedRing_ = agentUsedRing_ || !ringRecvBuf_.isEmpty();
+    handlePackets(ringRecvBuf_, ringRecvMessage_);
+    if (wakeUpWriter)
+        ringDoorbell();
+    // may be agent read something and we can write more
+    flushSendData();
+}
+
+void CommunicationMonkeyPart::ringDoorbell()
+{
+    if (curClient_ == nullptr)
+        return;
+    curClient_->write(
+        createPacket(static_cast<uint32_t>(PacketTypeForAgent::RingDoorbell),
+                     QString()));
+    flushSocket(*curClient_);
+}
+
 void CommunicationMonkeyPart::flushSendData()
 {
+    if (agentUsesRing_) {
+        if (sendBuf_.isEmpty())
+            return;
+        bool wakeUpReader;
+        const size_t writen = sendRing_->write(
+            sendBuf_.constData(), static_cast<size_t>(sendBuf_.size()),
+            wakeUpReader);
+        sendBuf_.remove(0, static_cast<int>(writen));
+        if (wakeUpReader)
+            ringDoorbell();
+        return;
+    }
     if (!sendBuf_.isEmpty()) {
         assert(curClient_ != nullptr);
         qint64 writen = curClient_->write(sendBuf_);
@@ -197,7 +704,7 @@ void CommunicationMonkeyPart::flushSendData()
             DBGPRINT("%s: wrote %lld bytes", Q_FUNC_INFO, writen);
         }
         sendBuf_.remove(0, writen);
-        curClient_->flush();
+        flushSocket(*curClient_);
     }
 }
 
@@ -206,7 +713,13 @@ void CommunicationMonkeyPart::clientDisconnected()
     DBGPRINT("%s: begin", Q_FUNC_INFO);
     curClient_ = nullptr;
     recvBuf_.clear();
+    recvMessage_.clear();
     sendBuf_.clear();
+    agentUsesRing_ = false;
+    sendRing_.reset(nullptr);
+    recvRing_.reset(nullptr);
+    ringRecvBuf_.clear();
+    ringRecvMessage_.clear();
 }
 
 void CommunicationMonkeyPart::connectionError(QAbstractSocket::SocketError err)
@@ -219,60 +732,90 @@ void CommunicationMonkeyPart::connectionError(QAbstractSocket::SocketError err)
                    : T_("socket err: %1").arg(static_cast<int>(err)));
 }
 
+void CommunicationMonkeyPart::localConnectionError(
+    QLocalSocket::LocalSocketError err)
+{
+    qWarning("%s: err %d\n", Q_FUNC_INFO, static_cast<int>(err));
+    if (err == QLocalSocket::PeerClosedError)
+        return;
+    emit error((curClient_ != nullptr)
+                   ? curClient_->errorString()
+                   : T_("socket err: %1").arg(static_cast<int>(err)));
+}
+
 void CommunicationMonkeyPart::sendCommand(PacketTypeForAgent pt,
                                           const QString &data)
 {
-    sendBuf_.append(createPacket(static_cast<uint32_t>(pt), data));
+    sendBuf_.append(createPacket(static_cast<uint32_t>(pt), data,
+                                 chunkSizeFor(commonCaps_)));
     flushSendData();
 }
 
 bool CommunicationMonkeyPart::isConnectedState() const
 {
-    return curClient_ != nullptr
-           && curClient_->state() == QAbstractSocket::ConnectedState;
+    return curClient_ != nullptr && isConnected(*curClient_);
 }
 
 void CommunicationMonkeyPart::close()
 {
-    assert(controlSock_.get() != nullptr);
-    if (controlSock_->isListening())
+    assert(controlSock_ != nullptr || localServer_ != nullptr);
+    if (controlSock_ != nullptr && controlSock_->isListening())
         controlSock_->close();
     controlSock_.reset(nullptr);
+    if (localServer_ != nullptr && localServer_->isListening())
+        localServer_->close();
+    localServer_.reset(nullptr);
 }
 
 bool CommunicationAgentPart::connectToMonkey()
 {
-    assert(sock_.state() == QAbstractSocket::UnconnectedState
-           && !timer_.isActive());
-    assert(sock_.thread() == thread());
+    assert(sock_ == nullptr);
     assert(thread() == QThread::currentThread());
-    if (sock_.state() != QAbstractSocket::UnconnectedState) {
+    if (sock_ != nullptr) {
         qWarning("%s: you try connect socket in not inital state\n",
                  Q_FUNC_INFO);
         return false;
     }
 
-    connect(&sock_, SIGNAL(bytesWritten(qint64)), this, SLOT(sendData()));
-    connect(&sock_, SIGNAL(connected()), this, SLOT(sendData()));
-    connect(&sock_, SIGNAL(readyRead()), this, SLOT(readCommands()));
-    connect(&sock_, SIGNAL(error(QAbstractSocket::SocketError)), this,
-            SLOT(connectionError(QAbstractSocket::SocketError)));
-
+    const QByteArray socketName = qgetenv(QTMONKEY_SOCKET_ENV_NAME);
     QByteArray portnoStr = qgetenv(QTMONKEY_PORT_ENV_NAME);
     bool ok = false;
     const unsigned portno = portnoStr.toUInt(&ok);
 
-    if (ok && portno <= 0xFFFFu) {
-        DBGPRINT("%s: portno %d", Q_FUNC_INFO, static_cast<int>(portno));
-        sock_.connectToHost(QHostAddress::LocalHost, portno);
-        timer_.start(200, this);
-        return true;
-    } else {
+    if (socketName.isEmpty() && !(ok && portno <= 0xFFFFu)) {
         qWarning("%s: QTMONKEY_PORT(%s) %s", Q_FUNC_INFO, portnoStr.data(),
                  (portnoStr.length() == 0) ? "not defined"
                                            : "not contain suitable number");
         return false;
     }
+
+    QLocalSocket *localSock = nullptr;
+    QTcpSocket *tcpSock = nullptr;
+    if (!socketName.isEmpty()) {
+        localSock = new QLocalSocket;
+        sock_.reset(localSock);
+        connect(localSock, SIGNAL(error(QLocalSocket::LocalSocketError)), this,
+                SLOT(localConnectionError(QLocalSocket::LocalSocketError)));
+    } else {
+        tcpSock = new QTcpSocket;
+        sock_.reset(tcpSock);
+        connect(tcpSock, SIGNAL(error(QAbstractSocket::SocketError)), this,
+                SLOT(connectionError(QAbstractSocket::SocketError)));
+    }
+    connect(sock_.get(), SIGNAL(bytesWritten(qint64)), this, SLOT(sendData()));
+    connect(sock_.get(), SIGNAL(connected()), this, SLOT(sendData()));
+    connect(sock_.get(), SIGNAL(readyRead()), this, SLOT(readCommands()));
+
+    if (localSock != nullptr) {
+        DBGPRINT("%s: socket %s", Q_FUNC_INFO, socketName.constData());
+        localSock->connectToServer(QFile::decodeName(socketName));
+    } else {
+        DBGPRINT("%s: portno %d", Q_FUNC_INFO, static_cast<int>(portno));
+        tcpSock->connectToHost(QHostAddress::LocalHost, portno);
+    }
+    // the first packet, sent when socket connected
+    sendCommand(PacketTypeForMonkey::Hello, createHello(supportedCapabilities));
+    return true;
 }
 
 bool CommunicationAgentPart::hasCloseAck()
@@ -282,109 +825,383 @@ bool CommunicationAgentPart::hasCloseAck()
 
 void CommunicationAgentPart::readCommands()
 {
-    assert(sock_.state() == QAbstractSocket::ConnectedState);
-    const qint64 nBytes = sock_.bytesAvailable();
-    if (nBytes <= 0) {
-        qWarning("%s: no data availabile: %lld\n", Q_FUNC_INFO,
-                 static_cast<long long>(nBytes));
-        return;
-    }
-    const auto wasSize = recvBuf_.size();
-    recvBuf_.resize(wasSize + nBytes);
-    const qint64 readBytes = sock_.read(recvBuf_.data() + wasSize, nBytes);
-    if (readBytes <= 0) {
+    assert(sock_ != nullptr && isConnected(*sock_));
+    const qint64 readBytes = readToBuffer(*sock_, recvBuf_);
+    if (readBytes < 0) {
         qWarning("%s: read data error", Q_FUNC_INFO);
-        recvBuf_.resize(wasSize);
         emit error(T_("Can not read data from client"));
         return;
     }
-    if (nBytes != readBytes)
-        recvBuf_.resize(wasSize + readBytes);
-    bool done;
-    do {
-        done = true;
-        switch (calcPacketState(recvBuf_)) {
+    handlePackets(recvBuf_, recvMessage_);
+}
+
+void CommunicationAgentPart::handlePackets(RecvBuffer &buf,
+                                           MessageAssembler &message)
+{
+    for (;;) {
+        switch (calcPacketState(buf)) {
         case PacketState::Damaged:
             qWarning("%s: packet damaged", Q_FUNC_INFO);
             emit error(T_("packet for qmonkey's agent damaged"));
-            break;
+            return;
         case PacketState::NotReady:
-            /*nothing*/ break;
+            /*nothing*/ return;
         case PacketState::Ready: {
-            auto packet = extractFromPacket(recvBuf_);
-            done = recvBuf_.isEmpty();
-            switch (static_cast<PacketTypeForAgent>(packet.first)) {
+            const PacketView packet = extractFromPacket(buf);
+            QByteArray bytes;
+            const MessageState state
+                = assembleMessage(packet, message, bytes);
+            if (state == MessageState::TooBig) {
+                qWarning("%s: message too big", Q_FUNC_INFO);
+                emit error(T_("message for qmonkey's agent too big"));
+                break;
+            }
+            if (state != MessageState::Ready)
+                break;
+            const QString text = QString::fromUtf8(bytes);
+            switch (static_cast<PacketTypeForAgent>(packet.type)) {
             case PacketTypeForAgent::RunScript:
                 DBGPRINT("%s: get script: '%s'", Q_FUNC_INFO,
-                         qPrintable(packet.second));
+                         qPrintable(text));
                 if (currentScriptFileName_.isEmpty()) {
-                    emit runScript(Script{std::move(packet.second)});
+                    emit runScript(Script{text});
                 } else {
-                    emit runScript(Script{currentScriptFileName_, 1,
-                                          std::move(packet.second)});
+                    emit runScript(
+                        Script{currentScriptFileName_, 1, text});
                     currentScriptFileName_.clear();
                 }
                 break;
             case PacketTypeForAgent::SetScriptFileName:
+                currentScriptFileName_ = text;
                 DBGPRINT("%s: script file name now '%s'", Q_FUNC_INFO,
-                         qPrintable(packet.second));
-                currentScriptFileName_ = std::move(packet.second);
+                         qPrintable(currentScriptFileName_));
+                break;
+            case PacketTypeForAgent::HaltScript:
+                DBGPRINT("%s: halt script", Q_FUNC_INFO);
+                emit haltScript();
                 break;
             case PacketTypeForAgent::CloseAck:
                 (void)close_ack_.ref();
                 break;
+            case PacketTypeForAgent::UseSharedMemory:
+                attachToSharedMemory(text);
+                break;
+            case PacketTypeForAgent::RingDoorbell:
+                readFromRing();
+                break;
+            case PacketTypeForAgent::HelloAck:
+                handleHelloAck(text);
+                break;
             default:
+                // newer monkey may send something that we do not know,
+                // it is not reason to kill application
                 qWarning("%s: unknown type of packet for qtmonkey's agent: %u",
-                         Q_FUNC_INFO, static_cast<unsigned>(packet.first));
-                emit error(T_("unknown type of packet for qtmonkey's agent"));
+                         Q_FUNC_INFO, static_cast<unsigned>(packet.type));
                 break;
             }
         }
         }
-    } while (!done);
+    }
 }
 
-void CommunicationAgentPart::connectionError(QAbstractSocket::SocketError err)
+void CommunicationAgentPart::handleHelloAck(const QString &text)
 {
-    qWarning("%s: err %d\n", Q_FUNC_INFO, static_cast<int>(err));
-    emit error(sock_.errorString());
+    uint32_t version, capabilities;
+    if (!parseHello(text, version, capabilities)) {
+        qWarning("%s: bad hello ack: %s", Q_FUNC_INFO, qPrintable(text));
+        emit error(T_("bad hello ack from qtmonkey"));
+        return;
+    }
+    DBGPRINT("%s: monkey version %u, common capabilities %x", Q_FUNC_INFO,
+             static_cast<unsigned>(version),
+             static_cast<unsigned>(capabilities));
+    // monkey answers with capabilities that it selected from ours
+    commonCaps_ = capabilities & supportedCapabilities;
 }
 
-void CommunicationAgentPart::timerEvent(QTimerEvent *event)
+void CommunicationAgentPart::attachToSharedMemory(const QString &key)
 {
-    assert(event->timerId() == timer_.timerId());
-    if (event->timerId() != timer_.timerId())
+    DBGPRINT("%s: shared memory %s", Q_FUNC_INFO, qPrintable(key));
+    std::unique_ptr<QSharedMemory> shm{new QSharedMemory(key)};
+    if (!shm->attach()) {
+        qWarning("%s: can not attach to shared memory, use socket: %s",
+                 Q_FUNC_INFO, qPrintable(shm->errorString()));
         return;
+    }
+    if (static_cast<size_t>(shm->size()) < sharedMemorySize()) {
+        qWarning("%s: shared memory too small, use socket", Q_FUNC_INFO);
+        return;
+    }
+    // all packets before this one go through socket,
+    // and packet can not be split between socket and ring
+    writeQueuedData(std::numeric_limits<qint64>::max());
+    const auto rings = ringsInSharedMemory(*shm, false);
+    recvRing_.reset(rings.first);
+    sendRing_.reset(rings.second);
+    shm_ = std::move(shm);
+    sock_->write(createPacket(
+        static_cast<uint32_t>(PacketTypeForMonkey::SharedMemoryAttached),
+        QString()));
+    flushSocket(*sock_);
+}
+
+void CommunicationAgentPart::readFromRing()
+{
+    if (recvRing_ == nullptr) {
+        qWarning("%s: doorbell without shared memory", Q_FUNC_INFO);
+        return;
+    }
+    const bool wakeUpWriter = readToBuffer(*recvRing_, ringRecvBuf_);
+    handlePackets(ringRecvBuf_, ringRecvMessage_);
+    if (wakeUpWriter)
+        ringDoorbell();
+    // may be monkey read something and we can write more
     sendData();
 }
 
+void CommunicationAgentPart::ringDoorbell()
+{
+    sock_->write(
+        createPacket(static_cast<uint32_t>(PacketTypeForMonkey::RingDoorbell),
+                     QString()));
+    flushSocket(*sock_);
+}
+
+void CommunicationAgentPart::connectionError(QAbstractSocket::SocketError err)
+{
+    qWarning("%s: err %d\n", Q_FUNC_INFO, static_cast<int>(err));
+    emit error(sock_->errorString());
+}
+
+void CommunicationAgentPart::localConnectionError(
+    QLocalSocket::LocalSocketError err)
+{
+    qWarning("%s: err %d\n", Q_FUNC_INFO, static_cast<int>(err));
+    emit error(sock_->errorString());
+}
+
 void CommunicationAgentPart::sendData()
+{
+    writeQueuedData(maxSocketWriteBuffer);
+}
+
+void CommunicationAgentPart::writeQueuedData(qint64 socketBufferLimit)
+{
+    // reset before taking data, so packet added after that post new call
+    sendDataPosted_.store(false, std::memory_order_release);
+    if (sock_ == nullptr || !isConnected(*sock_))
+        return;
+    bool wakeUpReader = false;
+    size_t written = 0;
+    for (;;) {
+        QByteArray packet;
+        while (sendQueue_.pop(packet))
+            unsent_.push_back(packet);
+        // like writev: packets are written one by one to socket's buffer
+        // or ring without concatenation, and then there is one flush or
+        // doorbell for all of them
+        while (!unsent_.empty()) {
+            const QByteArray &data = unsent_.front();
+            const char *begin = data.constData() + unsentOffset_;
+            const size_t len = static_cast<size_t>(data.size()) - unsentOffset_;
+            size_t nBytes;
+            if (sendRing_ != nullptr) {
+                bool wakeUp;
+                nBytes = sendRing_->write(begin, len, wakeUp);
+                wakeUpReader = wakeUpReader || wakeUp;
+            } else {
+                // keep data in our queue, instead of socket's buffer,
+                // so we know how much monkey not read yet
+                const qint64 room = socketBufferLimit - sock_->bytesToWrite();
+                if (room <= 0)
+                    break;
+                const qint64 res = sock_->write(
+                    begin, std::min<qint64>(room, static_cast<qint64>(len)));
+                if (res == -1) {
+                    qWarning("%s: write to socket failed %s", Q_FUNC_INFO,
+                             qPrintable(sock_->errorString()));
+                    break;
+                }
+                nBytes = static_cast<size_t>(res);
+            }
+            written += nBytes;
+            queuedBytes_ -= nBytes;
+            unsentOffset_ += nBytes;
+            // the rest will be sent, when monkey read something
+            if (unsentOffset_ < static_cast<size_t>(data.size()))
+                break;
+            unsent_.pop_front();
+            unsentOffset_ = 0;
+        }
+        if (!congested_ || queuedBytes_ > lowWatermark_)
+            break;
+        // it may add report about dropped logs, so one more round
+        endCongestion();
+    }
+    if (sendRing_ != nullptr) {
+        if (wakeUpReader)
+            ringDoorbell();
+    } else if (written > 0) {
+        flushSocket(*sock_);
+    }
+}
+
+void CommunicationAgentPart::endCongestion()
 {
     {
-        auto sendBuf = sendBuf_.get();
-        if (sock_.state() != QAbstractSocket::ConnectedState
-            || sendBuf->isEmpty())
-            return;
-        qint64 nBytes = sock_.write(*sendBuf);
-        if (nBytes == -1) {
-            qWarning("%s: write to socket failed %s", Q_FUNC_INFO,
-                     qPrintable(sock_.errorString()));
+        std::lock_guard<std::mutex> lock{drainedMutex_};
+        congested_ = false;
+    }
+    drained_.notify_all();
+    const uint64_t droppedLogs = droppedLogs_;
+    if (droppedLogs != reportedDroppedLogs_) {
+        pushPacket(createPacket(
+            static_cast<uint32_t>(PacketTypeForMonkey::ScriptLog),
+            T_("qtmonkey: %1 log messages dropped, because qtmonkey_app can "
+               "not read them in time")
+                .arg(droppedLogs - reportedDroppedLogs_)));
+        reportedDroppedLogs_ = droppedLogs;
+    }
+}
+
+void CommunicationAgentPart::waitUntilDrained()
+{
+    ++blockedSends_;
+    std::unique_lock<std::mutex> lock{drainedMutex_};
+    // monkey may hang or die, so not wait forever
+    drained_.wait_for(lock, maxBlockTime, [this] { return !congested_; });
+}
+
+void CommunicationAgentPart::pushPacket(const QByteArray &packet)
+{
+    const size_t size = static_cast<size_t>(packet.size());
+    // count before push, so consumer never see less then it took
+    const size_t queuedBytes = queuedBytes_.fetch_add(size) + size;
+    sendQueue_.push(QByteArray(packet));
+    size_t maxQueuedBytes = maxQueuedBytes_;
+    while (queuedBytes > maxQueuedBytes
+           && !maxQueuedBytes_.compare_exchange_weak(maxQueuedBytes,
+                                                     queuedBytes))
+        ;
+    if (queuedBytes > highWatermark_ && !congested_.exchange(true))
+        qWarning("%s: too many data for monkey %llu bytes", Q_FUNC_INFO,
+                 static_cast<unsigned long long>(queuedBytes));
+}
+
+void CommunicationAgentPart::pushUserAppEvent(const QString &script)
+{
+    const uint32_t chunkSize = chunkSizeFor(commonCaps_);
+    int idBegin, idEnd;
+    if (!findWidgetId(script, idBegin, idEnd)
+        || (idEnd - idBegin) < minInternedIdSize) {
+        pushPacket(createPacket(
+            static_cast<uint32_t>(PacketTypeForMonkey::NewUserAppEvent), script,
+            chunkSize));
+        return;
+    }
+    const QString id = script.mid(idBegin, idEnd - idBegin);
+    uint32_t idNo;
+    bool defined;
+    {
+        auto ids = internedIds_.get();
+        auto it = ids->constFind(id);
+        defined = it != ids->constEnd();
+        idNo = defined ? it.value() : static_cast<uint32_t>(ids->size());
+    }
+    QString rest;
+    rest.reserve(script.size() - (idEnd - idBegin));
+    rest.append(script.leftRef(idBegin));
+    rest.append(script.midRef(idEnd));
+    // packets encoded without lock, if other thread defined some id
+    // in the meantime, they encoded again with new number
+    for (;;) {
+        if (!defined && idNo >= static_cast<uint32_t>(maxInternedIds)) {
+            pushPacket(createPacket(
+                static_cast<uint32_t>(PacketTypeForMonkey::NewUserAppEvent),
+                script, chunkSize));
             return;
         }
-        sendBuf->remove(0, nBytes);
+        const QByteArray event = createPacket(
+            static_cast<uint32_t>(PacketTypeForMonkey::NewUserAppEventWithId),
+            QStringLiteral("%1 %2 ").arg(idNo).arg(idBegin) + rest,
+            chunkSize);
+        if (!defined) {
+            const QByteArray definition = createPacket(
+                static_cast<uint32_t>(PacketTypeForMonkey::DefineId),
+                QStringLiteral("%1 ").arg(idNo) + id, chunkSize);
+            auto ids = internedIds_.get();
+            auto it = ids->constFind(id);
+            if (it != ids->constEnd()) {
+                defined = true;
+                idNo = it.value();
+                continue;
+            }
+            if (static_cast<uint32_t>(ids->size()) != idNo) {
+                idNo = static_cast<uint32_t>(ids->size());
+                continue;
+            }
+            // push before id become visible for other threads,
+            // so definition always goes before usage
+            pushPacket(definition);
+            ids->insert(id, idNo);
+        }
+        pushPacket(event);
+        return;
     }
-    sock_.flush();
 }
 
 void CommunicationAgentPart::sendCommand(PacketTypeForMonkey pt,
                                          const QString &text)
 {
-    sendBuf_.get()->append(createPacket(static_cast<uint32_t>(pt), text));
+    const bool inOwnThread = QThread::currentThread() == thread();
+    if (congested_) {
+        if (pt == PacketTypeForMonkey::ScriptLog) {
+            ++droppedLogs_;
+            droppedLogChars_ += static_cast<uint64_t>(text.size());
+            return;
+        }
+        // only script thread waits for monkey; events recorded in GUI
+        // thread go past high watermark, they come with human speed,
+        // and application should not freeze; this thread sends data,
+        // so it can not wait
+        if (!inOwnThread
+            && (pt == PacketTypeForMonkey::ScriptError
+                || pt == PacketTypeForMonkey::ScriptEnd))
+            waitUntilDrained();
+    }
+    if (pt == PacketTypeForMonkey::NewUserAppEvent
+        && (commonCaps_ & CapInternedIds) != 0)
+        pushUserAppEvent(text);
+    else
+        pushPacket(createPacket(static_cast<uint32_t>(pt), text,
+                                chunkSizeFor(commonCaps_)));
+    if (inOwnThread) {
+        sendData();
+        return;
+    }
+    if (!sendDataPosted_.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, "sendData", Qt::QueuedConnection);
+}
+
+SendQueueStats CommunicationAgentPart::sendQueueStats() const
+{
+    return SendQueueStats{droppedLogs_, droppedLogChars_, blockedSends_,
+                          maxQueuedBytes_};
+}
+
+CommunicationAgentPart::~CommunicationAgentPart()
+{
+    if (droppedLogs_ != 0)
+        qWarning("%s: %llu log messages (%llu characters) were dropped",
+                 Q_FUNC_INFO,
+                 static_cast<unsigned long long>(droppedLogs_.load()),
+                 static_cast<unsigned long long>(droppedLogChars_.load()));
 }
 
 void CommunicationAgentPart::flushSendData()
 {
-    sendData();
-    if (sock_.state() == QAbstractSocket::ConnectedState)
-        sock_.flush();
+    // write all, because there may be no chance to do it later
+    writeQueuedData(std::numeric_limits<qint64>::max());
+    if (sock_ != nullptr && isConnected(*sock_))
+        flushSocket(*sock_);
 }
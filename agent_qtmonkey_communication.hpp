@@ -1,15 +1,27 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <QAtomicInt>
-#include <QtCore/QBasicTimer>
+#include <QtCore/QHash>
 #include <QtCore/QObject>
+#include <QtCore/QSharedMemory>
+#include <QtNetwork/QLocalServer>
+#include <QtNetwork/QLocalSocket>
 #include <QtNetwork/QTcpServer>
 #include <QtNetwork/QTcpSocket>
 
+#include "mpsc_queue.hpp"
 #include "shared_resource.hpp"
+#include "shm_ring.hpp"
 
 namespace qt_monkey_agent
 {
@@ -18,6 +30,18 @@ namespace Private
 
 class Script;
 
+//! version of protocol between agent and monkey, before Hello it was 0
+static const uint32_t protocolVersion = 1;
+
+//! features of protocol, agent and monkey use only common ones
+enum ProtocolCapability : uint32_t {
+    //! messages bigger then one packet
+    CapChunkedMessages = 1u << 0,
+    CapSharedMemory = 1u << 1,
+    //! widget ids in user events replaced with numbers
+    CapInternedIds = 1u << 2,
+};
+
 enum class PacketTypeForAgent : uint32_t {
     RunScript,
     SetScriptFileName,
@@ -26,6 +50,13 @@ enum class PacketTypeForAgent : uint32_t {
     ContinueScript,
     HaltScript,
     CloseAck,
+    //! contains key of shared memory with rings for packets
+    UseSharedMemory,
+    //! there is new data or free space in ring
+    RingDoorbell,
+    //! answer to Hello, contains version of monkey and capabilities
+    //! supported by both sides, old agent never get it
+    HelloAck,
 };
 
 enum class PacketTypeForMonkey : uint32_t {
@@ -36,6 +67,89 @@ enum class PacketTypeForMonkey : uint32_t {
     // TODO: may be need?
     ScriptStopOnBreakPoint,
     Close,
+    //! agent connected, contains time in ms since epoch
+    AgentReady,
+    //! agent attached to shared memory, and sends packets through ring
+    SharedMemoryAttached,
+    //! there is new data or free space in ring
+    RingDoorbell,
+    //! first packet of agent, contains version and capabilities of it,
+    //! monkey not send new types of packets until it get Hello
+    Hello,
+    //! contains number and widget id, that it means
+    DefineId,
+    //! contains number of widget id, position of it and script without it
+    NewUserAppEventWithId,
+};
+
+/**
+ * Buffer for received data with read cursor, so extraction of packet
+ * not shift the rest of data, unread data moved to the begining
+ * only when there is no space at the end and it is cheap enough
+ */
+class RecvBuffer final
+{
+public:
+    //! @return place to write n bytes, should be followed by commitWrite
+    char *prepareWrite(size_t n);
+    //! mark n bytes after previous end of data as valid
+    void commitWrite(size_t n)
+    {
+        assert(writePos_ + n <= static_cast<size_t>(buf_.size()));
+        writePos_ += n;
+    }
+    const char *data() const { return buf_.constData() + readPos_; }
+    size_t size() const { return writePos_ - readPos_; }
+    bool isEmpty() const { return readPos_ == writePos_; }
+    //! mark n bytes from begining of data as read
+    void consume(size_t n)
+    {
+        assert(n <= size());
+        readPos_ += n;
+        if (readPos_ == writePos_)
+            readPos_ = writePos_ = 0;
+    }
+    void clear() { readPos_ = writePos_ = 0; }
+
+private:
+    QByteArray buf_;
+    size_t readPos_ = 0;
+    size_t writePos_ = 0;
+};
+
+/**
+ * UTF-8 text of message, that was sent in several packets. Packet
+ * may end in the middle of character, so message decoded (if needed)
+ * only when it is complete
+ */
+class MessageAssembler final
+{
+public:
+    //! bigger messages are skipped, so peer can not eat all memory
+    static const size_t maxMessageSize = 64 * 1024 * 1024;
+
+    /**
+     * Add part of message
+     * @return false if message became bigger then maxMessageSize,
+     * its text dropped and the rest of it is ignored
+     */
+    bool append(const char *data, size_t n);
+    bool isEmpty() const { return !started_; }
+    //! message was too big, so text of it is not collected
+    bool isSkipped() const { return skipped_; }
+    //! @return whole message and start new one
+    QByteArray take();
+    void clear()
+    {
+        text_.clear();
+        started_ = false;
+        skipped_ = false;
+    }
+
+private:
+    QByteArray text_;
+    bool started_ = false;
+    bool skipped_ = false;
 };
 
 class CommunicationMonkeyPart
@@ -46,14 +160,26 @@ class CommunicationMonkeyPart
 {
     Q_OBJECT
 signals:
-    void newUserAppEvent(QString);
-    void scriptError(QString);
+    // text of events, errors and logs is in UTF-8, as agent sent it,
+    // so it can be passed further without conversation to QString
+    void newUserAppEvent(QByteArray);
+    void scriptError(QByteArray);
     void scriptEnd();
-    void scriptLog(QString);
+    void scriptLog(QByteArray);
     void error(QString);
     void agentReadyToRunScript();
+    //! @param readyTime time in ms since epoch when agent become ready
+    void agentReady(qint64 readyTime);
 
 public:
+    /**
+     * Listen tcp socket on loopback interface, or local socket
+     * (unix domain socket or named pipe) if QTMONKEY_TRANSPORT
+     * environment variable is "local". If it is "shm", then packets
+     * go through rings in shared memory, and tcp socket is used only
+     * to wake up other side, if shared memory is not available
+     * only tcp socket is used
+     */
     explicit CommunicationMonkeyPart(QObject *parent = nullptr);
     void sendCommand(PacketTypeForAgent pt, const QString &);
     bool isConnectedState() const;
@@ -62,19 +188,62 @@ public:
     {
         return envPrefs_;
     }
+    //! @return version of protocol of last connected agent,
+    //! 0 if it not sent Hello yet, or it is too old
+    uint32_t agentProtocolVersion() const { return agentVersion_; }
+    //! capabilities supported by both sides
+    uint32_t commonCapabilities() const { return commonCaps_; }
+    //! last connected agent sent some packets through shared memory
+    bool agentUsedSharedMemory() const { return agentUsedRing_; }
 private slots:
     void handleNewConnection();
     void readDataFromClientSocket();
     void flushSendData();
     void clientDisconnected();
     void connectionError(QAbstractSocket::SocketError);
+    void localConnectionError(QLocalSocket::LocalSocketError);
 
 private:
     std::unique_ptr<QTcpServer> controlSock_;
-    QTcpSocket *curClient_ = nullptr;
+    std::unique_ptr<QLocalServer> localServer_;
+    QIODevice *curClient_ = nullptr;
     QByteArray sendBuf_;
-    QByteArray recvBuf_;
+    RecvBuffer recvBuf_;
+    MessageAssembler recvMessage_;
     std::pair<QString, QString> envPrefs_;
+    std::unique_ptr<QSharedMemory> shm_;
+    std::unique_ptr<qt_monkey_common::ShmRing> sendRing_;
+    std::unique_ptr<qt_monkey_common::ShmRing> recvRing_;
+    RecvBuffer ringRecvBuf_;
+    MessageAssembler ringRecvMessage_;
+    //! agent attached to shared memory, so we can send via ring
+    bool agentUsesRing_ = false;
+    bool agentUsedRing_ = false;
+    uint32_t agentVersion_ = 0;
+    uint32_t commonCaps_ = 0;
+    //! widget ids defined by agent, index is number of id
+    std::vector<QByteArray> agentIds_;
+
+    void createSharedMemory();
+    void handleHello(const QString &text);
+    void handleDefineId(const QByteArray &text);
+    void handleUserAppEventWithId(const QByteArray &text);
+    void useSharedMemory();
+    void handlePackets(RecvBuffer &buf, MessageAssembler &message);
+    void readFromRing();
+    void ringDoorbell();
+};
+
+//! what happened with packets for monkey, when it can not read them in time
+struct SendQueueStats final {
+    //! script logs skipped, because of too many data in queue
+    uint64_t droppedLogs;
+    //! length of dropped logs in UTF-16 units of QString
+    uint64_t droppedLogChars;
+    //! how many times caller waited until queue drained
+    uint64_t blockedSends;
+    //! maximum size of queue in bytes
+    size_t maxQueuedBytes;
 };
 
 class CommunicationAgentPart
@@ -87,12 +256,33 @@ class CommunicationAgentPart
 signals:
     void error(const QString &);
     void runScript(const qt_monkey_agent::Private::Script &);
+    void haltScript();
 
 public:
     explicit CommunicationAgentPart(QObject *parent = nullptr) : QObject(parent)
     {
     }
+    ~CommunicationAgentPart();
+    /**
+     * Add packet to send buffer, can be called from any thread.
+     * Data send immediately if called from thread of this object,
+     * otherwise thread of this object waked up once per burst of packets.
+     * If there is more then high watermark of data in buffer, script logs
+     * are dropped, ScriptError and ScriptEnd wait (if called not from
+     * thread of this object) until it become lower then low watermark,
+     * other packets, like events recorded in GUI thread, are queued
+     */
     void sendCommand(PacketTypeForMonkey pt, const QString &);
+    //! should be called before connectToMonkey
+    void setWatermarks(size_t low, size_t high)
+    {
+        assert(low <= high);
+        lowWatermark_ = low;
+        highWatermark_ = high;
+    }
+    //! can be called from any thread
+    SendQueueStats sendQueueStats() const;
+    //! connect to local socket or tcp port, given by monkey via environment
     bool connectToMonkey();
     void flushSendData();
     bool hasCloseAck();
@@ -101,16 +291,58 @@ private slots:
     void sendData();
     void readCommands();
     void connectionError(QAbstractSocket::SocketError);
+    void localConnectionError(QLocalSocket::LocalSocketError);
 
 private:
-    QTcpSocket sock_;
-    QBasicTimer timer_;
-    qt_monkey_common::SharedResource<QByteArray> sendBuf_;
-    QByteArray recvBuf_;
+    //! QTcpSocket or QLocalSocket
+    std::unique_ptr<QIODevice> sock_;
+    //! ready packets from any thread
+    qt_monkey_common::MpscQueue<QByteArray> sendQueue_;
+    //! packets taken from queue, but not yet written, only in our thread
+    std::deque<QByteArray> unsent_;
+    size_t unsentOffset_ = 0;
+    //! bytes in sendQueue_ and unsent_
+    std::atomic<size_t> queuedBytes_{0};
+    //! sendData already queued to thread of this object
+    std::atomic<bool> sendDataPosted_{false};
+    size_t lowWatermark_ = 1024 * 1024;
+    size_t highWatermark_ = 8 * 1024 * 1024;
+    //! buffer was above high watermark and not yet below low watermark
+    std::atomic<bool> congested_{false};
+    std::mutex drainedMutex_;
+    std::condition_variable drained_;
+    std::atomic<uint64_t> droppedLogs_{0};
+    std::atomic<uint64_t> droppedLogChars_{0};
+    //! dropped logs already reported to monkey
+    uint64_t reportedDroppedLogs_ = 0;
+    std::atomic<uint64_t> blockedSends_{0};
+    std::atomic<size_t> maxQueuedBytes_{0};
+    RecvBuffer recvBuf_;
+    MessageAssembler recvMessage_;
     QString currentScriptFileName_;
     QAtomicInt close_ack_{0};
+    std::unique_ptr<QSharedMemory> shm_;
+    //! rings used only in thread of this object
+    std::unique_ptr<qt_monkey_common::ShmRing> sendRing_;
+    std::unique_ptr<qt_monkey_common::ShmRing> recvRing_;
+    RecvBuffer ringRecvBuf_;
+    MessageAssembler ringRecvMessage_;
+    //! capabilities supported by both sides, used by senders in any thread
+    std::atomic<uint32_t> commonCaps_{0};
+    //! widget ids already sent to monkey, and their numbers,
+    //! events recorded in GUI thread, so there is no contention for it
+    qt_monkey_common::SharedResource<QHash<QString, uint32_t>> internedIds_;
 
-    void timerEvent(QTimerEvent *) override;
+    void handleHelloAck(const QString &text);
+    void attachToSharedMemory(const QString &key);
+    void waitUntilDrained();
+    void endCongestion();
+    void pushPacket(const QByteArray &packet);
+    void pushUserAppEvent(const QString &script);
+    void writeQueuedData(qint64 socketBufferLimit);
+    void handlePackets(RecvBuffer &buf, MessageAssembler &message);
+    void readFromRing();
+    void ringDoorbell();
 };
 } // namespace Private
 } // namespace qt_monkey_agent
@@ -0,0 +1,224 @@
+#include "cbor.hpp"
+
+#include <cstring>
+#include <utility>
+
+#include "json11.hpp"
+
+using json11::Json;
+
+namespace
+{
+//! additional information of head, that means length in next bytes
+const uint8_t oneByteFollows = 24;
+const uint8_t twoBytesFollow = 25;
+const uint8_t fourBytesFollow = 26;
+const uint8_t eightBytesFollow = 27;
+
+const uint8_t simpleFalse = 20;
+const uint8_t simpleTrue = 21;
+const uint8_t simpleNull = 22;
+
+//! messages are shallow, so limit recursion for damaged data
+const int maxNestingDepth = 32;
+
+class CborParser final
+{
+public:
+    CborParser(const char *data, size_t size, std::string &err)
+        : p_(reinterpret_cast<const uint8_t *>(data)), end_(p_ + size),
+          err_(err)
+    {
+    }
+    bool parse(Json &res, int depth);
+    bool atEnd() const { return p_ == end_; }
+
+private:
+    const uint8_t *p_;
+    const uint8_t *end_;
+    std::string &err_;
+
+    bool fail(const char *reason)
+    {
+        err_ = reason;
+        return false;
+    }
+    bool readHead(uint8_t &type, uint8_t &info, uint64_t &val);
+    bool readText(uint64_t len, std::string &res);
+};
+
+bool CborParser::readHead(uint8_t &type, uint8_t &info, uint64_t &val)
+{
+    if (p_ == end_)
+        return fail("unexpected end of data");
+    type = *p_ >> 5;
+    info = *p_ & 0x1f;
+    ++p_;
+    size_t nBytes;
+    if (info < oneByteFollows) {
+        val = info;
+        return true;
+    } else if (info == oneByteFollows) {
+        nBytes = 1;
+    } else if (info == twoBytesFollow) {
+        nBytes = 2;
+    } else if (info == fourBytesFollow) {
+        nBytes = 4;
+    } else if (info == eightBytesFollow) {
+        nBytes = 8;
+    } else {
+        return fail("indefinite length is not supported");
+    }
+    if (static_cast<size_t>(end_ - p_) < nBytes)
+        return fail("unexpected end of data");
+    val = 0;
+    for (size_t i = 0; i < nBytes; ++i)
+        val = (val << 8) | *p_++;
+    return true;
+}
+
+bool CborParser::readText(uint64_t len, std::string &res)
+{
+    if (static_cast<uint64_t>(end_ - p_) < len)
+        return fail("unexpected end of data");
+    res.assign(reinterpret_cast<const char *>(p_), static_cast<size_t>(len));
+    p_ += len;
+    return true;
+}
+
+bool CborParser::parse(Json &res, int depth)
+{
+    if (depth > maxNestingDepth)
+        return fail("too deep nesting");
+    uint8_t type, info;
+    uint64_t val;
+    if (!readHead(type, info, val))
+        return false;
+    switch (static_cast<qt_monkey_app::CborType>(type)) {
+    case qt_monkey_app::CborType::UnsignedInt:
+        res = Json(static_cast<double>(val));
+        return true;
+    case qt_monkey_app::CborType::NegativeInt:
+        res = Json(-1. - static_cast<double>(val));
+        return true;
+    case qt_monkey_app::CborType::TextString: {
+        std::string text;
+        if (!readText(val, text))
+            return false;
+        res = Json(std::move(text));
+        return true;
+    }
+    case qt_monkey_app::CborType::Array: {
+        // every item takes at least one byte
+        if (val > static_cast<uint64_t>(end_ - p_))
+            return fail("unexpected end of data");
+        Json::array items;
+        items.reserve(static_cast<size_t>(val));
+        for (uint64_t i = 0; i < val; ++i) {
+            items.emplace_back();
+            if (!parse(items.back(), depth + 1))
+                return false;
+        }
+        res = Json(std::move(items));
+        return true;
+    }
+    case qt_monkey_app::CborType::Map: {
+        Json::object items;
+        for (uint64_t i = 0; i < val; ++i) {
+            uint8_t keyType, keyInfo;
+            uint64_t keyLen;
+            std::string key;
+            if (!readHead(keyType, keyInfo, keyLen))
+                return false;
+            if (keyType != static_cast<uint8_t>(
+                               qt_monkey_app::CborType::TextString))
+                return fail("key of map is not text");
+            if (!readText(keyLen, key))
+                return false;
+            if (!parse(items[std::move(key)], depth + 1))
+                return false;
+        }
+        res = Json(std::move(items));
+        return true;
+    }
+    case qt_monkey_app::CborType::Simple:
+        if (info == simpleFalse) {
+            res = Json(false);
+        } else if (info == simpleTrue) {
+            res = Json(true);
+        } else if (info == simpleNull) {
+            res = Json(nullptr);
+        } else if (info == fourBytesFollow) {
+            const uint32_t bits = static_cast<uint32_t>(val);
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            res = Json(static_cast<double>(f));
+        } else if (info == eightBytesFollow) {
+            double d;
+            std::memcpy(&d, &val, sizeof(d));
+            res = Json(d);
+        } else {
+            return fail("not supported simple value");
+        }
+        return true;
+    default:
+        return fail("not supported type of data item");
+    }
+}
+} // namespace
+
+void qt_monkey_app::appendCborHead(std::string &out, CborType type,
+                                   uint64_t val)
+{
+    const uint8_t major = static_cast<uint8_t>(type) << 5;
+    // the shortest form, as RFC recommends
+    size_t nBytes;
+    if (val < oneByteFollows) {
+        out += static_cast<char>(major | val);
+        return;
+    } else if (val <= 0xff) {
+        out += static_cast<char>(major | oneByteFollows);
+        nBytes = 1;
+    } else if (val <= 0xffff) {
+        out += static_cast<char>(major | twoBytesFollow);
+        nBytes = 2;
+    } else if (val <= 0xffffffff) {
+        out += static_cast<char>(major | fourBytesFollow);
+        nBytes = 4;
+    } else {
+        out += static_cast<char>(major | eightBytesFollow);
+        nBytes = 8;
+    }
+    for (size_t i = nBytes; i > 0; --i)
+        out += static_cast<char>((val >> (8 * (i - 1))) & 0xff);
+}
+
+void qt_monkey_app::appendCborText(std::string &out, const char *utf8,
+                                   size_t len)
+{
+    appendCborHead(out, CborType::TextString, len);
+    out.append(utf8, len);
+}
+
+void qt_monkey_app::appendCborInt(std::string &out, int64_t val)
+{
+    if (val >= 0)
+        appendCborHead(out, CborType::UnsignedInt,
+                       static_cast<uint64_t>(val));
+    else
+        appendCborHead(out, CborType::NegativeInt,
+                       static_cast<uint64_t>(-(val + 1)));
+}
+
+bool qt_monkey_app::parseCbor(const char *data, size_t size, Json &res,
+                              std::string &err)
+{
+    CborParser parser(data, size, err);
+    if (!parser.parse(res, 0))
+        return false;
+    if (!parser.atEnd()) {
+        err = "garbage after data item";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace json11
+{
+class Json;
+}
+
+namespace qt_monkey_app
+{
+//! major types of CBOR data items (RFC 7049), only used by us
+enum class CborType : uint8_t {
+    UnsignedInt = 0,
+    NegativeInt = 1,
+    TextString = 3,
+    Array = 4,
+    Map = 5,
+    Simple = 7,
+};
+
+//! append head of data item: major type and value or length
+void appendCborHead(std::string &out, CborType type, uint64_t val);
+void appendCborText(std::string &out, const char *utf8, size_t len);
+inline void appendCborText(std::string &out, const char *str)
+{
+    appendCborText(out, str, std::char_traits<char>::length(str));
+}
+void appendCborInt(std::string &out, int64_t val);
+
+/**
+ * Decode one data item, which takes whole data. Only items that
+ * can be represented in JSON are supported: integers, text strings,
+ * arrays, maps with text keys, false, true, null, floats
+ * @return false if data damaged or not supported, err contains reason
+ */
+bool parseCbor(const char *data, size_t size, json11::Json &res,
+               std::string &err);
+} // namespace qt_monkey_app
@@ -0,0 +1,54 @@
+//#define DEBUG_GUI_CALL_QUEUE
+#include "gui_call_queue.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <thread>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QThread>
+
+using qt_monkey_agent::Private::GuiCallQueue;
+
+#ifdef DEBUG_GUI_CALL_QUEUE
+#define DBGPRINT(fmt, ...) qDebug(fmt, __VA_ARGS__)
+#else
+#define DBGPRINT(fmt, ...)                                                     \
+    do {                                                                       \
+    } while (false)
+#endif
+
+GuiCallQueue::GuiCallQueue()
+{
+    eventType_ = static_cast<QEvent::Type>(QEvent::registerEventType());
+}
+
+void GuiCallQueue::call(std::function<void()> func)
+{
+    assert(QThread::currentThread() != thread());
+    // calls are synchronous except few ones, so it is almost impossible
+    while (!calls_.push(std::move(func))) {
+        DBGPRINT("%s: queue is full", Q_FUNC_INFO);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!wakeUpPosted_.exchange(true, std::memory_order_acq_rel))
+        QCoreApplication::postEvent(this, new QEvent(eventType_));
+}
+
+void GuiCallQueue::processCalls()
+{
+    assert(QThread::currentThread() == thread());
+    // reset before processing, so call added after that post new event,
+    // it is important if function starts new event loop
+    wakeUpPosted_.exchange(false, std::memory_order_acq_rel);
+    std::function<void()> func;
+    while (calls_.pop(func))
+        func();
+}
+
+void GuiCallQueue::customEvent(QEvent *event)
+{
+    if (event->type() != eventType_)
+        return;
+    processCalls();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+#include <QtCore/QEvent>
+#include <QtCore/QObject>
+
+#include "spsc_queue.hpp"
+
+namespace qt_monkey_agent
+{
+namespace Private
+{
+/**
+ * Queue of functions to call in thread of this object (GUI thread),
+ * calls should be added only from one thread. There is at most one
+ * posted event per burst of calls, instead of event per call.
+ */
+class GuiCallQueue final : public QObject
+{
+public:
+    GuiCallQueue();
+    GuiCallQueue(const GuiCallQueue &) = delete;
+    GuiCallQueue &operator=(const GuiCallQueue &) = delete;
+    //! add function to queue, and return immediately
+    void call(std::function<void()> func);
+    //! call all queued functions, should be called only in GUI thread
+    void processCalls();
+
+private:
+    qt_monkey_common::SpscQueue<std::function<void()>, 256> calls_;
+    std::atomic<bool> wakeUpPosted_{false};
+    QEvent::Type eventType_;
+
+    void customEvent(QEvent *event) override;
+};
+} // namespace Private
+} // namespace qt_monkey_agent
@@ -0,0 +1,84 @@
+#include "gui_idle_tracker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <QtCore/QAbstractEventDispatcher>
+#include <QtCore/QEvent>
+#include <QtCore/QObject>
+
+using qt_monkey_agent::Private::GuiIdleTracker;
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+//! check interval of timer, timers with zero interval are activity
+bool isPeriodicTimer(QObject *obj, int timerId)
+{
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+    if (dispatcher == nullptr)
+        return false;
+#if QT_VERSION >= 0x050000
+    for (const QAbstractEventDispatcher::TimerInfo &timer :
+         dispatcher->registeredTimers(obj))
+        if (timer.timerId == timerId)
+            return timer.interval > 0;
+#else
+    for (const QPair<int, int> &timer : dispatcher->registeredTimers(obj))
+        if (timer.first == timerId)
+            return timer.second > 0;
+#endif
+    return false;
+}
+} // namespace
+
+void GuiIdleTracker::eventSeen(QObject *obj, QEvent *event)
+{
+    // list of timers built on every call, so look at it only when
+    // somebody waits, before that tick is activity, it delays idle
+    // at most by one idle window
+    if (event->type() == QEvent::Timer
+        && nWaiters_.load(std::memory_order_relaxed) != 0
+        && isPeriodicTimer(obj, static_cast<QTimerEvent *>(event)->timerId()))
+        return;
+    lastActivity_.store(Clock::now().time_since_epoch().count(),
+                        std::memory_order_relaxed);
+}
+
+void GuiIdleTracker::aboutToBlock()
+{
+    lastBlock_.store(Clock::now().time_since_epoch().count(),
+                     std::memory_order_relaxed);
+}
+
+bool GuiIdleTracker::waitForIdle(int timeoutMs,
+                                 const std::function<bool()> &isCanceled)
+{
+    const auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    ++nWaiters_;
+    struct WaiterGuard final {
+        std::atomic<int> &nWaiters;
+        ~WaiterGuard() { --nWaiters; }
+    } guard{nWaiters_};
+    for (;;) {
+        const Clock::duration window
+            = std::chrono::milliseconds(idleWindowMs_.load());
+        const Clock::duration lastBlock(lastBlock_.load());
+        const Clock::duration lastActivity(lastActivity_.load());
+        const auto now = Clock::now();
+        const Clock::duration idleFor = now.time_since_epoch() - lastActivity;
+        // if event loop was not going to wait after last event,
+        // there are posted events or timers with zero interval,
+        // so GUI is busy, even if there were no events for a long time
+        if (lastBlock >= lastActivity && idleFor >= window)
+            return true;
+        if (now >= deadline || isCanceled())
+            return false;
+        const Clock::duration minSleep = std::chrono::milliseconds(1);
+        const Clock::duration sleepTime = std::min<Clock::duration>(
+            deadline - now, std::max(window - idleFor, minSleep));
+        std::this_thread::sleep_for(sleepTime);
+    }
+}
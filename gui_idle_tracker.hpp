@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+class QEvent;
+class QObject;
+
+namespace qt_monkey_agent
+{
+namespace Private
+{
+/**
+ * Track whether GUI thread is idle: its event loop processed all posted
+ * events (including UpdateRequest and Paint) and timers with zero
+ * interval, was going to wait for new events, and after that there were
+ * no events during idle window. Ticks of periodic timers are not activity,
+ * otherwise application with any fast timer never becomes idle; running
+ * animations are such ticks, so they matter only via repaint of widgets.
+ */
+class GuiIdleTracker final
+{
+public:
+    GuiIdleTracker() = default;
+    GuiIdleTracker(const GuiIdleTracker &) = delete;
+    GuiIdleTracker &operator=(const GuiIdleTracker &) = delete;
+
+    //! should be called for every event in GUI thread
+    void eventSeen(QObject *obj, QEvent *event);
+    //! should be called when GUI event loop is going to wait for events
+    void aboutToBlock();
+    //! how long GUI thread should be without events to be considered idle
+    void setIdleWindowMs(int ms) { idleWindowMs_ = ms; }
+    /**
+     * Wait until GUI is idle, can be called from any thread
+     * @param timeoutMs how long to wait
+     * @param isCanceled checked periodically, if it returns true
+     * waiting stops
+     * @return false if GUI was not idle during timeoutMs or wait canceled
+     */
+    bool waitForIdle(int timeoutMs, const std::function<bool()> &isCanceled);
+
+private:
+    std::atomic<int> idleWindowMs_{50};
+    //! time of last event in GUI thread, in steady_clock ticks
+    std::atomic<std::int64_t> lastActivity_{0};
+    //! time when GUI event loop was going to wait events
+    std::atomic<std::int64_t> lastBlock_{0};
+    //! threads inside waitForIdle
+    std::atomic<int> nWaiters_{0};
+};
+} // namespace Private
+} // namespace qt_monkey_agent
@@ -0,0 +1,184 @@
+#include "json_writer.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)                                       \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QTMONKEY_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+inline bool needEscape(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+//! @return number of written bytes, at most 6
+size_t writeEscaped(char *dst, unsigned char c)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    dst[0] = '\\';
+    switch (c) {
+    case '"':
+        dst[1] = '"';
+        return 2;
+    case '\\':
+        dst[1] = '\\';
+        return 2;
+    case '\b':
+        dst[1] = 'b';
+        return 2;
+    case '\f':
+        dst[1] = 'f';
+        return 2;
+    case '\n':
+        dst[1] = 'n';
+        return 2;
+    case '\r':
+        dst[1] = 'r';
+        return 2;
+    case '\t':
+        dst[1] = 't';
+        return 2;
+    default:
+        dst[1] = 'u';
+        dst[2] = '0';
+        dst[3] = '0';
+        dst[4] = hexDigits[c >> 4];
+        dst[5] = hexDigits[c & 0xf];
+        return 6;
+    }
+}
+
+#ifdef QTMONKEY_USE_SSE2
+//! mask of bytes which should be escaped
+inline int escapeMask(__m128i chunk)
+{
+    const __m128i maxCtrl = _mm_set1_epi8(0x1f);
+    // there is no unsigned compare in SSE2, so use max(x, 0x1f) == 0x1f
+    const __m128i ctrl
+        = _mm_cmpeq_epi8(_mm_max_epu8(chunk, maxCtrl), maxCtrl);
+    const __m128i quote = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'));
+    const __m128i backslash = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'));
+    return _mm_movemask_epi8(
+        _mm_or_si128(ctrl, _mm_or_si128(quote, backslash)));
+}
+#endif
+
+//! find first byte in [p, end) which should be escaped
+const char *findEscape(const char *p, const char *end)
+{
+#ifdef QTMONKEY_USE_SSE2
+    for (; end - p >= 16; p += 16) {
+        const __m128i chunk
+            = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        if (escapeMask(chunk) != 0)
+            break;
+    }
+#else
+    // the same via 64-bit words, test for zero byte
+    // (x - 0x01..01) & ~x & 0x80..80 is exact for existence of such byte
+    static const uint64_t ones = UINT64_C(0x0101010101010101);
+    static const uint64_t highBits = ones * 0x80;
+    for (; end - p >= 8; p += 8) {
+        uint64_t x;
+        std::memcpy(&x, p, sizeof(x));
+        const uint64_t quote = x ^ (ones * '"');
+        const uint64_t backslash = x ^ (ones * '\\');
+        const uint64_t special = ((x - ones * 0x20) & ~x)
+                                 | ((quote - ones) & ~quote)
+                                 | ((backslash - ones) & ~backslash);
+        if ((special & highBits) != 0)
+            break;
+    }
+#endif
+    while (p < end && !needEscape(static_cast<unsigned char>(*p)))
+        ++p;
+    return p;
+}
+} // namespace
+
+void qt_monkey_app::appendJsonString(std::string &out, const char *utf8,
+                                     size_t len)
+{
+    const char *p = utf8, *end = utf8 + len;
+    out += '"';
+    for (;;) {
+        const char *esc = findEscape(p, end);
+        out.append(p, esc - p);
+        if (esc == end)
+            break;
+        char buf[6];
+        out.append(buf, writeEscaped(buf, static_cast<unsigned char>(*esc)));
+        p = esc + 1;
+    }
+    out += '"';
+}
+
+void qt_monkey_app::appendJsonString(std::string &out, const QString &str)
+{
+    const ushort *p = str.utf16(), *end = p + str.size();
+    char buf[1024];
+    size_t n = 0;
+    out += '"';
+    while (p < end) {
+        // at most 8 bytes written per iteration
+        if (n + 8 > sizeof(buf)) {
+            out.append(buf, n);
+            n = 0;
+        }
+#ifdef QTMONKEY_USE_SSE2
+        if (end - p >= 8) {
+            // saturation maps all not ASCII characters to 0x80-0xff or 0,
+            // so ASCII text without escapes goes by 8 characters
+            const __m128i units
+                = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i bytes = _mm_packus_epi16(units, units);
+            if ((escapeMask(bytes) | _mm_movemask_epi8(bytes)) == 0) {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(buf + n), bytes);
+                n += 8;
+                p += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t ch = *p++;
+        if (ch < 0x80) {
+            if (needEscape(static_cast<unsigned char>(ch)))
+                n += writeEscaped(buf + n, static_cast<unsigned char>(ch));
+            else
+                buf[n++] = static_cast<char>(ch);
+            continue;
+        }
+        if (ch >= 0xd800 && ch <= 0xdfff) {
+            if (ch <= 0xdbff && p < end && *p >= 0xdc00 && *p <= 0xdfff)
+                ch = 0x10000 + ((ch - 0xd800) << 10) + (*p++ - 0xdc00);
+            else // broken surrogate pair
+                ch = 0xfffd;
+        }
+        if (ch < 0x800) {
+            buf[n++] = static_cast<char>(0xc0 | (ch >> 6));
+        } else if (ch < 0x10000) {
+            buf[n++] = static_cast<char>(0xe0 | (ch >> 12));
+            buf[n++] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+        } else {
+            buf[n++] = static_cast<char>(0xf0 | (ch >> 18));
+            buf[n++] = static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+            buf[n++] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+        }
+        buf[n++] = static_cast<char>(0x80 | (ch & 0x3f));
+    }
+    out.append(buf, n);
+    out += '"';
+}
+
+void qt_monkey_app::appendJsonNumber(std::string &out, int64_t val)
+{
+    char buf[32];
+    const int n
+        = std::snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(val));
+    out.append(buf, static_cast<size_t>(n));
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <QtCore/QString>
+
+namespace qt_monkey_app
+{
+/**
+ * Append JSON string literal (with quotes) to out, escape only what
+ * JSON requires: quote, backslash and control characters
+ * @param utf8 valid UTF-8 text, not escaped
+ */
+void appendJsonString(std::string &out, const char *utf8, size_t len);
+//! the same as above, but encode UTF-16 of QString to UTF-8 on the fly
+void appendJsonString(std::string &out, const QString &str);
+void appendJsonNumber(std::string &out, int64_t val);
+} // namespace qt_monkey_app
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace qt_monkey_common
+{
+/**
+ * Lock-free unbounded queue for many producer threads and one consumer
+ * thread (intrusive list with stub node). Producers never wait each other
+ * or consumer: push is one allocation and one atomic exchange.
+ * If producer is interrupted between exchange and link of node,
+ * consumer see queue as empty until producer finish push, so producer
+ * should wake up consumer after push.
+ */
+template <typename T> class MpscQueue final
+{
+    struct Node final {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+    ~MpscQueue()
+    {
+        T val;
+        while (pop(val))
+            ;
+        if (tail_ != &stub_)
+            delete tail_;
+    }
+
+    //! can be called from any thread
+    void push(T &&val)
+    {
+        Node *node = new Node;
+        node->value = std::move(val);
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    //! should be called only from consumer thread
+    //! @return false if queue is empty
+    bool pop(T &val)
+    {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+        val = std::move(next->value);
+        // free resources that may be hold by moved-from value
+        next->value = T();
+        // next become stub node
+        tail_ = next;
+        if (tail != &stub_)
+            delete tail;
+        return true;
+    }
+
+private:
+    static constexpr size_t cacheLineSize = 64;
+
+    Node stub_;
+    // producers and consumer data on different cache lines
+    char pad0_[cacheLineSize];
+    std::atomic<Node *> head_{&stub_};
+    char pad1_[cacheLineSize];
+    Node *tail_ = &stub_;
+};
+} // namespace qt_monkey_common
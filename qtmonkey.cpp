@@ -4,6 +4,7 @@
 #include <atomic>
 #include <cassert>
 #include <iostream>
+#include <vector>
 
 #ifdef _WIN32 // windows both 32 bit and 64 bit
 #include <windows.h>
@@ -15,6 +16,7 @@
 #include <QtCore/QCoreApplication>
 #include <QtCore/QTextCodec>
 #include <QtCore/QThread>
+#include <QtCore/QTimerEvent>
 
 #include "common.hpp"
 #include "json11.hpp"
@@ -37,6 +39,11 @@ using qt_monkey_common::operator<<;
 namespace
 {
 static constexpr int waitBeforeExitMs = 300;
+//! scripts may be megabytes, so read them by big blocks
+static constexpr size_t stdinBlockSize = 64 * 1024;
+//! packets for gui collected during this time are written at once
+static constexpr int outFlushDelayMs = 5;
+static constexpr size_t maxOutBufSize = 64 * 1024;
 
 static inline std::ostream &operator<<(std::ostream &os, const QString &str)
 {
@@ -76,9 +83,9 @@ ReadStdinThread::ReadStdinThread(QObject *parent, StdinReader &reader)
 
 void ReadStdinThread::run()
 {
+    std::vector<char> buf(stdinBlockSize);
     while (!timeToExit_) {
-        char ch;
-
+        DWORD bytesToRead = static_cast<DWORD>(buf.size());
         switch (::GetFileType(stdinHandle_)) {
         case FILE_TYPE_CHAR: { // console
             DWORD numberOfEvents = 0;
@@ -102,8 +109,9 @@ void ReadStdinThread::run()
             if (numberOfEventsRead != 1 || event.EventType != KEY_EVENT
                 || !event.Event.KeyEvent.bKeyDown)
                 continue;
-            ch = event.Event.KeyEvent.uChar.AsciiChar;
-            break;
+            const char ch = event.Event.KeyEvent.uChar.AsciiChar;
+            reader_.append(&ch, 1);
+            continue;
         }
         case FILE_TYPE_PIPE: {
             DWORD bytesAvailInPipe;
@@ -118,11 +126,14 @@ void ReadStdinThread::run()
                 continue;
             if (timeToExit_)
                 return;
+            // so ReadFile not wait more data
+            if (bytesAvailInPipe < bytesToRead)
+                bytesToRead = bytesAvailInPipe;
         }
         // fall through
         default: {
             DWORD readBytes = 0;
-            if (!::ReadFile(stdinHandle_, &ch, sizeof(ch), &readBytes,
+            if (!::ReadFile(stdinHandle_, buf.data(), bytesToRead, &readBytes,
                             nullptr)) {
                 reader_.emitError(
                     T_("reading from stdin error: %1").arg(::GetLastError()));
@@ -130,15 +141,10 @@ void ReadStdinThread::run()
             }
             if (readBytes == 0)
                 return;
+            reader_.append(buf.data(), readBytes);
             break;
         }
         } // switch
-
-        {
-            auto ptr = reader_.data.get();
-            ptr->append(ch);
-        }
-        reader_.emitDataReady();
     }
 }
 
@@ -151,8 +157,8 @@ ReadStdinThread::ReadStdinThread(QObject *parent, StdinReader &reader)
 
 void ReadStdinThread::run()
 {
+    std::vector<char> buf(stdinBlockSize);
     while (!timeToExit_) {
-        char ch;
         fd_set readfds, exceptfds;
         FD_ZERO(&readfds);
         FD_ZERO(&exceptfds);
@@ -173,18 +179,14 @@ void ReadStdinThread::run()
             || !FD_ISSET(STDIN_FILENO, &readfds))
             continue;
 
-        const ssize_t nBytes = ::read(STDIN_FILENO, &ch, sizeof(ch));
+        const ssize_t nBytes = ::read(STDIN_FILENO, buf.data(), buf.size());
         if (nBytes < 0) {
             reader_.emitError(T_("reading from stdin error: %1").arg(errno));
             return;
         } else if (nBytes == 0) {
             break;
         }
-        {
-            auto ptr = reader_.data.get();
-            ptr->append(ch);
-        }
-        reader_.emitDataReady();
+        reader_.append(buf.data(), static_cast<size_t>(nBytes));
     }
 }
 
@@ -200,8 +202,24 @@ void ReadStdinThread::stop()
 #endif
 } // namespace
 
-QtMonkey::QtMonkey(bool exitOnScriptError)
-    : exitOnScriptError_(exitOnScriptError)
+QtMonkey::QtMonkey(bool exitOnScriptError, Protocol protocol)
+    : protocol_(protocol), exitOnScriptError_(exitOnScriptError),
+      guiParser_(
+          [this](QString script_code, QString scriptFileName) {
+              auto scripts = Script::splitToExecutableParts(scriptFileName,
+                                                            script_code);
+              for (auto &&script : scripts) {
+                  toRunList_.push(std::move(script));
+              }
+              onAgentReadyToRunScript();
+          },
+          [this]() { haltScript(); },
+          [](QString errMsg) {
+              std::cerr
+                  << T_("Can not parse gui<->monkey protocol: %1\n")
+                         .arg(errMsg);
+          },
+          protocol)
 {
     QProcessEnvironment curEnv = QProcessEnvironment::systemEnvironment();
     curEnv.insert(channelWithAgent_.requiredProcessEnvironment().first,
@@ -219,15 +237,17 @@ QtMonkey::QtMonkey(bool exitOnScriptError)
 
     connect(&channelWithAgent_, SIGNAL(error(QString)), this,
             SLOT(communicationWithAgentError(const QString &)));
-    connect(&channelWithAgent_, SIGNAL(newUserAppEvent(QString)), this,
-            SLOT(onNewUserAppEvent(QString)));
-    connect(&channelWithAgent_, SIGNAL(scriptError(QString)), this,
-            SLOT(onScriptError(QString)));
+    connect(&channelWithAgent_, SIGNAL(newUserAppEvent(QByteArray)),
+            this, SLOT(onNewUserAppEvent(QByteArray)));
+    connect(&channelWithAgent_, SIGNAL(scriptError(QByteArray)), this,
+            SLOT(onScriptError(QByteArray)));
     connect(&channelWithAgent_, SIGNAL(agentReadyToRunScript()), this,
             SLOT(onAgentReadyToRunScript()));
+    connect(&channelWithAgent_, SIGNAL(agentReady(qint64)), this,
+            SLOT(onAgentReady(qint64)));
     connect(&channelWithAgent_, SIGNAL(scriptEnd()), this, SLOT(onScriptEnd()));
-    connect(&channelWithAgent_, SIGNAL(scriptLog(QString)), this,
-            SLOT(onScriptLog(QString)));
+    connect(&channelWithAgent_, SIGNAL(scriptLog(QByteArray)), this,
+            SLOT(onScriptLog(QByteArray)));
 
     readStdinThread_ = new ReadStdinThread(this, stdinReader_);
     stdinReader_.moveToThread(readStdinThread_);
@@ -252,6 +272,7 @@ QtMonkey::~QtMonkey()
     }
     // so any signals from channel will be disconected
     channelWithAgent_.close();
+    flushOutput();
 }
 
 void QtMonkey::communicationWithAgentError(const QString &errStr)
@@ -259,15 +280,16 @@ void QtMonkey::communicationWithAgentError(const QString &errStr)
     qWarning("%s: errStr %s", Q_FUNC_INFO, qPrintable(errStr));
 }
 
-void QtMonkey::onNewUserAppEvent(QString scriptLines)
+void QtMonkey::onNewUserAppEvent(QByteArray scriptLines)
 {
-    std::cout << qt_monkey_app::createPacketFromUserAppEvent(scriptLines)
-              << std::endl;
+    appendPacketFromUserAppEvent(outBuf_, scriptLines, protocol_);
+    packetForGuiAdded();
 }
 
 void QtMonkey::userAppError(QProcess::ProcessError err)
 {
     qDebug("%s: begin err %d", Q_FUNC_INFO, static_cast<int>(err));
+    flushOutput();
     throw std::runtime_error(
         qPrintable(qt_monkey_common::processErrorToString(err)));
 }
@@ -277,6 +299,7 @@ void QtMonkey::userAppFinished(int exitCode, QProcess::ExitStatus exitStatus)
     qDebug("%s: begin exitCode %d, exitStatus %d", Q_FUNC_INFO, exitCode,
            static_cast<int>(exitStatus));
     qt_monkey_common::processEventsFor(waitBeforeExitMs);
+    flushOutput();
     if (exitCode != EXIT_SUCCESS)
         throw std::runtime_error(T_("user app exit status not %1: %2")
                                      .arg(EXIT_SUCCESS)
@@ -289,7 +312,7 @@ void QtMonkey::userAppFinished(int exitCode, QProcess::ExitStatus exitStatus)
     } else {
         assert(!userAppPath_.isEmpty());
         restartDone_ = true;
-        userApp_.start(userAppPath_, userAppArgs_);
+        startUserApp();
     }
 }
 
@@ -297,48 +320,41 @@ void QtMonkey::userAppNewOutput()
 {
     const QString stdoutStr
         = QString::fromLocal8Bit(userApp_.readAllStandardOutput());
-    std::cout << createPacketFromUserAppOutput(stdoutStr) << std::endl;
+    appendPacketFromUserAppOutput(outBuf_, stdoutStr, protocol_);
+    packetForGuiAdded();
 }
 
 void QtMonkey::userAppNewErrOutput()
 {
     const QString errOut
         = QString::fromLocal8Bit(userApp_.readAllStandardError());
-    std::cout << createPacketFromUserAppErrors(errOut) << std::endl;
+    appendPacketFromUserAppErrors(outBuf_, errOut, protocol_);
+    packetForGuiAdded();
 }
 
 void QtMonkey::stdinDataReady()
 {
-    auto dataPtr = stdinReader_.data.get();
-    size_t parserStopPos;
-    parseOutputFromGui(
-        {dataPtr->constData(), static_cast<size_t>(dataPtr->size())},
-        parserStopPos,
-        [this](QString script_code, QString scriptFileName) {
-            auto scripts
-                = Script::splitToExecutableParts(scriptFileName, script_code);
-            for (auto &&script : scripts) {
-                toRunList_.push(std::move(script));
-            }
-            onAgentReadyToRunScript();
-        },
-        [](QString errMsg) {
-            std::cerr
-                << T_("Can not parse gui<->monkey protocol: %1\n").arg(errMsg);
-        });
-    if (parserStopPos != 0)
-        dataPtr->remove(0, parserStopPos);
+    stdinReader_.resetDataReady();
+    QByteArray newData;
+    stdinReader_.data.get()->swap(newData);
+    guiParser_.feed(newData.constData(), static_cast<size_t>(newData.size()));
 }
 
-void QtMonkey::onScriptError(QString errMsg)
+void QtMonkey::onScriptError(QByteArray errMsg)
 {
-    qDebug("%s: begin %s", Q_FUNC_INFO, qPrintable(errMsg));
-    setScriptRunningState(false);
-    std::cout << createPacketFromUserAppErrors(errMsg) << std::endl;
-    if (exitOnScriptError_) {
+    qDebug("%s: begin %s", Q_FUNC_INFO, errMsg.constData());
+    // agent always sends ScriptEnd after ScriptError,
+    // so running state is changed there
+    appendPacketFromUserAppErrors(outBuf_, errMsg, protocol_);
+    packetForGuiAdded();
+    if (exitOnScriptError_ && !haltRequested_) {
         qt_monkey_common::processEventsFor(waitBeforeExitMs);
+        flushOutput();
         throw std::runtime_error(
-            T_("script return error: %1").arg(errMsg).toUtf8().data());
+            T_("script return error: %1")
+                .arg(QString::fromUtf8(errMsg))
+                .toUtf8()
+                .data());
     }
 }
 
@@ -408,20 +424,88 @@ void QtMonkey::onAgentReadyToRunScript()
     setScriptRunningState(true);
 }
 
+void QtMonkey::onAgentReady(qint64 readyTime)
+{
+    DBGPRINT("%s: agent ready after %lld ms", Q_FUNC_INFO,
+             static_cast<long long>(readyTime - userAppStartTime_));
+    appendPacketFromAgentReady(outBuf_, readyTime,
+                               readyTime - userAppStartTime_, protocol_);
+    packetForGuiAdded();
+}
+
 void QtMonkey::onScriptEnd()
 {
     setScriptRunningState(false);
-    std::cout << createPacketFromScriptEnd() << std::endl;
+    appendPacketFromScriptEnd(outBuf_, protocol_);
+    packetForGuiAdded();
+}
+
+void QtMonkey::onScriptLog(QByteArray msg)
+{
+    appendPacketFromUserAppScriptLog(outBuf_, msg, protocol_);
+    packetForGuiAdded();
+}
+
+void QtMonkey::haltScript()
+{
+    DBGPRINT("%s: script running %s", Q_FUNC_INFO,
+             scriptRunning_ ? "true" : "false");
+    if (!scriptRunning_ || haltRequested_)
+        return;
+    haltRequested_ = true;
+    channelWithAgent_.sendCommand(PacketTypeForAgent::HaltScript, QString());
 }
 
-void QtMonkey::onScriptLog(QString msg)
+void QtMonkey::packetForGuiAdded()
 {
-    std::cout << createPacketFromUserAppScriptLog(msg) << std::endl;
+    // CBOR messages have length, JSON ones are separated for readability
+    if (protocol_ == Protocol::Json)
+        outBuf_ += '\n';
+    if (outBuf_.size() >= maxOutBufSize)
+        flushOutput();
+    else if (!outFlushTimer_.isActive())
+        outFlushTimer_.start(outFlushDelayMs, this);
+}
+
+void QtMonkey::flushOutput()
+{
+    outFlushTimer_.stop();
+    if (outBuf_.empty())
+        return;
+    std::cout.write(outBuf_.data(),
+                    static_cast<std::streamsize>(outBuf_.size()));
+    std::cout.flush();
+    // capacity is kept for next packets
+    outBuf_.clear();
+}
+
+void QtMonkey::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() == outFlushTimer_.timerId()) {
+        flushOutput();
+        return;
+    }
+    if (event->timerId() != scriptTimer_.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+    scriptTimer_.stop();
+    appendPacketFromUserAppErrors(
+        outBuf_,
+        T_("Script runs longer than %1 ms, halt it").arg(scriptTimeoutMs_),
+        protocol_);
+    packetForGuiAdded();
+    haltScript();
 }
 
 void QtMonkey::setScriptRunningState(bool val)
 {
     scriptRunning_ = val;
+    haltRequested_ = false;
+    if (scriptRunning_ && scriptTimeoutMs_ > 0)
+        scriptTimer_.start(scriptTimeoutMs_, this);
+    else
+        scriptTimer_.stop();
     if (!scriptRunning_)
         onAgentReadyToRunScript();
 }
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <atomic>
 #include <queue>
+#include <string>
 
+#include <QtCore/QBasicTimer>
+#include <QtCore/QDateTime>
 #include <QtCore/QFile>
 #include <QtCore/QObject>
 #include <QtCore/QProcess>
 
 #include "agent_qtmonkey_communication.hpp"
+#include "qtmonkey_app_api.hpp"
 #include "script.hpp"
 #include "shared_resource.hpp"
 
@@ -30,7 +35,24 @@ public:
     qt_monkey_common::SharedResource<QByteArray> data;
 
     void emitError(const QString &msg) { emit error(msg); }
-    void emitDataReady() { emit dataReady(); }
+    /**
+     * Add data from stdin, and emit dataReady, if previous
+     * one already handled, so there is at most one signal in queue
+     */
+    void append(const char *buf, size_t len)
+    {
+        data.get()->append(buf, static_cast<int>(len));
+        if (!dataReadyPosted_.exchange(true, std::memory_order_acq_rel))
+            emit dataReady();
+    }
+    //! should be called by handler of dataReady before taking data
+    void resetDataReady()
+    {
+        dataReadyPosted_.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> dataReadyPosted_{false};
 };
 } // namespace Private
 //! main class to control agent
@@ -42,43 +64,74 @@ class QtMonkey
 {
     Q_OBJECT
 public:
-    explicit QtMonkey(bool exitOnScriptError);
+    explicit QtMonkey(bool exitOnScriptError,
+                      Protocol protocol = Protocol::Json);
     ~QtMonkey();
     void runApp(QString userAppPath, QStringList userAppArgs)
     {
         userAppPath_ = std::move(userAppPath);
         userAppArgs_ = std::move(userAppArgs);
-        userApp_.start(userAppPath_, userAppArgs_);
+        startUserApp();
     }
     bool runScriptFromFile(QString codeToRunBeforeAll,
                            QStringList scriptPathList,
                            const char *encoding = "UTF-8");
+    /**
+     * Set how long script can run, after that it is halted
+     * and the next script runs in the same instance of user app
+     * @param ms time limit, 0 means no limit
+     */
+    void setScriptTimeout(int ms) { scriptTimeoutMs_ = ms; }
+    //! ask agent to abort running script
+    void haltScript();
 private slots:
     void userAppError(QProcess::ProcessError);
     void userAppFinished(int, QProcess::ExitStatus);
     void userAppNewOutput();
     void userAppNewErrOutput();
     void communicationWithAgentError(const QString &errStr);
-    void onNewUserAppEvent(QString scriptLines);
+    void onNewUserAppEvent(QByteArray scriptLines);
     void stdinDataReady();
-    void onScriptError(QString errMsg);
+    void onScriptError(QByteArray errMsg);
     void onAgentReadyToRunScript();
+    void onAgentReady(qint64 readyTime);
     void onScriptEnd();
-    void onScriptLog(QString msg);
+    void onScriptLog(QByteArray msg);
 
 private:
+    //! encoding of messages for gui and from it
+    Protocol protocol_;
     bool scriptRunning_ = false;
+    //! halt of running script requested, so its error is expected
+    bool haltRequested_ = false;
+    int scriptTimeoutMs_ = 0;
+    QBasicTimer scriptTimer_;
+    //! packets for gui, written to stdout by batches
+    std::string outBuf_;
+    QBasicTimer outFlushTimer_;
 
     qt_monkey_agent::Private::CommunicationMonkeyPart channelWithAgent_;
     QProcess userApp_;
     std::queue<qt_monkey_agent::Private::Script> toRunList_;
     bool exitOnScriptError_ = false;
     Private::StdinReader stdinReader_;
+    GuiStreamParser guiParser_;
     QThread *readStdinThread_ = nullptr;
     QString userAppPath_;
     QStringList userAppArgs_;
     bool restartDone_ = false;
+    //! time in ms since epoch of last start of user app
+    qint64 userAppStartTime_ = 0;
 
     void setScriptRunningState(bool val);
+    //! packet was appended to outBuf_, schedule write of it
+    void packetForGuiAdded();
+    void flushOutput();
+    void timerEvent(QTimerEvent *) override;
+    void startUserApp()
+    {
+        userAppStartTime_ = QDateTime::currentMSecsSinceEpoch();
+        userApp_.start(userAppPath_, userAppArgs_);
+    }
 };
 } // namespace qt_monkey_app
@@ -3,6 +3,11 @@
 #include <cstring>
 #include <iostream>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
 #include <QtCore/QCoreApplication>
 #include <QtCore/QProcess>
 #include <QtCore/QTextStream>
@@ -77,6 +82,8 @@ static QString usage()
               "[--trace-script-exec] "
               "[--save-screenshots path/to/dir maxium_number] "
               "[--script path/to/script] "
+              "[--script-timeout milliseconds] "
+              "[--protocol=json|cbor] "
               "--user-app "
               "path/to/application [application's command line args]\n")
         .arg(QCoreApplication::applicationFilePath());
@@ -93,6 +100,9 @@ int main(int argc, char *argv[])
     QStringList scripts;
     const char *encoding = "UTF-8";
     QString codeToRunBeforeAll;
+    int scriptTimeoutMs = 0;
+    qt_monkey_app::Protocol protocol = qt_monkey_app::Protocol::Json;
+    static const char protocolOption[] = "--protocol=";
 
     for (int i = 1; i < argc; ++i)
         if (std::strcmp(argv[i], "--user-app") == 0) {
@@ -110,6 +120,22 @@ int main(int argc, char *argv[])
             }
             ++i;
             scripts.append(QFile::decodeName(argv[i]));
+        } else if (std::strcmp(argv[i], "--script-timeout") == 0) {
+            if ((i + 1) >= argc
+                || sscanf(argv[i + 1], "%d", &scriptTimeoutMs) != 1
+                || scriptTimeoutMs < 0) {
+                std::cerr << qPrintable(usage());
+                return EXIT_FAILURE;
+            }
+            ++i;
+        } else if (std::strncmp(argv[i], protocolOption,
+                                sizeof(protocolOption) - 1)
+                   == 0) {
+            if (!qt_monkey_app::parseProtocolName(
+                    argv[i] + sizeof(protocolOption) - 1, protocol)) {
+                std::cerr << qPrintable(usage());
+                return EXIT_FAILURE;
+            }
         } else if (std::strcmp(argv[i], "--exit-on-script-error") == 0) {
             exitOnScriptError = true;
         } else if (std::strcmp(argv[i], "--encoding") == 0) {
@@ -151,7 +177,13 @@ int main(int argc, char *argv[])
     QStringList userAppArgs;
     for (int i = userAppOffset + 1; i < argc; ++i)
         userAppArgs << QString::fromLocal8Bit(argv[i]);
-    qt_monkey_app::QtMonkey monkey(exitOnScriptError);
+#ifdef _WIN32
+    // CBOR is binary, so there should be no conversation of '\n'
+    if (protocol == qt_monkey_app::Protocol::Cbor)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    qt_monkey_app::QtMonkey monkey(exitOnScriptError, protocol);
+    monkey.setScriptTimeout(scriptTimeoutMs);
 
     if (!scripts.empty()
         && !monkey.runScriptFromFile(std::move(codeToRunBeforeAll),
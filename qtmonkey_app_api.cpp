@@ -1,9 +1,13 @@
 #include "qtmonkey_app_api.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
+#include "cbor.hpp"
 #include "common.hpp"
 #include "json11.hpp"
+#include "json_writer.hpp"
 
 namespace qt_monkey_app
 {
@@ -12,57 +16,434 @@ using json11::Json;
 
 namespace
 {
-struct QStringJsonTrait final {
-    explicit QStringJsonTrait(const QString &s) : str_(s) {}
-    std::string to_json() const { return str_.toUtf8().data(); }
+//! CBOR message is prefixed by its size as 32-bit big-endian number
+const size_t cborFrameHeaderSize = 4;
+//! do not wait for the rest of frame, if its header damaged
+const uint32_t maxCborFrameSize = 256 * 1024 * 1024;
+
+/**
+ * Write message, that consists of maps, strings and numbers,
+ * in JSON or CBOR
+ */
+class PacketWriter final
+{
+public:
+    PacketWriter(std::string &out, Protocol protocol)
+        : out_(out), protocol_(protocol), frameStart_(out.size())
+    {
+        if (protocol_ == Protocol::Cbor)
+            out_.append(cborFrameHeaderSize, '\0');
+    }
+    PacketWriter(const PacketWriter &) = delete;
+    PacketWriter &operator=(const PacketWriter &) = delete;
+    ~PacketWriter()
+    {
+        if (protocol_ != Protocol::Cbor)
+            return;
+        const uint32_t size = static_cast<uint32_t>(
+            out_.size() - frameStart_ - cborFrameHeaderSize);
+        for (size_t i = 0; i < cborFrameHeaderSize; ++i)
+            out_[frameStart_ + i] = static_cast<char>(
+                (size >> (8 * (cborFrameHeaderSize - 1 - i))) & 0xff);
+    }
+    void beginMap(size_t nItems)
+    {
+        if (protocol_ == Protocol::Cbor) {
+            appendCborHead(out_, CborType::Map, nItems);
+        } else {
+            out_ += '{';
+            firstInMap_ = true;
+        }
+    }
+    void endMap()
+    {
+        if (protocol_ == Protocol::Json)
+            out_ += '}';
+        firstInMap_ = false;
+    }
+    //! @param name should not need escaping
+    void key(const char *name)
+    {
+        if (protocol_ == Protocol::Cbor) {
+            appendCborText(out_, name);
+            return;
+        }
+        if (!firstInMap_)
+            out_ += ',';
+        out_ += '"';
+        out_ += name;
+        out_ += "\":";
+        firstInMap_ = true;
+    }
+    void value(const char *utf8, size_t len)
+    {
+        if (protocol_ == Protocol::Cbor)
+            appendCborText(out_, utf8, len);
+        else
+            appendJsonString(out_, utf8, len);
+        firstInMap_ = false;
+    }
+    void value(const QByteArray &utf8)
+    {
+        value(utf8.constData(), static_cast<size_t>(utf8.size()));
+    }
+    void value(const QString &str)
+    {
+        if (protocol_ == Protocol::Cbor) {
+            // CBOR needs length before text
+            value(str.toUtf8());
+            return;
+        }
+        appendJsonString(out_, str);
+        firstInMap_ = false;
+    }
+    void value(int64_t val)
+    {
+        if (protocol_ == Protocol::Cbor)
+            appendCborInt(out_, val);
+        else
+            appendJsonNumber(out_, val);
+        firstInMap_ = false;
+    }
 
 private:
-    const QString &str_;
+    std::string &out_;
+    Protocol protocol_;
+    size_t frameStart_;
+    bool firstInMap_ = true;
 };
+
+//! message {"name": value}
+template <typename T>
+void appendOneKeyPacket(std::string &out, Protocol protocol,
+                        const char *name, const T &value)
+{
+    PacketWriter writer(out, protocol);
+    writer.beginMap(1);
+    writer.key(name);
+    writer.value(value);
+    writer.endMap();
+}
+
+//! message {"event": {"script": scriptLines}}
+template <typename T>
+void appendUserAppEvent(std::string &out, Protocol protocol,
+                        const T &scriptLines)
+{
+    PacketWriter writer(out, protocol);
+    writer.beginMap(1);
+    writer.key("event");
+    writer.beginMap(1);
+    writer.key("script");
+    writer.value(scriptLines);
+    writer.endMap();
+    writer.endMap();
+}
+
+//! message, that is just string
+void appendCommandPacket(std::string &out, Protocol protocol,
+                         const char *command)
+{
+    PacketWriter writer(out, protocol);
+    writer.value(command, std::char_traits<char>::length(command));
+}
 } // namespace
 
-std::string createPacketFromUserAppEvent(const QString &scriptLines)
+bool parseProtocolName(const char *name, Protocol &protocol)
+{
+    if (std::strcmp(name, "json") == 0)
+        protocol = Protocol::Json;
+    else if (std::strcmp(name, "cbor") == 0)
+        protocol = Protocol::Cbor;
+    else
+        return false;
+    return true;
+}
+
+void appendPacketFromUserAppEvent(std::string &out,
+                                  const QString &scriptLines,
+                                  Protocol protocol)
+{
+    appendUserAppEvent(out, protocol, scriptLines);
+}
+
+void appendPacketFromUserAppEvent(std::string &out,
+                                  const QByteArray &scriptLines,
+                                  Protocol protocol)
+{
+    appendUserAppEvent(out, protocol, scriptLines);
+}
+
+void appendPacketFromUserAppOutput(std::string &out,
+                                   const QString &stdOutLines,
+                                   Protocol protocol)
+{
+    appendOneKeyPacket(out, protocol, "app output", stdOutLines);
+}
+
+void appendPacketFromUserAppErrors(std::string &out, const QString &errMsg,
+                                   Protocol protocol)
+{
+    appendOneKeyPacket(out, protocol, "app errors", errMsg);
+}
+
+void appendPacketFromUserAppErrors(std::string &out, const QByteArray &errMsg,
+                                   Protocol protocol)
+{
+    appendOneKeyPacket(out, protocol, "app errors", errMsg);
+}
+
+void appendPacketFromScriptEnd(std::string &out, Protocol protocol)
+{
+    appendCommandPacket(out, protocol, "script end");
+}
+
+void appendPacketFromUserAppScriptLog(std::string &out, const QString &logMsg,
+                                      Protocol protocol)
+{
+    appendOneKeyPacket(out, protocol, "script logs", logMsg);
+}
+
+void appendPacketFromUserAppScriptLog(std::string &out,
+                                      const QByteArray &logMsg,
+                                      Protocol protocol)
 {
-    auto json = Json::object{
-        {"event", Json::object{{"script", QStringJsonTrait{scriptLines}}}}};
+    appendOneKeyPacket(out, protocol, "script logs", logMsg);
+}
+
+void appendPacketFromAgentReady(std::string &out, int64_t readyTime,
+                                int64_t sinceAppStartMs, Protocol protocol)
+{
+    PacketWriter writer(out, protocol);
+    writer.beginMap(1);
+    writer.key("agent ready");
+    writer.beginMap(2);
+    writer.key("since app start");
+    writer.value(sinceAppStartMs);
+    writer.key("time");
+    writer.value(readyTime);
+    writer.endMap();
+    writer.endMap();
+}
+
+void appendPacketFromRunScript(std::string &out, const QString &script,
+                               const QString &scriptFileName,
+                               Protocol protocol)
+{
+    PacketWriter writer(out, protocol);
+    writer.beginMap(1);
+    writer.key("run script");
+    writer.beginMap(2);
+    writer.key("file");
+    writer.value(scriptFileName);
+    writer.key("script");
+    writer.value(script);
+    writer.endMap();
+    writer.endMap();
+}
+
+void appendPacketFromHaltScript(std::string &out, Protocol protocol)
+{
+    appendCommandPacket(out, protocol, "halt script");
+}
 
-    return Json{json}.dump();
+std::string createPacketFromUserAppEvent(const QString &scriptLines)
+{
+    std::string res;
+    appendPacketFromUserAppEvent(res, scriptLines);
+    return res;
 }
 
 std::string createPacketFromUserAppOutput(const QString &stdOutLines)
 {
-    auto json = Json::object{{"app output", QStringJsonTrait{stdOutLines}}};
-    return Json{json}.dump();
+    std::string res;
+    appendPacketFromUserAppOutput(res, stdOutLines);
+    return res;
 }
 
 std::string createPacketFromUserAppErrors(const QString &errMsg)
 {
-    auto json = Json::object{{"app errors", QStringJsonTrait{errMsg}}};
-    return Json{json}.dump();
+    std::string res;
+    appendPacketFromUserAppErrors(res, errMsg);
+    return res;
 }
 
 std::string createPacketFromScriptEnd()
 {
-    auto json = Json{"script end"};
-    return Json{json}.dump();
+    std::string res;
+    appendPacketFromScriptEnd(res);
+    return res;
 }
 
 std::string createPacketFromUserAppScriptLog(const QString &logMsg)
 {
-    auto json = Json::object{{"script logs", QStringJsonTrait{logMsg}}};
-    return Json{json}.dump();
+    std::string res;
+    appendPacketFromUserAppScriptLog(res, logMsg);
+    return res;
+}
+
+std::string createPacketFromAgentReady(int64_t readyTime,
+                                       int64_t sinceAppStartMs)
+{
+    std::string res;
+    appendPacketFromAgentReady(res, readyTime, sinceAppStartMs);
+    return res;
 }
 
 std::string createPacketFromRunScript(const QString &script,
                                       const QString &scriptFileName)
 {
-    auto json = Json::object{
-        {"run script",
-         Json::object{{"script", QStringJsonTrait{script}},
-                      {"file", QStringJsonTrait{scriptFileName}}}}};
-    return Json{json}.dump();
+    std::string res;
+    appendPacketFromRunScript(res, script, scriptFileName);
+    return res;
 }
 
+std::string createPacketFromHaltScript()
+{
+    std::string res;
+    appendPacketFromHaltScript(res);
+    return res;
+}
+
+namespace
+{
+inline QString stringFromUtf8(const std::string &s)
+{
+    return QString::fromUtf8(s.data(), static_cast<int>(s.size()));
+}
+
+//! @return false if message has wrong format
+bool handleMessageFromMonkeyApp(
+    const Json &elm, const std::function<void(QString)> &onNewUserAppEvent,
+    const std::function<void(QString)> &onUserAppError,
+    const std::function<void()> &onScriptEnd,
+    const std::function<void(QString)> &onScriptLog,
+    const std::function<void(QString)> &onParseError)
+{
+    if (elm.is_null())
+        return true;
+    if (elm.is_object() && elm.object_items().size() == 1u
+        && elm.object_items().begin()->first == "event") {
+        const Json &eventJson = elm.object_items().begin()->second;
+        if (!eventJson.is_object() || eventJson.object_items().size() != 1u
+            || eventJson.object_items().begin()->first != "script"
+            || !eventJson.object_items().begin()->second.is_string()) {
+            onParseError(QStringLiteral("event"));
+            return false;
+        }
+        onNewUserAppEvent(stringFromUtf8(
+            eventJson.object_items().begin()->second.string_value()));
+    } else if (elm.is_object() && elm.object_items().size() == 1u
+               && elm.object_items().begin()->first == "app errors") {
+        auto it = elm.object_items().begin();
+        if (!it->second.is_string()) {
+            onParseError(QStringLiteral("app errors"));
+            return false;
+        }
+        onUserAppError(stringFromUtf8(it->second.string_value()));
+    } else if (elm.is_object() && elm.object_items().size() == 1u
+               && elm.object_items().begin()->first == "script logs") {
+        auto it = elm.object_items().begin();
+        if (!it->second.is_string()) {
+            onParseError(QStringLiteral("script logs"));
+            return false;
+        }
+        onScriptLog(stringFromUtf8(it->second.string_value()));
+    } else if (elm.is_string() && elm.string_value() == "script end") {
+        onScriptEnd();
+    }
+    return true;
+}
+
+//! @return false if message has wrong format
+bool handleMessageFromGui(
+    const Json &elm, const std::function<void(QString, QString)> &onRunScript,
+    const std::function<void()> &onHaltScript,
+    const std::function<void(QString)> &onParseError)
+{
+    if (elm.is_null())
+        return true;
+    if (elm.is_object() && elm.object_items().size() == 1u
+        && elm.object_items().begin()->first == "run script") {
+        const Json &scriptJson = elm.object_items().begin()->second;
+
+        Json::object::const_iterator scriptIt, scriptFNameIt;
+        if (!scriptJson.is_object() || scriptJson.object_items().size() != 2u
+            || (scriptIt = scriptJson.object_items().find("script"))
+                   == scriptJson.object_items().end()
+            || !scriptIt->second.is_string()
+            || (scriptFNameIt = scriptJson.object_items().find("file"))
+                   == scriptJson.object_items().end()
+            || !scriptFNameIt->second.is_string()) {
+            onParseError(QStringLiteral("run script"));
+            return false;
+        }
+
+        onRunScript(stringFromUtf8(scriptIt->second.string_value()),
+                    stringFromUtf8(scriptFNameIt->second.string_value()));
+    } else if (elm.is_string() && elm.string_value() == "halt script") {
+        onHaltScript();
+    }
+    return true;
+}
+
+//! parse one complete message found by JsonStreamSplitter or in CBOR frame
+bool parseValue(Protocol protocol, const char *data, size_t size, Json &res,
+                const std::function<void(QString)> &onParseError)
+{
+    std::string err;
+    if (protocol == Protocol::Cbor) {
+        if (parseCbor(data, size, res, err))
+            return true;
+        onParseError(QStringLiteral("not valid cbor: %1")
+                         .arg(QString::fromStdString(err)));
+        return false;
+    }
+    size_t stopPos = 0;
+    auto jsonArr = Json::parse_multi({data, size}, stopPos, err);
+    if (!err.empty() || jsonArr.size() != 1u) {
+        const int previewLen = static_cast<int>(std::min<size_t>(size, 64));
+        onParseError(QStringLiteral("not valid json: %1")
+                         .arg(QString::fromUtf8(data, previewLen)));
+        return false;
+    }
+    res = std::move(jsonArr.front());
+    return true;
+}
+
+/**
+ * Find complete CBOR frames
+ * @return number of bytes in complete frames, all data if it is damaged
+ */
+size_t splitCborFrames(const char *data, size_t size,
+                       const std::function<void(const char *, size_t)> &onFrame,
+                       const std::function<void(QString)> &onParseError)
+{
+    size_t pos = 0;
+    while (size - pos >= cborFrameHeaderSize) {
+        uint32_t frameSize = 0;
+        for (size_t i = 0; i < cborFrameHeaderSize; ++i)
+            frameSize = (frameSize << 8)
+                        | static_cast<unsigned char>(data[pos + i]);
+        if (frameSize > maxCborFrameSize) {
+            onParseError(QStringLiteral("too big cbor frame: %1")
+                             .arg(frameSize));
+            return size;
+        }
+        if (size - pos - cborFrameHeaderSize < frameSize)
+            break;
+        onFrame(data + pos + cborFrameHeaderSize, frameSize);
+        pos += cborFrameHeaderSize + frameSize;
+    }
+    return pos;
+}
+
+inline bool isJsonSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+} // namespace
+
 void parseOutputFromMonkeyApp(
     const json11::string_view &data, size_t &stopPos,
     const std::function<void(QString)> &onNewUserAppEvent,
@@ -77,77 +458,154 @@ void parseOutputFromMonkeyApp(
     std::string err;
     auto jsonArr = Json::parse_multi(data, parserStopPos, err);
     stopPos = parserStopPos;
-    for (const Json &elm : jsonArr) {
-        if (elm.is_null())
-            continue;
-        if (elm.is_object() && elm.object_items().size() == 1u
-            && elm.object_items().begin()->first == "event") {
-            const Json &eventJson = elm.object_items().begin()->second;
-            if (!eventJson.is_object() || eventJson.object_items().size() != 1u
-                || eventJson.object_items().begin()->first != "script"
-                || !eventJson.object_items().begin()->second.is_string()) {
-                onParseError(QStringLiteral("event"));
-                return;
-            }
-            onNewUserAppEvent(QString::fromUtf8(eventJson.object_items()
-                                                    .begin()
-                                                    ->second.string_value()
-                                                    .c_str()));
-        } else if (elm.is_object() && elm.object_items().size() == 1u
-                   && elm.object_items().begin()->first == "app errors") {
-            auto it = elm.object_items().begin();
-            if (!it->second.is_string()) {
-                onParseError(QStringLiteral("app errors"));
-                return;
-            }
-            onUserAppError(
-                QString::fromUtf8(it->second.string_value().c_str()));
-        } else if (elm.is_object() && elm.object_items().size() == 1u
-                   && elm.object_items().begin()->first == "script logs") {
-            auto it = elm.object_items().begin();
-            if (!it->second.is_string()) {
-                onParseError(QStringLiteral("script logs"));
-                return;
-            }
-            onScriptLog(QString::fromUtf8(it->second.string_value().c_str()));
-        } else if (elm.is_string() && elm.string_value() == "script end") {
-            onScriptEnd();
-        }
-    }
+    for (const Json &elm : jsonArr)
+        if (!handleMessageFromMonkeyApp(elm, onNewUserAppEvent, onUserAppError,
+                                        onScriptEnd, onScriptLog,
+                                        onParseError))
+            return;
 }
 
 void parseOutputFromGui(
     const json11::string_view &data, size_t &parserStopPos,
     const std::function<void(QString, QString)> &onRunScript,
+    const std::function<void()> &onHaltScript,
     const std::function<void(QString)> &onParseError)
 {
     std::string err;
     auto jsonArr = Json::parse_multi(data, parserStopPos, err);
-    for (const Json &elm : jsonArr) {
-        if (elm.is_null())
-            continue;
-        if (elm.is_object() && elm.object_items().size() == 1u
-            && elm.object_items().begin()->first == "run script") {
-            const Json &scriptJson = elm.object_items().begin()->second;
-
-            Json::object::const_iterator scriptIt, scriptFNameIt;
-            if (!scriptJson.is_object()
-                || scriptJson.object_items().size() != 2u
-                || (scriptIt = scriptJson.object_items().find("script"))
-                       == scriptJson.object_items().end()
-                || !scriptIt->second.is_string()
-                || (scriptFNameIt = scriptJson.object_items().find("file"))
-                       == scriptJson.object_items().end()
-                || !scriptFNameIt->second.is_string()) {
-                onParseError(QStringLiteral("run script"));
-                return;
-            }
+    for (const Json &elm : jsonArr)
+        if (!handleMessageFromGui(elm, onRunScript, onHaltScript, onParseError))
+            return;
+}
 
-            onRunScript(
-                QString::fromUtf8(scriptIt->second.string_value().c_str()),
-                QString::fromUtf8(
-                    scriptFNameIt->second.string_value().c_str()));
+size_t JsonStreamSplitter::scan(
+    const char *data, size_t size,
+    const std::function<void(const char *, size_t)> &onValue)
+{
+    size_t consumed = 0;
+    size_t pos = scanPos_;
+    auto valueEnd = [&](size_t end) {
+        onValue(data + valueStart_, end - valueStart_);
+        consumed = end;
+        state_ = State::Between;
+    };
+    while (pos < size) {
+        const char c = data[pos];
+        switch (state_) {
+        case State::Between:
+            valueStart_ = pos;
+            if (c == '{' || c == '[') {
+                state_ = State::Container;
+                depth_ = 1;
+                inString_ = false;
+            } else if (c == '"') {
+                state_ = State::String;
+                escape_ = false;
+            } else if (isJsonSpace(c)) {
+                consumed = pos + 1;
+            } else {
+                state_ = State::Bare;
+            }
+            ++pos;
+            break;
+        case State::String:
+            ++pos;
+            if (escape_)
+                escape_ = false;
+            else if (c == '\\')
+                escape_ = true;
+            else if (c == '"')
+                valueEnd(pos);
+            break;
+        case State::Container:
+            ++pos;
+            if (inString_) {
+                if (escape_)
+                    escape_ = false;
+                else if (c == '\\')
+                    escape_ = true;
+                else if (c == '"')
+                    inString_ = false;
+            } else if (c == '"') {
+                inString_ = true;
+                escape_ = false;
+            } else if (c == '{' || c == '[') {
+                ++depth_;
+            } else if ((c == '}' || c == ']') && --depth_ == 0) {
+                valueEnd(pos);
+            }
+            break;
+        case State::Bare:
+            // number or literal ends only with next token
+            if (isJsonSpace(c) || c == '{' || c == '[' || c == '"' || c == '}'
+                || c == ']')
+                valueEnd(pos);
+            else
+                ++pos;
+            break;
         }
     }
+    scanPos_ = pos - consumed;
+    valueStart_ -= std::min(valueStart_, consumed);
+    return consumed;
+}
+
+GuiStreamParser::GuiStreamParser(
+    std::function<void(QString, QString)> onRunScript,
+    std::function<void()> onHaltScript,
+    std::function<void(QString)> onParseError, Protocol protocol)
+    : protocol_(protocol), onRunScript_(std::move(onRunScript)),
+      onHaltScript_(std::move(onHaltScript)),
+      onParseError_(std::move(onParseError))
+{
+}
+
+void GuiStreamParser::feed(const char *data, size_t size)
+{
+    buf_.append(data, size);
+    auto onValue = [this](const char *value, size_t len) {
+        Json elm;
+        if (parseValue(protocol_, value, len, elm, onParseError_))
+            handleMessageFromGui(elm, onRunScript_, onHaltScript_,
+                                 onParseError_);
+    };
+    const size_t consumed
+        = protocol_ == Protocol::Cbor
+              ? splitCborFrames(buf_.data(), buf_.size(), onValue,
+                                onParseError_)
+              : splitter_.scan(buf_.data(), buf_.size(), onValue);
+    buf_.erase(0, consumed);
+}
+
+MonkeyAppStreamParser::MonkeyAppStreamParser(
+    std::function<void(QString)> onNewUserAppEvent,
+    std::function<void(QString)> onUserAppError,
+    std::function<void()> onScriptEnd,
+    std::function<void(QString)> onScriptLog,
+    std::function<void(QString)> onParseError, Protocol protocol)
+    : protocol_(protocol), onNewUserAppEvent_(std::move(onNewUserAppEvent)),
+      onUserAppError_(std::move(onUserAppError)),
+      onScriptEnd_(std::move(onScriptEnd)),
+      onScriptLog_(std::move(onScriptLog)),
+      onParseError_(std::move(onParseError))
+{
+}
+
+void MonkeyAppStreamParser::feed(const char *data, size_t size)
+{
+    buf_.append(data, size);
+    auto onValue = [this](const char *value, size_t len) {
+        Json elm;
+        if (parseValue(protocol_, value, len, elm, onParseError_))
+            handleMessageFromMonkeyApp(elm, onNewUserAppEvent_,
+                                       onUserAppError_, onScriptEnd_,
+                                       onScriptLog_, onParseError_);
+    };
+    const size_t consumed
+        = protocol_ == Protocol::Cbor
+              ? splitCborFrames(buf_.data(), buf_.size(), onValue,
+                                onParseError_)
+              : splitter_.scan(buf_.data(), buf_.size(), onValue);
+    buf_.erase(0, consumed);
 }
 } // namespace qt_monkey_app
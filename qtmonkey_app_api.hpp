@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <string>
 
+#include <QtCore/QByteArray>
 #include <QtCore/QString>
 
 namespace json11
@@ -12,17 +14,67 @@ class string_view;
 
 namespace qt_monkey_app
 {
+/**
+ * Encoding of messages between gui and qtmonkey_app: text JSON values
+ * one after another, or CBOR data items with the same structure,
+ * each one prefixed by its size as 32-bit big-endian number
+ */
+enum class Protocol { Json, Cbor };
+//! @return false if name is not "json" or "cbor"
+bool parseProtocolName(const char *name, Protocol &protocol);
+
+/**
+ * Write packet at the end of out, so several packets can be collected
+ * in one reusable buffer, createPacketFrom* return them as new string
+ */
+void appendPacketFromUserAppEvent(std::string &out, const QString &scriptLines,
+                                  Protocol protocol = Protocol::Json);
+//! the same, but text is already in UTF-8, so it is not converted
+void appendPacketFromUserAppEvent(std::string &out,
+                                  const QByteArray &scriptLines,
+                                  Protocol protocol = Protocol::Json);
+void appendPacketFromUserAppOutput(std::string &out,
+                                   const QString &stdOutLines,
+                                   Protocol protocol = Protocol::Json);
+void appendPacketFromUserAppErrors(std::string &out, const QString &errOut,
+                                   Protocol protocol = Protocol::Json);
+void appendPacketFromUserAppErrors(std::string &out, const QByteArray &errOut,
+                                   Protocol protocol = Protocol::Json);
+void appendPacketFromScriptEnd(std::string &out,
+                               Protocol protocol = Protocol::Json);
+void appendPacketFromUserAppScriptLog(std::string &out, const QString &logMsg,
+                                      Protocol protocol = Protocol::Json);
+void appendPacketFromUserAppScriptLog(std::string &out,
+                                      const QByteArray &logMsg,
+                                      Protocol protocol = Protocol::Json);
+/**
+ * @param readyTime time in ms since epoch when agent become ready
+ * @param sinceAppStartMs how long it takes from start of user app
+ */
+void appendPacketFromAgentReady(std::string &out, int64_t readyTime,
+                                int64_t sinceAppStartMs,
+                                Protocol protocol = Protocol::Json);
+void appendPacketFromRunScript(std::string &out, const QString &script,
+                               const QString &scriptFileName,
+                               Protocol protocol = Protocol::Json);
+void appendPacketFromHaltScript(std::string &out,
+                                Protocol protocol = Protocol::Json);
+
 std::string createPacketFromUserAppEvent(const QString &scriptLines);
 std::string createPacketFromUserAppOutput(const QString &stdOutLines);
 std::string createPacketFromUserAppErrors(const QString &errOut);
 std::string createPacketFromScriptEnd();
 std::string createPacketFromUserAppScriptLog(const QString &logMsg);
+std::string createPacketFromAgentReady(int64_t readyTime,
+                                       int64_t sinceAppStartMs);
 std::string createPacketFromRunScript(const QString &script,
                                       const QString &scriptFileName);
+std::string createPacketFromHaltScript();
 
 void parseOutputFromGui(
     const json11::string_view &data, size_t &parserStopPos,
     const std::function<void(QString, QString)> &onRunScript,
+    const std::function<void()> &onHaltScript,
     const std::function<void(QString)> &onParseError);
 
 void parseOutputFromMonkeyApp(
@@ -32,4 +84,77 @@ void parseOutputFromMonkeyApp(
     const std::function<void()> &onScriptEnd,
     const std::function<void(QString)> &onScriptLog,
     const std::function<void(QString)> &onParseError);
+
+/**
+ * Find ends of top level JSON values in byte stream. State is kept
+ * between calls, so every byte of stream is scanned only once.
+ */
+class JsonStreamSplitter final
+{
+public:
+    /**
+     * @param data not consumed yet part of stream, begins with bytes
+     * returned as not consumed by previous call
+     * @param onValue called for every complete value found in new bytes
+     * @return number of bytes from start of data with complete values,
+     * caller should remove them before the next call
+     */
+    size_t scan(const char *data, size_t size,
+                const std::function<void(const char *, size_t)> &onValue);
+    void reset() { *this = JsonStreamSplitter(); }
+
+private:
+    enum class State { Between, Container, String, Bare };
+    State state_ = State::Between;
+    //! state inside container
+    bool inString_ = false;
+    bool escape_ = false;
+    size_t depth_ = 0;
+    size_t scanPos_ = 0;
+    size_t valueStart_ = 0;
+};
+
+//! resumable variant of parseOutputFromGui, also supports CBOR
+class GuiStreamParser final
+{
+public:
+    GuiStreamParser(std::function<void(QString, QString)> onRunScript,
+                    std::function<void()> onHaltScript,
+                    std::function<void(QString)> onParseError,
+                    Protocol protocol = Protocol::Json);
+    //! handle next bytes from gui, callbacks called for complete messages
+    void feed(const char *data, size_t size);
+
+private:
+    Protocol protocol_;
+    std::string buf_;
+    JsonStreamSplitter splitter_;
+    std::function<void(QString, QString)> onRunScript_;
+    std::function<void()> onHaltScript_;
+    std::function<void(QString)> onParseError_;
+};
+
+//! resumable variant of parseOutputFromMonkeyApp, also supports CBOR
+class MonkeyAppStreamParser final
+{
+public:
+    MonkeyAppStreamParser(std::function<void(QString)> onNewUserAppEvent,
+                          std::function<void(QString)> onUserAppError,
+                          std::function<void()> onScriptEnd,
+                          std::function<void(QString)> onScriptLog,
+                          std::function<void(QString)> onParseError,
+                          Protocol protocol = Protocol::Json);
+    //! handle next bytes from qtmonkey_app
+    void feed(const char *data, size_t size);
+
+private:
+    Protocol protocol_;
+    std::string buf_;
+    JsonStreamSplitter splitter_;
+    std::function<void(QString)> onNewUserAppEvent_;
+    std::function<void(QString)> onUserAppError_;
+    std::function<void()> onScriptEnd_;
+    std::function<void(QString)> onScriptLog_;
+    std::function<void(QString)> onParseError_;
+};
 } // namespace qt_monkey_app
@@ -29,8 +29,28 @@ static const QLatin1String protocolModePrefName{"protocol mode"};
 static const QLatin1String pathToScriptDirPrefName{"path to script dir"};
 
 QtMonkeyAppCtrl::QtMonkeyAppCtrl(const QString &appPath,
-                                 const QStringList &appArgs, QObject *parent)
-    : QObject(parent)
+                                 const QStringList &appArgs,
+                                 qt_monkey_app::Protocol protocol,
+                                 QObject *parent)
+    : QObject(parent), protocol_(protocol),
+      outputParser_(
+          [this](QString eventScriptLines) {
+              emit monkeyAppNewEvent(std::move(eventScriptLines));
+          },
+          [this](QString userAppErrors) {
+              emit monkeyUserAppError(std::move(userAppErrors));
+          },
+          [this]() { // on script end
+              emit monkeyScriptEnd();
+          },
+          [this](QString scriptLog) { emit monkeScriptLog(scriptLog); },
+          [this](QString data) {
+              qtmonkeyApp_.kill();
+              emit monkeyAppFinishedSignal(
+                  T_("Internal Error: problem with monkey<->gui protocol: %1")
+                      .arg(data));
+          },
+          protocol)
 {
     const QString appDirPath = QCoreApplication::applicationDirPath();
     const QString monkeyAppFileName = QFile::decodeName(QTMONKEY_APP_NAME);
@@ -52,6 +72,8 @@ QtMonkeyAppCtrl::QtMonkeyAppCtrl(const QString &appPath,
             SLOT(monkeyAppNewErrOutput()));
 
     QStringList args;
+    if (protocol_ == qt_monkey_app::Protocol::Cbor)
+        args << QStringLiteral("--protocol=cbor");
     args << QStringLiteral("--user-app") << appPath << appArgs;
     qtmonkeyApp_.start(monkeyAppPath, args);
 }
@@ -77,35 +99,11 @@ void QtMonkeyAppCtrl::monkeyAppFinished(int exitCode,
 
 void QtMonkeyAppCtrl::monkeyAppNewOutput()
 {
-    qDebug("%s: begin", Q_FUNC_INFO);
     const QByteArray out = qtmonkeyApp_.readAllStandardOutput();
-    jsonFromMonkey_.append(out);
-    qDebug("%s: json |%s|", Q_FUNC_INFO, qPrintable(jsonFromMonkey_));
-
-    std::string::size_type parserStopPos;
-    qt_monkey_app::parseOutputFromMonkeyApp(
-        {jsonFromMonkey_.constData(),
-         static_cast<size_t>(jsonFromMonkey_.size())},
-        parserStopPos,
-        [this](QString eventScriptLines) {
-            emit monkeyAppNewEvent(std::move(eventScriptLines));
-        },
-        [this](QString userAppErrors) {
-            emit monkeyUserAppError(std::move(userAppErrors));
-        },
-        [this]() { // on script end
-            emit monkeyScriptEnd();
-        },
-        [this](QString scriptLog) { emit monkeScriptLog(scriptLog); },
-        [this](QString data) {
-            qtmonkeyApp_.kill();
-            emit monkeyAppFinishedSignal(
-                T_("Internal Error: problem with monkey<->gui protocol: %1")
-                    .arg(data));
-        });
-
-    if (parserStopPos != 0)
-        jsonFromMonkey_.remove(0, parserStopPos);
+    // output may be binary CBOR and may contain huge logs,
+    // so print only size of it
+    qDebug("%s: got %d bytes", Q_FUNC_INFO, out.size());
+    outputParser_.feed(out.constData(), static_cast<size_t>(out.size()));
 }
 
 void QtMonkeyAppCtrl::monkeyAppNewErrOutput()
@@ -118,9 +116,25 @@ void QtMonkeyAppCtrl::monkeyAppNewErrOutput()
 void QtMonkeyAppCtrl::runScript(const QString &script,
                                 const QString &scriptFileName)
 {
-    const std::string data
-        = qt_monkey_app::createPacketFromRunScript(script, scriptFileName)
-          + '\n';
+    std::string packet;
+    qt_monkey_app::appendPacketFromRunScript(packet, script, scriptFileName,
+                                             protocol_);
+    if (protocol_ == qt_monkey_app::Protocol::Json)
+        packet += '\n';
+    sendToMonkey(packet);
+}
+
+void QtMonkeyAppCtrl::haltScript()
+{
+    std::string packet;
+    qt_monkey_app::appendPacketFromHaltScript(packet, protocol_);
+    if (protocol_ == qt_monkey_app::Protocol::Json)
+        packet += '\n';
+    sendToMonkey(packet);
+}
+
+void QtMonkeyAppCtrl::sendToMonkey(const std::string &data)
+{
     quint64 sentBytes = 0;
     do {
         qint64 nbytes = qtmonkeyApp_.write(data.data() + sentBytes,
@@ -194,7 +208,8 @@ static QStringList splitCommandLine(const QString &cmdLine)
 QtMonkeyAppCtrl *QtMonkeyWindow::getMonkeyCtrl() try {
     if (monkeyCtrl_ == nullptr) {
         monkeyCtrl_ = new QtMonkeyAppCtrl(
-            leTestApp_->text(), splitCommandLine(leTestAppArgs_->text()), this);
+            leTestApp_->text(), splitCommandLine(leTestAppArgs_->text()),
+            protocol_, this);
         connect(monkeyCtrl_, SIGNAL(monkeyAppFinishedSignal(QString)), this,
                 SLOT(onMonkeyAppFinishedSignal(QString)));
         connect(monkeyCtrl_, SIGNAL(monkeyAppNewEvent(const QString &)), this,
@@ -372,6 +387,12 @@ void QtMonkeyWindow::on_pbRunScript__pressed()
     changeState(State::PlayingEvents);
 }
 
+void QtMonkeyWindow::on_pbHaltScript__pressed()
+{
+    SETUP_WIN_CTRL(ctrl)
+    ctrl->haltScript();
+}
+
 void QtMonkeyWindow::changeState(State val)
 {
     qDebug("%s: begin was val %d, now val %d", Q_FUNC_INFO,
@@ -381,16 +402,19 @@ void QtMonkeyWindow::changeState(State val)
     case State::DoNothing:
         teScriptEdit_->setReadOnly(false);
         pbRunScript_->setEnabled(true);
+        pbHaltScript_->setEnabled(false);
         pbStartRecording_->setEnabled(true);
         break;
     case State::RecordEvents:
         teScriptEdit_->setReadOnly(false);
         pbRunScript_->setEnabled(true);
+        pbHaltScript_->setEnabled(false);
         pbStartRecording_->setEnabled(false);
         break;
     case State::PlayingEvents:
         teScriptEdit_->setReadOnly(true);
         pbRunScript_->setEnabled(false);
+        pbHaltScript_->setEnabled(true);
         pbStartRecording_->setEnabled(false);
         break;
     }
@@ -471,14 +495,27 @@ void QtMonkeyWindow::on_pbSaveScript__pressed()
 int main(int argc, char *argv[])
 {
     const char *enc = nullptr;
+    qt_monkey_app::Protocol protocol = qt_monkey_app::Protocol::Json;
+    static const char protocolOption[] = "--protocol=";
     for (int i = 1; i < argc; ++i) {
         if (std::strcmp(argv[i], "--encoding") == 0) {
             if ((i + 1) >= argc) {
-                qFatal("Usage: %s [--encoding scripts_charset]", argv[0]);
+                qFatal("Usage: %s [--encoding scripts_charset] "
+                       "[--protocol=json|cbor]",
+                       argv[0]);
                 return EXIT_FAILURE;
             }
             ++i;
             enc = argv[i];
+        } else if (std::strncmp(argv[i], protocolOption,
+                                sizeof(protocolOption) - 1)
+                       == 0
+                   && !qt_monkey_app::parseProtocolName(
+                          argv[i] + sizeof(protocolOption) - 1, protocol)) {
+            qFatal("Usage: %s [--encoding scripts_charset] "
+                   "[--protocol=json|cbor]",
+                   argv[0]);
+            return EXIT_FAILURE;
         }
     }
     QApplication app(argc, argv);
@@ -487,6 +524,7 @@ int main(int argc, char *argv[])
     if (enc != nullptr) {
         mw.setEncoding(enc);
     }
+    mw.setProtocol(protocol);
     mw.show();
     return app.exec();
 }
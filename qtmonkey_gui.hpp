@@ -1,10 +1,13 @@
 #pragma once
 
+#include <string>
+
 #include <QWidget>
 #include <QtCore/QProcess>
 #include <QtCore/QStringList>
 #include <QtCore/QTimer>
 
+#include "qtmonkey_app_api.hpp"
 #include "ui_qtmonkey_gui.h"
 
 class QtMonkeyAppCtrl
@@ -23,10 +26,12 @@ signals:
     void criticalError(const QString &);
 
 public:
-    explicit QtMonkeyAppCtrl(const QString &appPath, const QStringList &appArgs,
-                             QObject *parent = nullptr);
+    QtMonkeyAppCtrl(const QString &appPath, const QStringList &appArgs,
+                    qt_monkey_app::Protocol protocol,
+                    QObject *parent = nullptr);
     void runScript(const QString &script,
                    const QString &scriptFilename = QString());
+    void haltScript();
 private slots:
     void monkeyAppError(QProcess::ProcessError);
     void monkeyAppFinished(int, QProcess::ExitStatus);
@@ -35,7 +40,10 @@ private slots:
 
 private:
     QProcess qtmonkeyApp_;
-    QByteArray jsonFromMonkey_;
+    qt_monkey_app::Protocol protocol_;
+    qt_monkey_app::MonkeyAppStreamParser outputParser_;
+
+    void sendToMonkey(const std::string &data);
 };
 
 class QtMonkeyWindow
@@ -50,6 +58,7 @@ public:
     QtMonkeyWindow(QWidget *parent = nullptr);
     ~QtMonkeyWindow();
     void setEncoding(QByteArray enc) { encoding_ = std::move(enc); }
+    void setProtocol(qt_monkey_app::Protocol protocol) { protocol_ = protocol; }
 private slots:
     // auto connection
     void on_pbStartRecording__pressed();
@@ -57,6 +66,7 @@ private slots:
     void on_leTestAppArgs__textEdited(const QString &text);
     void on_pbBrowse__pressed();
     void on_pbRunScript__pressed();
+    void on_pbHaltScript__pressed();
     void on_pbClearLog__pressed();
     void on_cbProtocolRunning__toggled(bool checked);
     void on_pbSaveScriptToFile__pressed();
@@ -89,6 +99,7 @@ private:
     State state_ = State::DoNothing;
     QString scriptDir_;
     QByteArray encoding_{"UTF-8"};
+    qt_monkey_app::Protocol protocol_ = qt_monkey_app::Protocol::Json;
     QString scriptFileName_;
 
     QtMonkeyAppCtrl *getMonkeyCtrl();
@@ -1,8 +1,12 @@
 //#define DEBUG_SCRIPT_API
 #include "script_api.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <thread>
 
 #include <QAbstractButton>
@@ -31,9 +35,14 @@
 #include "common.hpp"
 #include "script_runner.hpp"
 #include "user_events_analyzer.hpp"
+#include "widgets_index.hpp"
 
 using qt_monkey_agent::Agent;
 using qt_monkey_agent::ScriptAPI;
+using qt_monkey_agent::Private::WidgetIdPart;
+using qt_monkey_agent::Private::WidgetPath;
+using qt_monkey_agent::Private::WidgetsIndex;
+using qt_monkey_common::Semaphore;
 
 #ifdef DEBUG_SCRIPT_API
 #define DBGPRINT(fmt, ...) qDebug(fmt, __VA_ARGS__)
@@ -60,6 +69,8 @@ using qt_monkey_agent::internal::MouseBtnEventType;
 namespace
 {
 static const int sleepTimeForWaitWidgetMs = 70;
+static const int recheckWidgetIntervalMs = 500;
+static const int maxStepIdleWaitMs = 120;
 
 class MyLineEdit final : public QLineEdit
 {
@@ -77,10 +88,13 @@ static QWidget *bruteForceWidgetSearch(const QString &objectName,
                                        const QString &className,
                                        bool shouldBeEnabled)
 {
+    const QByteArray classNameLatin1 = className.toLatin1();
     const QWidgetList allWdg = QApplication::allWidgets();
     for (QWidget *widget : allWdg) {
         if (!className.isEmpty()
-            && className == widget->metaObject()->className()) {
+            && std::strcmp(classNameLatin1.constData(),
+                           widget->metaObject()->className())
+                   == 0) {
             DBGPRINT("%s: found widget with class %s, w %s", Q_FUNC_INFO,
                      qPrintable(className),
                      widget == nullptr ? "null" : "not null");
@@ -104,12 +118,18 @@ static QWidget *bruteForceWidgetSearch(const QString &objectName,
     return nullptr;
 }
 
-static QWidget *doGetWidgetWithSuchName(const QString &objectName,
+static QWidget *doGetWidgetWithSuchName(WidgetsIndex &index,
+                                        const QString &objectName,
                                         bool shouldBeEnabled)
 {
-    QStringList names = objectName.split('.');
+    QWidget *w = index.cachedWidget(objectName, shouldBeEnabled);
+    if (w != nullptr) {
+        DBGPRINT("%s: %s found in cache", Q_FUNC_INFO, qPrintable(objectName));
+        return w;
+    }
+    const WidgetPath &names = index.widgetPath(objectName);
 
-    if (names.isEmpty()) {
+    if (names.empty()) {
         DBGPRINT("%s: list of widget's name empty\n", Q_FUNC_INFO);
         return nullptr;
     }
@@ -127,100 +147,74 @@ static QWidget *doGetWidgetWithSuchName(const QString &objectName,
     DBGPRINT("(%s, %d): active Window %s", Q_FUNC_INFO, __LINE__,
              win != nullptr ? qPrintable(win->objectName()) : "nullptr");
 #endif
-    const QString &mainWidgetName = names.first();
+    const WidgetIdPart &mainWidget = names.front();
+    const QString &mainWidgetName = mainWidget.name;
     DBGPRINT("(%s, %d): search widget with such name %s", Q_FUNC_INFO, __LINE__,
              qPrintable(mainWidgetName));
-    QList<QObject *> lst
-        = QCoreApplication::instance()->findChildren<QObject *>(mainWidgetName);
-    if (lst.isEmpty()) {
-        const QWidgetList topLvlWdg = QApplication::topLevelWidgets();
-        for (QWidget *widget : topLvlWdg) {
-            if (mainWidgetName == widget->objectName()) {
-                lst << widget;
-                break;
-            } else {
-                lst = widget->findChildren<QObject *>(mainWidgetName);
-            }
-
-            if (!lst.isEmpty())
-                break;
-        }
-    }
-    const QRegExp class_name_rx("^<class_name=([^>]+)>$");
-    if (lst.isEmpty()) {
-        DBGPRINT("%s: list of widget's name empty, start bruteforce\n",
-                 Q_FUNC_INFO);
-        //! \todo if there is class name use it in brute search
-        QString className;
-        if (class_name_rx.indexIn(mainWidgetName) != -1)
-            className = class_name_rx.cap(1);
-        QWidget *w = bruteForceWidgetSearch(mainWidgetName, className,
-                                            shouldBeEnabled);
-        if (w == nullptr)
-            return nullptr;
-        lst << w;
-    }
+    w = index.findByName(mainWidgetName);
+    if (w == nullptr) {
+        DBGPRINT("%s: %s not in index, search in tree", Q_FUNC_INFO,
+                 qPrintable(mainWidgetName));
+        QList<QObject *> lst
+            = QCoreApplication::instance()->findChildren<QObject *>(
+                mainWidgetName);
+        if (lst.isEmpty()) {
+            const QWidgetList topLvlWdg = QApplication::topLevelWidgets();
+            for (QWidget *widget : topLvlWdg) {
+                if (mainWidgetName == widget->objectName()) {
+                    lst << widget;
+                    break;
+                } else {
+                    lst = widget->findChildren<QObject *>(mainWidgetName);
+                }
 
-    //! \todo may be try all variants, instead of lst.first?
-    QWidget *w = qobject_cast<QWidget *>(lst.first());
-    assert(w != nullptr);
-    DBGPRINT("%s: we found %s", Q_FUNC_INFO, qPrintable(w->objectName()));
-    names.removeFirst();
-
-    while (!names.isEmpty()) {
-        const QObjectList &clist = w->children();
-        const QString &el = names.first();
-        QString class_name;
-        int class_order = 0;
-        if (class_name_rx.indexIn(el) != -1) {
-            class_name = class_name_rx.cap(1);
-            const QStringList res
-                = class_name.split(",", QString::SkipEmptyParts);
-            if (res.size() == 0)
-                class_name = "";
-            else
-                class_name = res[0];
-            if (res.size() > 1) {
-                bool ok = false;
-                class_order = res[1].toInt(&ok);
-                if (!ok)
-                    class_order = 0;
+                if (!lst.isEmpty())
+                    break;
             }
-            DBGPRINT("%s: search object with class: %s, order %d", Q_FUNC_INFO,
-                     qPrintable(class_name), class_order);
         }
-        int order = 0;
-        QObjectList::const_iterator it;
-        for (it = clist.begin(); it != clist.end(); ++it) {
-            if ((!class_name.isEmpty()
-                 && class_name == (*it)->metaObject()->className())
-                || (*it)->objectName() == el) {
-                DBGPRINT("%s: found widget %s, order %d", Q_FUNC_INFO,
-                         qPrintable(el), order);
-                w = qobject_cast<QWidget *>(*it);
-                if (shouldBeEnabled && !(w->isVisible() && w->isEnabled()))
-                    continue;
-                if (order++ != class_order)
-                    continue;
-
-                names.removeFirst();
-                break;
-            }
+        if (lst.isEmpty()) {
+            DBGPRINT("%s: list of widget's name empty, start bruteforce\n",
+                     Q_FUNC_INFO);
+            //! \todo use order of class in brute search
+            const QString className
+                = mainWidget.order == 0 ? mainWidget.className : QString();
+            QWidget *bw = bruteForceWidgetSearch(mainWidgetName, className,
+                                                 shouldBeEnabled);
+            if (bw == nullptr)
+                return nullptr;
+            lst << bw;
         }
 
-        if (it == clist.end()) {
+        //! \todo may be try all variants, instead of lst.first?
+        w = qobject_cast<QWidget *>(lst.first());
+        assert(w != nullptr);
+        index.addNamed(*w);
+    }
+    DBGPRINT("%s: we found %s", Q_FUNC_INFO, qPrintable(w->objectName()));
+
+    for (size_t i = 1; i < names.size(); ++i) {
+        const WidgetIdPart &el = names[i];
+        DBGPRINT("%s: search object with name %s, class: %s, order %d",
+                 Q_FUNC_INFO, qPrintable(el.name), qPrintable(el.className),
+                 el.order);
+        QWidget *child = index.findChild(*w, el.name, el.className, el.order,
+                                         shouldBeEnabled);
+        if (child == nullptr) {
             DBGPRINT("(%s, %d): Can not find object with such name %s, try "
                      "brute search",
-                     Q_FUNC_INFO, __LINE__, qPrintable(el));
-            w = bruteForceWidgetSearch(el, class_name, shouldBeEnabled);
-            if (w == nullptr) {
+                     Q_FUNC_INFO, __LINE__, qPrintable(el.name));
+            child = bruteForceWidgetSearch(el.name, el.className,
+                                           shouldBeEnabled);
+            if (child == nullptr) {
                 DBGPRINT("(%s, %d) brute force failed", Q_FUNC_INFO, __LINE__);
                 return nullptr;
             }
-            names.removeFirst();
         }
+        DBGPRINT("%s: found widget %s", Q_FUNC_INFO, qPrintable(el.name));
+        w = child;
     }
 
+    index.cacheWidget(objectName, shouldBeEnabled, *w);
     return w;
 }
 
@@ -568,6 +562,94 @@ void emulateMouseBtnEventInGuiThread(Agent &agent, const QPoint &posA,
     }
 }
 
+/**
+ * Parse key sequence in form like Ctrl+P
+ * @return error message or empty string if all ok
+ */
+static QString parseKeySequence(const QString &keyseqStr, QKeySequence &keySeq,
+                                Qt::KeyboardModifiers &modifiers)
+{
+    keySeq = QKeySequence::fromString(keyseqStr);
+    if (keySeq.isEmpty())
+        return QStringLiteral("Invalid key sequnce(%1): empty").arg(keyseqStr);
+    modifiers = Qt::NoModifier;
+    for (decltype(keySeq.count()) i = 0;
+         keySeq.count() > 0 && i < (keySeq.count() - 1); ++i)
+        modifiers |= static_cast<Qt::KeyboardModifier>(keySeq[i]);
+    return QString();
+}
+
+/**
+ * @param realSyms if not null, text of key event
+ */
+static void keyClickInGuiThread(QWidget &w, const QKeySequence &keySeq,
+                                Qt::KeyboardModifiers modifiers,
+                                const QString *realSyms)
+{
+    if (!w.hasFocus())
+        w.setFocus(Qt::ShortcutFocusReason);
+    DBGPRINT("%s: key(%s) click for widget", Q_FUNC_INFO,
+             qPrintable(keySeq.toString()));
+    auto ascii_key = static_cast<Qt::Key>(keySeq[keySeq.count() - 1]);
+    if (realSyms != nullptr)
+        QTest::sendKeyEvent(QTest::KeyAction::Click, &w, ascii_key, *realSyms,
+                            modifiers);
+    else
+        QTest::keyClick(&w, ascii_key, modifiers, -1);
+    DBGPRINT("%s: key(%s) click for widget DONE", Q_FUNC_INFO,
+             qPrintable(keySeq.toString()));
+}
+
+/**
+ * Execute one step of batch, widget already found
+ * @return error message or empty string if all ok
+ */
+static QString runBatchStepInGuiThread(Agent &agent, QWidget &w,
+                                       const QVariantMap &step)
+{
+    const QString cmd = step.value("cmd").toString();
+    const QString widgetName = step.value("widget").toString();
+    static const std::pair<QLatin1String, MouseBtnEventType> mouseCmds[] = {
+        {QLatin1String("mouseClick"), MouseBtnEventType::Click},
+        {QLatin1String("mouseDClick"), MouseBtnEventType::DClick},
+        {QLatin1String("mousePress"), MouseBtnEventType::Press},
+        {QLatin1String("mouseRelease"), MouseBtnEventType::Release},
+    };
+    for (const auto &mouseCmd : mouseCmds) {
+        if (cmd != mouseCmd.first)
+            continue;
+        Qt::MouseButton btn;
+        const QString buttonName = step.value("button").toString();
+        if (!qt_monkey_agent::stringToMouseButton(buttonName, btn))
+            return QStringLiteral("Unknown mouse button %1").arg(buttonName);
+        const QPoint pos{step.value("x").toInt(), step.value("y").toInt()};
+        emulateMouseBtnEventInGuiThread(agent, pos, w, btn, mouseCmd.second);
+        return QString();
+    }
+    if (cmd == QLatin1String("keyClick")) {
+        QKeySequence keySeq;
+        Qt::KeyboardModifiers modifiers;
+        const QString errMsg = parseKeySequence(step.value("keys").toString(),
+                                                keySeq, modifiers);
+        if (!errMsg.isEmpty())
+            return errMsg;
+        const QString realSyms = step.value("text").toString();
+        keyClickInGuiThread(w, keySeq, modifiers,
+                            step.contains("text") ? &realSyms : nullptr);
+        return QString();
+    }
+    if (cmd == QLatin1String("activateItem")) {
+        const Qt::MatchFlag flag
+            = step.contains("flags")
+                  ? matchFlagFromString(step.value("flags").toString())
+                  : Qt::MatchStartsWith;
+        return activateItemInGuiThread(agent, &w, step.value("item").toString(),
+                                       false, flag);
+    }
+    return QStringLiteral("Unknown command '%1' for widget %2")
+        .arg(cmd, widgetName);
+}
+
 } // namespace
 
 void qt_monkey_agent::clickInGuiThread(qt_monkey_agent::Agent &agent,
@@ -586,11 +668,20 @@ QWidget *qt_monkey_agent::getWidgetWithSuchName(
     DBGPRINT("%s begin, search %s", Q_FUNC_INFO, qPrintable(objectName));
     QWidget *w = nullptr;
 
-    const int maxAttempts
-        = (maxTimeToFindWidgetSec * 1000) / sleepTimeForWaitWidgetMs + 1;
-    for (int i = 0; i < maxAttempts; ++i) {
-        agent.runCodeInGuiThreadSync([&w, &objectName, shouldBeEnabled] {
-            w = doGetWidgetWithSuchName(objectName, shouldBeEnabled);
+    // widget is waited by the last part of its id
+    const QString waitName = objectName.section('.', -1);
+    const QString waitClassName
+        = qt_monkey_agent::Private::parseWidgetId(waitName).front().className;
+
+    using Clock = std::chrono::steady_clock;
+    const auto deadline
+        = Clock::now() + std::chrono::seconds(maxTimeToFindWidgetSec);
+    std::shared_ptr<Semaphore> waitSem{new Semaphore{0}};
+    for (;;) {
+        agent.runCodeInGuiThreadSync([&agent, &w, &objectName, shouldBeEnabled,
+                                      &waitName, &waitClassName, waitSem] {
+            WidgetsIndex &index = agent.widgetsIndex();
+            w = doGetWidgetWithSuchName(index, objectName, shouldBeEnabled);
             DBGPRINT("%s, %d: doGetWidgetWithSuchName return w '%s'",
                      Q_FUNC_INFO, __LINE__,
                      w != nullptr ? qPrintable(w->objectName()) : "nullptr");
@@ -598,22 +689,41 @@ QWidget *qt_monkey_agent::getWidgetWithSuchName(
                 DBGPRINT("%s: canNotFind return true", Q_FUNC_INFO);
                 w = nullptr;
             }
+            if (w == nullptr
+                || (shouldBeEnabled && !(w->isVisible() && w->isEnabled())))
+                // register in the same call as search,
+                // so we not miss any event
+                index.addWaiter(waitClassName.isEmpty() ? waitName : QString(),
+                                waitClassName, waitSem);
             return QString();
         });
 
-        if (w == nullptr
-            || (shouldBeEnabled && !(w->isVisible() && w->isEnabled()))) {
-            DBGPRINT("%s, %d: w '%s', v %d e %d", Q_FUNC_INFO, __LINE__,
-                     w != nullptr ? qPrintable(w->objectName()) : "nullptr",
-                     static_cast<int>(w ? w->isVisible() : 0),
-                     static_cast<int>(w ? w->isEnabled() : 0));
-            w = nullptr;
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(sleepTimeForWaitWidgetMs));
-        } else {
+        if (w != nullptr
+            && !(shouldBeEnabled && !(w->isVisible() && w->isEnabled()))) {
             DBGPRINT("%s: widget found", Q_FUNC_INFO);
             break;
         }
+        DBGPRINT("%s, %d: w '%s', v %d e %d", Q_FUNC_INFO, __LINE__,
+                 w != nullptr ? qPrintable(w->objectName()) : "nullptr",
+                 static_cast<int>(w ? w->isVisible() : 0),
+                 static_cast<int>(w ? w->isEnabled() : 0));
+        w = nullptr;
+        const auto now = Clock::now();
+        if (now >= deadline || agent.scriptHalted())
+            break;
+        // there is no event for QObject::setObjectName,
+        // so recheck from time to time even without wake up
+        const auto waitTime = std::min<Clock::duration>(
+            deadline - now, std::chrono::milliseconds(recheckWidgetIntervalMs));
+        const bool woken = waitSem->tryAcquire(1, waitTime);
+        if (!woken)
+            agent.runCodeInGuiThreadSync([&agent, waitSem] {
+                agent.widgetsIndex().removeWaiter(*waitSem);
+                // release may happen before remove
+                while (waitSem->tryAcquire(1, std::chrono::milliseconds(0)))
+                    ;
+                return QString();
+            });
     }
     return w;
 }
@@ -804,12 +914,24 @@ void ScriptAPI::Wait(int ms)
     std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
+bool ScriptAPI::waitForIdle()
+{
+    Step step(agent_);
+    return agent_.waitForGuiIdle(waitWidgetAppearTimeoutSec_ * 1000);
+}
+
+void ScriptAPI::setIdleWindowMs(int ms) { agent_.setIdleWindowMs(ms); }
+
 ScriptAPI::Step::Step(Agent &agent)
 {
     agent.scriptCheckPoint();
     qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
-    std::this_thread::sleep_for(
-        std::chrono::milliseconds(agent.demonstrationMode() ? 200 : 120));
+    if (agent.demonstrationMode())
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    else
+        // previous step may start animation or something like that,
+        // so do not wait longer than before
+        agent.waitForGuiIdle(maxStepIdleWaitMs);
 }
 
 ScriptAPI::Step::~Step() {}
@@ -938,27 +1060,16 @@ void ScriptAPI::keyClick(const QString &widgetName, const QString &keyseqStr,
         return;
     }
 
-    const QKeySequence keySeq = QKeySequence::fromString(keyseqStr);
-    if (keySeq.isEmpty()) {
-        agent_.throwScriptError(
-            QStringLiteral("Invalid key sequnce(%1): empty").arg(keyseqStr));
+    QKeySequence keySeq;
+    Qt::KeyboardModifiers modifiers;
+    QString errMsg = parseKeySequence(keyseqStr, keySeq, modifiers);
+    if (!errMsg.isEmpty()) {
+        agent_.throwScriptError(std::move(errMsg));
         return;
     }
-    Qt::KeyboardModifiers modifiers = Qt::NoModifier;
-    for (decltype(keySeq.count()) i = 0;
-         keySeq.count() > 0 && i < (keySeq.count() - 1); ++i)
-        modifiers |= static_cast<Qt::KeyboardModifier>(keySeq[i]);
-    QString errMsg = agent_.runCodeInGuiThreadSyncWithTimeout(
+    errMsg = agent_.runCodeInGuiThreadSyncWithTimeout(
         [w, keySeq, modifiers, real_syms] {
-            if (!w->hasFocus())
-                w->setFocus(Qt::ShortcutFocusReason);
-            DBGPRINT("%s: key(%s) click for widget", Q_FUNC_INFO,
-                     qPrintable(keySeq.toString()));
-            auto ascii_key = static_cast<Qt::Key>(keySeq[keySeq.count() - 1]);
-            QTest::sendKeyEvent(QTest::KeyAction::Click, w, ascii_key,
-                                real_syms, modifiers);
-            DBGPRINT("%s: key(%s) click for widget DONE", Q_FUNC_INFO,
-                     qPrintable(keySeq.toString()));
+            keyClickInGuiThread(*w, keySeq, modifiers, &real_syms);
             return QString();
         },
         newEventLoopWaitTimeoutSecs_);
@@ -986,26 +1097,16 @@ void ScriptAPI::keyClick(const QString &widgetName, const QString &keyseqStr)
         return;
     }
 
-    const QKeySequence keySeq = QKeySequence::fromString(keyseqStr);
-    if (keySeq.isEmpty()) {
-        agent_.throwScriptError(
-            QStringLiteral("Invalid key sequnce(%1): empty").arg(keyseqStr));
+    QKeySequence keySeq;
+    Qt::KeyboardModifiers modifiers;
+    QString errMsg = parseKeySequence(keyseqStr, keySeq, modifiers);
+    if (!errMsg.isEmpty()) {
+        agent_.throwScriptError(std::move(errMsg));
         return;
     }
-    Qt::KeyboardModifiers modifiers = Qt::NoModifier;
-    for (decltype(keySeq.count()) i = 0;
-         keySeq.count() > 0 && i < (keySeq.count() - 1); ++i)
-        modifiers |= static_cast<Qt::KeyboardModifier>(keySeq[i]);
-    QString errMsg = agent_.runCodeInGuiThreadSyncWithTimeout(
+    errMsg = agent_.runCodeInGuiThreadSyncWithTimeout(
         [w, keySeq, modifiers] {
-            if (!w->hasFocus())
-                w->setFocus(Qt::ShortcutFocusReason);
-            DBGPRINT("%s: key(%s) click for widget", Q_FUNC_INFO,
-                     qPrintable(keySeq.toString()));
-            QTest::keyClick(w, static_cast<Qt::Key>(keySeq[keySeq.count() - 1]),
-                            modifiers, -1);
-            DBGPRINT("%s: key(%s) click for widget DONE", Q_FUNC_INFO,
-                     qPrintable(keySeq.toString()));
+            keyClickInGuiThread(*w, keySeq, modifiers, nullptr);
             return QString();
         },
         newEventLoopWaitTimeoutSecs_);
@@ -1163,6 +1264,116 @@ void ScriptAPI::AssertEqual(const QString &s1, const QString &s2)
     }
 }
 
+QList<QVariant> ScriptAPI::batch(const QList<QVariant> &steps)
+{
+    Step step(agent_);
+    DBGPRINT("%s: begin, %d steps", Q_FUNC_INFO, steps.size());
+
+    struct BatchState final {
+        std::mutex mutex;
+        QList<QVariant> results;
+        //! next step to execute
+        int next = 0;
+        bool finished = false;
+        //! GUI thread should not start new steps
+        bool abandoned = false;
+    };
+    auto stepResult = [](const QString &errMsg) -> QVariant {
+        QVariantMap res;
+        res.insert("ok", errMsg.isEmpty());
+        res.insert("error", errMsg);
+        return res;
+    };
+    QList<QVariant> results;
+    for (int i = 0; i < steps.size(); ++i)
+        results << QVariant();
+    Agent *agent = &agent_;
+    int begin = 0;
+    while (begin < steps.size()) {
+        std::shared_ptr<BatchState> state{new BatchState};
+        state->next = begin;
+        state->results = results;
+        // execute steps while their widgets are ready, if some step starts
+        // new event loop, the rest of steps executed by next iteration
+        const QString errMsg = agent_.runCodeInGuiThreadSyncWithTimeout(
+            [agent, state, steps, stepResult] {
+                WidgetsIndex &index = agent->widgetsIndex();
+                for (;;) {
+                    int i;
+                    {
+                        std::lock_guard<std::mutex> lock{state->mutex};
+                        if (state->abandoned || state->next >= steps.size())
+                            break;
+                        i = state->next;
+                    }
+                    const QVariantMap step = steps[i].toMap();
+                    QWidget *w = doGetWidgetWithSuchName(
+                        index, step.value("widget").toString(), true);
+                    if (w == nullptr || canNotFind(*w)
+                        || !(w->isVisible() && w->isEnabled()))
+                        // wait for it in script thread
+                        break;
+                    {
+                        std::lock_guard<std::mutex> lock{state->mutex};
+                        if (state->abandoned)
+                            break;
+                        ++state->next;
+                    }
+                    const QVariant res
+                        = stepResult(runBatchStepInGuiThread(*agent, *w, step));
+                    std::lock_guard<std::mutex> lock{state->mutex};
+                    state->results[i] = res;
+                }
+                std::lock_guard<std::mutex> lock{state->mutex};
+                state->finished = true;
+                return QString();
+            },
+            newEventLoopWaitTimeoutSecs_);
+
+        const int prevBegin = begin;
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock{state->mutex};
+            state->abandoned = true;
+            finished = state->finished;
+            results = state->results;
+            // step that started new event loop is done, like usual command
+            for (; begin < state->next; ++begin)
+                if (results[begin].isNull())
+                    results[begin] = stepResult(QString());
+        }
+        // not error of some step, but of whole call, like halt of script
+        if (!errMsg.isEmpty()) {
+            DBGPRINT("%s: error %s", Q_FUNC_INFO, qPrintable(errMsg));
+            agent_.throwScriptError(errMsg);
+            return results;
+        }
+        // call times out only if GUI thread not started it,
+        // so search of widget was not even started
+        if (!finished && begin == prevBegin) {
+            results[begin] = stepResult(
+                QStringLiteral("Timeout while waiting GUI thread to search "
+                               "widget %1")
+                    .arg(steps[begin].toMap().value("widget").toString()));
+            ++begin;
+        }
+        if (!finished || begin >= steps.size())
+            continue;
+        const QString widgetName
+            = steps[begin].toMap().value("widget").toString();
+        if (getWidgetWithSuchName(agent_, widgetName,
+                                  waitWidgetAppearTimeoutSec_, true)
+            == nullptr) {
+            results[begin] = stepResult(
+                QStringLiteral("Can not find widget with such name %1")
+                    .arg(widgetName));
+            ++begin;
+        }
+    }
+    DBGPRINT("%s: done", Q_FUNC_INFO);
+    return results;
+}
+
 QObject *ScriptAPI::getObjectById(const QString &id)
 {
     Step step(agent_);
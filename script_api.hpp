@@ -126,6 +126,20 @@ public slots:
      */
     void Wait(int ms);
 
+    /**
+     * Wait until application settles: all posted events, paint events
+     * and timers with zero interval processed, and there was no events
+     * except ticks of periodic timers during idle window after that.
+     * Waits not longer then timeout of widget appearing.
+     * @return false if application did not settle
+     */
+    bool waitForIdle();
+    /**
+     * How long application should be without events to be considered idle
+     * @param ms idle window in milliseconds
+     */
+    void setIdleWindowMs(int ms);
+
     /**
      * Activate MDI window with such title
      * @param workspace name of WorkSpace
@@ -163,6 +177,20 @@ public slots:
      */
     QObject *getObjectById(const QString &id);
 
+    /**
+     * Execute list of independent steps in one call to GUI thread,
+     * if widget of step not appeared yet, it is waited as usual.
+     * Error in one step not stop others and not throw exception,
+     * but halt of script throws exception as any other command.
+     * @param steps list of objects with "cmd" and "widget" properties
+     * and properties for command:
+     *  - mouseClick, mouseDClick, mousePress, mouseRelease: button, x, y
+     *  - keyClick: keys and optional text
+     *  - activateItem: item and optional flags
+     * @return list of objects with "ok" and "error" properties for each step
+     */
+    QList<QVariant> batch(const QList<QVariant> &steps);
+
     //! Call QCoreApplication::exit(0)
     void quitApp();
 
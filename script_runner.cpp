@@ -11,6 +11,10 @@ using qt_monkey_agent::ScriptAPI;
 using qt_monkey_agent::Private::Script;
 using qt_monkey_agent::Private::ScriptRunner;
 
+// engine process events with such interval during evaluation,
+// so it is possible to abort script in infinite loop
+static constexpr int processEventsIntervalMs = 20;
+
 static int extractLineNumFromBacktraceLine(const QString &line)
 {
     const int ln = line.indexOf(':');
@@ -25,6 +29,7 @@ ScriptRunner::ScriptRunner(ScriptAPI &api,
     QScriptValue global = scriptEngine_.globalObject();
 
     global.setProperty(QLatin1String("Test"), testCtrl);
+    scriptEngine_.setProcessEventsInterval(processEventsIntervalMs);
 
     if (onInitCb != nullptr)
         onInitCb(scriptEngine_);
@@ -32,9 +37,12 @@ ScriptRunner::ScriptRunner(ScriptAPI &api,
 
 void ScriptRunner::runScript(const Script &script, QString &errMsg)
 {
+    aborted_ = false;
     scriptEngine_.evaluate(script.code(), "script", 1);
 
-    if (scriptEngine_.hasUncaughtException()) {
+    if (aborted_) {
+        errMsg = T_("Script halted");
+    } else if (scriptEngine_.hasUncaughtException()) {
         QString expd;
 
         expd += QStringLiteral("Backtrace:\n");
@@ -71,6 +79,14 @@ int ScriptRunner::currentLineNum() const
     return extractLineNumFromBacktraceLine(backtrace.back());
 }
 
+void ScriptRunner::abort()
+{
+    if (!scriptEngine_.isEvaluating())
+        return;
+    aborted_ = true;
+    scriptEngine_.abortEvaluation();
+}
+
 void ScriptRunner::throwError(QString errMsg)
 {
     auto ctx = scriptEngine_.currentContext();
@@ -20,9 +20,15 @@ public:
     void runScript(const Script &, QString &errMsg);
     int currentLineNum() const;
     void throwError(QString errMsg);
+    /**
+     * Abort script evaluation, can not be catched by script,
+     * should be called in thread of script
+     */
+    void abort();
 
 private:
     QScriptEngine scriptEngine_;
+    bool aborted_ = false;
 };
 } // namespace Private
 } // namespace qt_monkey_agent
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
 
 namespace qt_monkey_common
 {
@@ -42,4 +44,68 @@ private:
     std::mutex mutex_;
     std::condition_variable cv_;
 };
+
+/**
+ * One shot event, like futex: if it is set before waiting begins
+ * or during short spin, waiter and setter do not touch mutex at all
+ */
+class Completion final
+{
+public:
+    Completion() = default;
+    Completion(const Completion &) = delete;
+    Completion &operator=(const Completion &) = delete;
+
+    void set()
+    {
+        int expected = Pending;
+        if (state_.compare_exchange_strong(expected, Done,
+                                           std::memory_order_acq_rel))
+            return;
+        // waiter may wake up spuriously and destroy this object as soon as
+        // it see Done, so publish it only under mutex
+        std::lock_guard<std::mutex> lock{mutex_};
+        state_.store(Done, std::memory_order_release);
+        cv_.notify_all();
+    }
+    bool isSet() const { return state_.load(std::memory_order_acquire) == Done; }
+    void wait()
+    {
+        if (spin())
+            return;
+        std::unique_lock<std::mutex> lock{mutex_};
+        cv_.wait(lock, [this] { return isSet(); });
+    }
+    template <class Rep, class Period>
+    bool waitFor(const std::chrono::duration<Rep, Period> &d)
+    {
+        if (spin())
+            return true;
+        std::unique_lock<std::mutex> lock{mutex_};
+        return cv_.wait_for(lock, d, [this] { return isSet(); });
+    }
+
+private:
+    enum State { Pending, Sleeping, Done };
+    static constexpr int spinCount = 256;
+
+    std::atomic<int> state_{Pending};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    //! @return true if set, otherwise mark that there is sleeping waiter
+    bool spin()
+    {
+        for (int i = 0; i < spinCount; ++i) {
+            if (isSet())
+                return true;
+            if (i >= spinCount / 4)
+                std::this_thread::yield();
+        }
+        int expected = Pending;
+        return !state_.compare_exchange_strong(expected, Sleeping,
+                                               std::memory_order_acq_rel)
+               && expected == Done;
+    }
+};
 } // namespace qt_monkey_common
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+namespace qt_monkey_common
+{
+/**
+ * Byte stream from one process to another inside shared memory,
+ * for one writer and one reader. Sides mark themselves as waiting,
+ * when there is nothing to read or no space to write, so the other
+ * side knows when it should wake them up via some other channel.
+ */
+class ShmRing final
+{
+    static_assert(ATOMIC_INT_LOCK_FREE == 2,
+                  "atomics in shared memory should be lock free");
+
+    struct Header {
+        //! read position, changed only by reader
+        std::atomic<uint32_t> head{0};
+        char pad0_[64 - sizeof(uint32_t)];
+        //! write position, changed only by writer
+        std::atomic<uint32_t> tail{0};
+        char pad1_[64 - sizeof(uint32_t)];
+        //! reader found ring empty, at start there is nothing to read
+        std::atomic<uint32_t> readerWaiting{1};
+        //! writer found ring full
+        std::atomic<uint32_t> writerWaiting{0};
+    };
+
+public:
+    static size_t memorySize(uint32_t capacity)
+    {
+        return sizeof(Header) + capacity;
+    }
+    /**
+     * @param mem memory of memorySize(capacity) bytes
+     * @param capacity should be power of two
+     * @param init true if ring should be initialized, it should be done
+     * once, before other side uses it
+     */
+    ShmRing(void *mem, uint32_t capacity, bool init)
+        : header_(static_cast<Header *>(mem)),
+          data_(static_cast<char *>(mem) + sizeof(Header)), capacity_(capacity)
+    {
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+        if (init)
+            new (header_) Header;
+    }
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    /**
+     * Write as much as possible, if not all data fits, writer marked
+     * as waiting, and reader should wake up it after read
+     * @param wakeUpReader set to true if reader waits new data
+     * @return number of written bytes
+     */
+    size_t write(const char *data, size_t n, bool &wakeUpReader)
+    {
+        size_t written = 0;
+        for (;;) {
+            written += writeSome(data + written, n - written);
+            if (written == n)
+                break;
+            header_->writerWaiting.store(1);
+            // reader may read all before it see flag
+            if (freeSpace() == 0)
+                break;
+            header_->writerWaiting.store(0);
+        }
+        wakeUpReader = written > 0 && header_->readerWaiting.exchange(0) != 0;
+        return written;
+    }
+
+    /**
+     * Read up to n bytes, if there is less data then n, reader marked
+     * as waiting, and writer should wake up it after write
+     * @param wakeUpWriter set to true if writer waits free space
+     * @return number of read bytes
+     */
+    size_t read(char *dst, size_t n, bool &wakeUpWriter)
+    {
+        size_t nRead = 0;
+        for (;;) {
+            nRead += readSome(dst + nRead, n - nRead);
+            if (nRead == n)
+                break;
+            header_->readerWaiting.store(1);
+            // writer may write all before it see flag
+            if (available() == 0)
+                break;
+            header_->readerWaiting.store(0);
+        }
+        wakeUpWriter = nRead > 0 && header_->writerWaiting.exchange(0) != 0;
+        return nRead;
+    }
+
+    size_t available() const
+    {
+        return header_->tail.load() - header_->head.load();
+    }
+    size_t freeSpace() const { return capacity_ - available(); }
+
+private:
+    Header *header_;
+    char *data_;
+    uint32_t capacity_;
+
+    size_t writeSome(const char *data, size_t n)
+    {
+        const uint32_t tail = header_->tail.load(std::memory_order_relaxed);
+        const uint32_t head = header_->head.load(std::memory_order_acquire);
+        const size_t len = std::min<size_t>(n, capacity_ - (tail - head));
+        const uint32_t pos = tail & (capacity_ - 1);
+        const size_t firstPart = std::min<size_t>(len, capacity_ - pos);
+        std::memcpy(data_ + pos, data, firstPart);
+        std::memcpy(data_, data + firstPart, len - firstPart);
+        header_->tail.store(tail + static_cast<uint32_t>(len));
+        return len;
+    }
+
+    size_t readSome(char *dst, size_t n)
+    {
+        const uint32_t head = header_->head.load(std::memory_order_relaxed);
+        const uint32_t tail = header_->tail.load(std::memory_order_acquire);
+        const size_t len = std::min<size_t>(n, tail - head);
+        const uint32_t pos = head & (capacity_ - 1);
+        const size_t firstPart = std::min<size_t>(len, capacity_ - pos);
+        std::memcpy(dst, data_ + pos, firstPart);
+        std::memcpy(dst + firstPart, data_, len - firstPart);
+        header_->head.store(head + static_cast<uint32_t>(len));
+        return len;
+    }
+};
+} // namespace qt_monkey_common
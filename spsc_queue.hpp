@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace qt_monkey_common
+{
+/**
+ * Lock-free bounded queue for one producer thread and one consumer thread,
+ * all slots preallocated. Consumer may be reentered from the same thread
+ * (for example from nested event loop), because value is taken from slot
+ * before it is used.
+ */
+template <typename T, size_t Capacity> class SpscQueue final
+{
+    static_assert(Capacity > 1 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity should be power of two");
+
+public:
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    //! should be called only from producer thread
+    //! @return false if queue is full, val is not changed in this case
+    bool push(T &&val)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - headCache_ == Capacity) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail - headCache_ == Capacity)
+                return false;
+        }
+        slots_[tail & (Capacity - 1)] = std::move(val);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! should be called only from consumer thread
+    //! @return false if queue is empty
+    bool pop(T &val)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tailCache_) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (head == tailCache_)
+                return false;
+        }
+        T &slot = slots_[head & (Capacity - 1)];
+        val = std::move(slot);
+        // free resources that may be hold by moved-from value
+        slot = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static constexpr size_t cacheLineSize = 64;
+
+    std::array<T, Capacity> slots_;
+    // producer and consumer data on different cache lines
+    char pad0_[cacheLineSize];
+    std::atomic<size_t> head_{0};
+    size_t tailCache_ = 0;
+    char pad1_[cacheLineSize];
+    std::atomic<size_t> tail_{0};
+    size_t headCache_ = 0;
+    char pad2_[cacheLineSize];
+};
+} // namespace qt_monkey_common
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEvent>
+#include <QtCore/QObject>
+
+#include "gui_call_queue.hpp"
+#include "semaphore.hpp"
+
+// measure round-trip latency of call of function in GUI thread
+// from another thread and wait of result
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+class FuncEvent final : public QEvent
+{
+public:
+    FuncEvent(QEvent::Type type, std::function<void()> func)
+        : QEvent(type), func_(std::move(func))
+    {
+    }
+    void exec() { func_(); }
+
+private:
+    std::function<void()> func_;
+};
+
+// the way how Agent::runCodeInGuiThreadSync was implemented before
+class PostEventCaller final : public QObject
+{
+public:
+    PostEventCaller()
+    {
+        eventType_ = static_cast<QEvent::Type>(QEvent::registerEventType());
+    }
+    void callSync(const std::function<void()> &func)
+    {
+        QCoreApplication::postEvent(this, new FuncEvent(eventType_, [this,
+                                                                     &func] {
+                                        func();
+                                        sem_.release();
+                                    }));
+        sem_.acquire();
+    }
+
+private:
+    QEvent::Type eventType_;
+    qt_monkey_common::Semaphore sem_{0};
+
+    void customEvent(QEvent *event) override
+    {
+        if (event->type() == eventType_)
+            static_cast<FuncEvent *>(event)->exec();
+    }
+};
+
+// the way how Agent::runCodeInGuiThreadSync works: action is shared with
+// GUI thread, because waiter may cancel it and go away
+class GuiCallQueueCaller final
+{
+public:
+    void callSync(const std::function<void()> &func)
+    {
+        std::shared_ptr<Action> action{new Action};
+        queue_.call([&func, action] {
+            if (action->started.exchange(true))
+                return; // canceled
+            func();
+            action->released.set();
+        });
+        action->released.wait();
+    }
+    void call(std::function<void()> func) { queue_.call(std::move(func)); }
+
+private:
+    struct Action final {
+        std::atomic<bool> started{false};
+        qt_monkey_common::Completion released;
+    };
+    qt_monkey_agent::Private::GuiCallQueue queue_;
+};
+
+template <class Caller>
+static std::vector<double> measure(Caller &caller, int nCalls)
+{
+    std::vector<double> res;
+    res.reserve(static_cast<size_t>(nCalls));
+    int counter = 0;
+    for (int i = 0; i < nCalls; ++i) {
+        const auto start = Clock::now();
+        caller.callSync([&counter] { ++counter; });
+        res.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start)
+                .count());
+    }
+    return res;
+}
+
+static void report(const char *name, std::vector<double> lat)
+{
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double p) {
+        return lat[std::min(lat.size() - 1,
+                            static_cast<size_t>(p * lat.size() / 100.))];
+    };
+    std::printf("%-12s p50 %8.2f us, p90 %8.2f us, p99 %8.2f us, max %8.2f "
+                "us\n",
+                name, percentile(50), percentile(90), percentile(99),
+                lat.back());
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const int nCalls = argc > 1 ? std::atoi(argv[1]) : 100000;
+    PostEventCaller postEventCaller;
+    GuiCallQueueCaller guiCallQueue;
+    std::thread worker([&] {
+        // warm up
+        measure(postEventCaller, nCalls / 10 + 1);
+        measure(guiCallQueue, nCalls / 10 + 1);
+        report("postEvent", measure(postEventCaller, nCalls));
+        report("queue", measure(guiCallQueue, nCalls));
+        guiCallQueue.call([] { QCoreApplication::quit(); });
+    });
+    app.exec();
+    worker.join();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "qtmonkey_app_api.hpp"
+
+// compare JSON and CBOR encoding of qtmonkey_app output: time to write
+// messages as qtmonkey_app does and to parse them in gui, on mix of
+// recorded events, short logs and big logs with not ASCII text
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+using qt_monkey_app::Protocol;
+
+struct Message final {
+    bool isEvent;
+    QByteArray text;
+};
+using Traffic = std::vector<Message>;
+
+static Traffic createTraffic(size_t nEvents)
+{
+    Traffic res;
+    for (size_t i = 0; i < nEvents; ++i) {
+        const QString event
+            = QStringLiteral("Test.mouseClick('MainWindow.<class_name="
+                           "QSplitter>.centralWidget.btn%1', "
+                           "'Qt.LeftButton', %2, %3);")
+                .arg(i % 32)
+                .arg(i % 640)
+                .arg(i % 480);
+        res.push_back({true, event.toUtf8()});
+        if (i % 4 == 0) {
+            const QString log = QStringLiteral("step %1: \"value\" = %2\n")
+                                    .arg(i)
+                                    .arg(i * 7);
+            res.push_back({false, log.toUtf8()});
+        }
+        if (i % 100 == 0) {
+            QString bigLog;
+            for (int line = 0; line < 200; ++line)
+                bigLog += QStringLiteral("\t%1: ").arg(line)
+                          + QString::fromUtf8("\xd0\xbf\xd1\x80\xd0\xb8"
+                                              "\xd0\xb2\xd0\xb5\xd1\x82 "
+                                              "world, path C:\\tmp\\x\n");
+            res.push_back({false, bigLog.toUtf8()});
+        }
+    }
+    return res;
+}
+
+static void encode(const Traffic &traffic, Protocol protocol,
+                   std::string &out)
+{
+    out.clear();
+    for (const Message &msg : traffic) {
+        if (msg.isEvent)
+            qt_monkey_app::appendPacketFromUserAppEvent(out, msg.text,
+                                                        protocol);
+        else
+            qt_monkey_app::appendPacketFromUserAppScriptLog(out, msg.text,
+                                                            protocol);
+        if (protocol == Protocol::Json)
+            out += '\n';
+    }
+    qt_monkey_app::appendPacketFromScriptEnd(out, protocol);
+}
+
+static size_t decode(const std::string &data, Protocol protocol)
+{
+    size_t nMessages = 0;
+    qt_monkey_app::MonkeyAppStreamParser parser(
+        [&nMessages](QString) { ++nMessages; },
+        [&nMessages](QString) { ++nMessages; },
+        [&nMessages]() { ++nMessages; },
+        [&nMessages](QString) { ++nMessages; },
+        [](QString err) {
+            std::fprintf(stderr, "parse error: %s\n", qPrintable(err));
+            std::exit(EXIT_FAILURE);
+        },
+        protocol);
+    // as it comes from pipe
+    const size_t blockSize = 64 * 1024;
+    for (size_t pos = 0; pos < data.size(); pos += blockSize)
+        parser.feed(data.data() + pos, std::min(blockSize, data.size() - pos));
+    return nMessages;
+}
+
+static void measure(const char *name, const Traffic &traffic,
+                    Protocol protocol, int nRuns)
+{
+    std::string out;
+    double encodeSec = 0, decodeSec = 0;
+    size_t nMessages = 0;
+    for (int run = 0; run < nRuns; ++run) {
+        auto start = Clock::now();
+        encode(traffic, protocol, out);
+        encodeSec += std::chrono::duration<double>(Clock::now() - start)
+                         .count();
+        start = Clock::now();
+        nMessages = decode(out, protocol);
+        decodeSec += std::chrono::duration<double>(Clock::now() - start)
+                         .count();
+    }
+    std::printf("%-5s %9zu bytes, %zu messages, encode %8.2f ms, "
+                "decode %8.2f ms\n",
+                name, out.size(), nMessages, encodeSec * 1000. / nRuns,
+                decodeSec * 1000. / nRuns);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const size_t nEvents = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const int nRuns = 10;
+    const Traffic traffic = createTraffic(nEvents);
+    measure("json", traffic, Protocol::Json, nRuns);
+    measure("cbor", traffic, Protocol::Cbor, nRuns);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <QtCore/QString>
+
+#include "cbor.hpp"
+#include "qtmonkey_app_api.hpp"
+
+// measure how fast qtmonkey_app reads big "run script" packets from
+// stdin and parses them: real binary is started with pipe on its stdin,
+// so ReadStdinThread, StdinReader and GuiStreamParser are all measured
+//
+// usage: bench_stdin path/to/qtmonkey_app [megabytes]
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+using qt_monkey_app::Protocol;
+
+static const char parseErrorMarker[] = "Can not parse gui<->monkey protocol";
+
+/**
+ * qtmonkey_app reports this message to stderr, so when report
+ * appears, everything before message is read and parsed
+ */
+static std::string brokenRunScript(Protocol protocol)
+{
+    if (protocol == Protocol::Json)
+        return "{\"run script\": 1}\n";
+    std::string body;
+    qt_monkey_app::appendCborHead(body, qt_monkey_app::CborType::Map, 1);
+    qt_monkey_app::appendCborText(body, "run script");
+    qt_monkey_app::appendCborInt(body, 1);
+    std::string res;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        res += static_cast<char>((body.size() >> shift) & 0xff);
+    return res + body;
+}
+
+static void writeAll(int fd, const std::string &data)
+{
+    size_t pos = 0;
+    while (pos < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + pos, data.size() - pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            std::perror("write");
+            std::exit(EXIT_FAILURE);
+        }
+        pos += static_cast<size_t>(n);
+    }
+}
+
+class MonkeyApp final
+{
+public:
+    MonkeyApp(const char *path, Protocol protocol)
+    {
+        int in[2], err[2];
+        if (::pipe(in) != 0 || ::pipe(err) != 0) {
+            std::perror("pipe");
+            std::exit(EXIT_FAILURE);
+        }
+        pid_ = ::fork();
+        if (pid_ < 0) {
+            std::perror("fork");
+            std::exit(EXIT_FAILURE);
+        }
+        if (pid_ == 0) {
+            const int devNull = ::open("/dev/null", O_WRONLY);
+            ::dup2(in[0], STDIN_FILENO);
+            ::dup2(devNull, STDOUT_FILENO);
+            ::dup2(err[1], STDERR_FILENO);
+            ::close(in[1]);
+            ::close(err[0]);
+            // user app never connects, so scripts are only queued,
+            // cat exits when qtmonkey_app dies
+            ::execl(path, path,
+                    protocol == Protocol::Json ? "--protocol=json"
+                                               : "--protocol=cbor",
+                    "--user-app", "/bin/cat", static_cast<char *>(nullptr));
+            std::perror("exec");
+            std::_Exit(EXIT_FAILURE);
+        }
+        ::close(in[0]);
+        ::close(err[1]);
+        stdin_ = in[1];
+        stderr_ = err[0];
+    }
+    MonkeyApp(const MonkeyApp &) = delete;
+    MonkeyApp &operator=(const MonkeyApp &) = delete;
+    ~MonkeyApp()
+    {
+        ::close(stdin_);
+        ::kill(pid_, SIGTERM);
+        ::waitpid(pid_, nullptr, 0);
+        ::close(stderr_);
+    }
+    int stdinFd() const { return stdin_; }
+    //! wait until qtmonkey_app reported n parse errors since start
+    void waitParseErrors(size_t n)
+    {
+        char buf[4096];
+        while (countParseErrors() < n) {
+            const ssize_t nBytes = ::read(stderr_, buf, sizeof(buf));
+            if (nBytes < 0 && errno == EINTR)
+                continue;
+            if (nBytes <= 0) {
+                std::fprintf(stderr, "qtmonkey_app exited: %s\n",
+                             errOut_.c_str());
+                std::exit(EXIT_FAILURE);
+            }
+            errOut_.append(buf, static_cast<size_t>(nBytes));
+        }
+    }
+
+private:
+    pid_t pid_;
+    int stdin_;
+    int stderr_;
+    std::string errOut_;
+
+    size_t countParseErrors() const
+    {
+        size_t res = 0;
+        for (size_t pos = errOut_.find(parseErrorMarker);
+             pos != std::string::npos;
+             pos = errOut_.find(parseErrorMarker, pos + 1))
+            ++res;
+        return res;
+    }
+};
+
+static void measure(const char *appPath, Protocol protocol, size_t totalMb)
+{
+    const QString script = QStringLiteral("Test.log('%1');\n")
+                               .arg(QString(256 * 1024, QLatin1Char('x')));
+    std::string input;
+    size_t nScripts = 0;
+    while (input.size() < totalMb * 1024 * 1024) {
+        qt_monkey_app::appendPacketFromRunScript(
+            input, script, QStringLiteral("test.js"), protocol);
+        ++nScripts;
+    }
+    const std::string sentinel = brokenRunScript(protocol);
+    input += sentinel;
+
+    MonkeyApp app(appPath, protocol);
+    // exclude start of application
+    writeAll(app.stdinFd(), sentinel);
+    app.waitParseErrors(1);
+
+    const auto start = Clock::now();
+    std::thread writer([&app, &input] { writeAll(app.stdinFd(), input); });
+    app.waitParseErrors(2);
+    const double sec
+        = std::chrono::duration<double>(Clock::now() - start).count();
+    writer.join();
+    std::printf("%-5s %8.2f MB/s, %zu scripts\n",
+                protocol == Protocol::Json ? "json" : "cbor",
+                input.size() / sec / (1024. * 1024.), nScripts);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s path/to/qtmonkey_app [megabytes]\n",
+                     argv[0]);
+        return EXIT_FAILURE;
+    }
+    // qtmonkey_app may die, do not die with it
+    std::signal(SIGPIPE, SIG_IGN);
+    const size_t totalMb = argc > 2 ? std::atoi(argv[2]) : 16;
+    measure(argv[1], Protocol::Json, totalMb);
+    measure(argv[1], Protocol::Cbor, totalMb);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEventLoop>
+#include <QtCore/QThread>
+
+#include "agent_qtmonkey_communication.hpp"
+
+// measure round-trip latency of packet between agent and monkey:
+// agent sends Close and monkey replies with CloseAck
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+using qt_monkey_agent::Private::CommunicationAgentPart;
+using qt_monkey_agent::Private::CommunicationMonkeyPart;
+using qt_monkey_agent::Private::PacketTypeForMonkey;
+
+class ClientThread final : public QThread
+{
+public:
+    explicit ClientThread(int nCalls) : nCalls_(nCalls) {}
+    void run() override
+    {
+        CommunicationAgentPart client;
+        if (!client.connectToMonkey()) {
+            std::fprintf(stderr, "can not connect to monkey\n");
+            std::exit(EXIT_FAILURE);
+        }
+        // warm up, and wait connection
+        measure(client, nCalls_ / 10 + 1);
+        latency = measure(client, nCalls_);
+    }
+    std::vector<double> latency;
+
+private:
+    int nCalls_;
+
+    static std::vector<double> measure(CommunicationAgentPart &client,
+                                       int nCalls)
+    {
+        std::vector<double> res;
+        res.reserve(static_cast<size_t>(nCalls));
+        QEventLoop loop;
+        for (int i = 0; i < nCalls; ++i) {
+            const auto start = Clock::now();
+            client.sendCommand(PacketTypeForMonkey::Close, QString());
+            while (!client.hasCloseAck())
+                loop.processEvents(QEventLoop::WaitForMoreEvents);
+            res.push_back(
+                std::chrono::duration<double, std::micro>(Clock::now() - start)
+                    .count());
+        }
+        return res;
+    }
+};
+
+static void report(const char *name, std::vector<double> lat)
+{
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double p) {
+        return lat[std::min(lat.size() - 1,
+                            static_cast<size_t>(p * lat.size() / 100.))];
+    };
+    std::printf("%-12s p50 %8.2f us, p90 %8.2f us, p99 %8.2f us, max %8.2f "
+                "us\n",
+                name, percentile(50), percentile(90), percentile(99),
+                lat.back());
+}
+
+static std::vector<double> measureTransport(const char *transport, int nCalls)
+{
+    qputenv("QTMONKEY_TRANSPORT", transport);
+    // agent selects transport by variables that monkey sets
+    qputenv("QTMONKEY_SOCKET", QByteArray());
+    qputenv("QTMONKEY_PORT", QByteArray());
+    CommunicationMonkeyPart server;
+    const auto env = server.requiredProcessEnvironment();
+    qputenv(env.first.toUtf8().data(), env.second.toUtf8());
+    ClientThread client(nCalls);
+    QEventLoop loop;
+    QObject::connect(&client, SIGNAL(finished()), &loop, SLOT(quit()));
+    client.start();
+    loop.exec();
+    client.wait();
+    return client.latency;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const int nCalls = argc > 1 ? std::atoi(argv[1]) : 10000;
+    report("tcp", measureTransport("tcp", nCalls));
+    report("local", measureTransport("local", nCalls));
+    report("shm", measureTransport("shm", nCalls));
+    return EXIT_SUCCESS;
+}
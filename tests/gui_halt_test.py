@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+
+import subprocess, sys, json, threading
+
+qt_monkey_app_path = sys.argv[1]
+test_app_path = sys.argv[2]
+endless_script_path = sys.argv[3]
+second_script_path = sys.argv[4]
+
+TIMEOUT_ERROR = "Script runs longer than 500 ms, halt it"
+
+monkey_cmd = [qt_monkey_app_path, "--script-timeout", "500",
+              "--user-app", test_app_path]
+
+monkey = subprocess.Popen(monkey_cmd, stdout=subprocess.PIPE,
+                          stdin=subprocess.PIPE, stderr=sys.stderr)
+# if halt not works, script runs forever
+watchdog = threading.Timer(60, monkey.kill)
+watchdog.start()
+
+lines = []
+
+def fail(msg):
+    watchdog.cancel()
+    monkey.kill()
+    sys.stderr.write(msg + "\n")
+    sys.stderr.write("\n".join(lines) + "\n")
+    sys.exit(1)
+
+def read_msg():
+    line = monkey.stdout.readline()
+    if not line:
+        return None
+    line = line.decode("utf-8").strip()
+    lines.append(line)
+    return json.loads(line) if line else ""
+
+def run_script(path):
+    with open(path, "r") as f:
+        code = f.read()
+    cmd = {"run script": {"file": path, "script": code}}
+    monkey.stdin.write((json.dumps(cmd) + "\n").encode("utf-8"))
+    monkey.stdin.flush()
+
+def key_values(msgs, key):
+    return [m[key] for m in msgs if type(m) is dict and key in m]
+
+msgs = []
+run_script(endless_script_path)
+while True:
+    msg = read_msg()
+    if msg is None:
+        fail("qtmonkey_app exited before end of endless script")
+    msgs.append(msg)
+    if msg == "script end":
+        break
+if "endless started" not in key_values(msgs, "script logs"):
+    fail("endless script not started")
+if TIMEOUT_ERROR not in key_values(msgs, "app errors"):
+    fail("no error about script timeout")
+
+run_script(second_script_path)
+while True:
+    msg = read_msg()
+    if msg is None:
+        break
+    msgs.append(msg)
+watchdog.cancel()
+monkey.wait()
+
+if "second done" not in key_values(msgs, "script logs"):
+    fail("second script not done")
+# both scripts run in the same instance of application
+if len(key_values(msgs, "agent ready")) != 1:
+    fail("application restarted")
+sys.exit(0)
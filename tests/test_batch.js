@@ -0,0 +1,23 @@
+var tab = 'MainWindow.centralwidget.tabWidget.qt_tabwidget_stackedwidget.tab';
+var res = Test.batch([
+    {cmd: 'mouseClick', widget: tab + '.pushButton_ModalDialog',
+     button: 'Qt.LeftButton', x: 10, y: 10},
+    {cmd: 'keyClick', widget: 'MainWindow.<class_name=QMessageBox>',
+     keys: 'Esc'},
+    {cmd: 'mouseClick', widget: tab + '.comboBox', button: 'Qt.NoButton',
+     x: 10, y: 10},
+    {cmd: 'noSuchCommand', widget: tab + '.comboBox'},
+    {cmd: 'activateItem', widget: 'MainWindow.centralwidget.tabWidget.qt_tabwidget_tabbar',
+     item: 'Tab 6'},
+    {cmd: 'keyClick', widget: tab + '_6.lineEdit', keys: '1'}
+]);
+Test.AssertEqual('6', String(res.length));
+Test.Assert(res[0].ok);
+Test.Assert(res[1].ok);
+Test.Assert(!res[2].ok);
+Test.AssertEqual('Unknown mouse button Qt.NoButton', res[2].error);
+Test.Assert(!res[3].ok);
+Test.Assert(res[4].ok);
+Test.Assert(res[5].ok);
+Test.log("batch done");
+Test.quitApp();
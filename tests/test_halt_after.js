@@ -0,0 +1,4 @@
+var tab = 'MainWindow.centralwidget.tabWidget.qt_tabwidget_stackedwidget.tab';
+Test.keyClick(tab + '_6.lineEdit', '2');
+Test.log("second done");
+Test.quitApp();
@@ -0,0 +1,7 @@
+var tabbar = 'MainWindow.centralwidget.tabWidget.qt_tabwidget_tabbar';
+var tab = 'MainWindow.centralwidget.tabWidget.qt_tabwidget_stackedwidget.tab';
+Test.activateItem(tabbar, 'Tab 6');
+Test.log("endless started");
+// every step waits for GUI thread, halt should interrupt such wait
+for (;;)
+    Test.keyClick(tab + '_6.lineEdit', '1');
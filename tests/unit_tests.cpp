@@ -1,20 +1,33 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include <QApplication>
+#include <QLabel>
+#include <QWidget>
 #include <QtCore/QEventLoop>
 #include <QtCore/QThread>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpSocket>
 #include <QtTest/QSignalSpy>
 
 #include <gtest/gtest.h>
 
 #include "agent_qtmonkey_communication.hpp"
+#include "cbor.hpp"
 #include "common.hpp"
+#include "gui_idle_tracker.hpp"
 #include "json11.hpp"
+#include "json_writer.hpp"
+#include "mpsc_queue.hpp"
 #include "qtmonkey_app_api.hpp"
 #include "script.hpp"
+#include "widgets_index.hpp"
 
 using qt_monkey_common::operator<<;
 
@@ -47,7 +60,7 @@ static inline void PrintTo(const QString &str, ::std::ostream *os)
     *os << str.toLocal8Bit();
 }
 
-TEST(QtMonkey, CommunicationBasic)
+static void checkCommunication(bool viaSharedMemory = false)
 {
     using namespace qt_monkey_agent::Private;
     using namespace std::placeholders;
@@ -55,7 +68,7 @@ TEST(QtMonkey, CommunicationBasic)
     CommunicationMonkeyPart server;
     const auto env = server.requiredProcessEnvironment();
     ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
-    QSignalSpy serverSpy(&server, SIGNAL(newUserAppEvent(QString)));
+    QSignalSpy serverSpy(&server, SIGNAL(newUserAppEvent(QByteArray)));
     ASSERT_TRUE(serverSpy.isValid());
     QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
     ASSERT_TRUE(serverErr.isValid());
@@ -92,13 +105,541 @@ TEST(QtMonkey, CommunicationBasic)
         },
         std::chrono::milliseconds(1000));
     ASSERT_EQ(0, serverErr.count());
+    EXPECT_EQ(protocolVersion, server.agentProtocolVersion());
+    EXPECT_NE(0u, server.commonCapabilities() & CapChunkedMessages);
+    EXPECT_EQ(viaSharedMemory,
+              (server.commonCapabilities() & CapSharedMemory) != 0);
+    EXPECT_EQ(viaSharedMemory, server.agentUsedSharedMemory());
     ASSERT_EQ(2, serverSpy.count());
     QList<QVariant> userAppEventArgs
         = serverSpy.takeFirst(); // take the first signal
-    EXPECT_EQ(QString("Test.log(\"hi\");"), userAppEventArgs.at(0).toString());
+    EXPECT_EQ(QString("Test.log(\"hi\");"),
+              QString::fromUtf8(userAppEventArgs.at(0).toByteArray()));
     clientThread.wait(3000 /*milliseconds*/);
 }
 
+TEST(QtMonkey, CommunicationBasic) { checkCommunication(); }
+
+TEST(QtMonkey, CommunicationLocalSocket)
+{
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", "local"));
+    checkCommunication();
+    // return to default transport for other tests
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", QByteArray()));
+    ASSERT_TRUE(qputenv("QTMONKEY_SOCKET", QByteArray()));
+}
+
+TEST(QtMonkey, CommunicationSharedMemory)
+{
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", "shm"));
+    checkCommunication(true);
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", QByteArray()));
+}
+
+TEST(QtMonkey, CommunicationInternedIds)
+{
+    using namespace qt_monkey_agent::Private;
+
+    CommunicationMonkeyPart server;
+    const auto env = server.requiredProcessEnvironment();
+    ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
+    QSignalSpy serverSpy(&server, SIGNAL(newUserAppEvent(QByteArray)));
+    ASSERT_TRUE(serverSpy.isValid());
+    QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
+    ASSERT_TRUE(serverErr.isValid());
+    const QStringList events = {
+        "Test.mouseClick('MainWindow.<class_name=QSplitter>.centralWidget', "
+        "'Qt.LeftButton', 1, 2);",
+        "Test.keyClick('MainWindow.<class_name=QSplitter>.centralWidget', "
+        "'A');",
+        "Test.keyClick('short', 'B');",
+        "Test.log(\"no id\");",
+        "Test.mouseClick('MainWindow.<class_name=QSplitter>.centralWidget', "
+        "'Qt.RightButton', 3, 4);",
+        // position of id in UTF-16 and UTF-8 differs
+        QString::fromUtf8("Test.keyClick/*\xd0\xbf\xf0\x9f\x98\x80*/("
+                          "'MainWindow.<class_name=QSplitter>.centralWidget', "
+                          "'\xd0\xbf');"),
+    };
+
+    class ClientThread final : public QThread
+    {
+    public:
+        explicit ClientThread(const QStringList &events) : events_(events) {}
+        void run() override
+        {
+            CommunicationAgentPart client;
+            ASSERT_TRUE(client.connectToMonkey());
+            QEventLoop loop;
+            auto procFunc = [&loop](int milliseconds) {
+                loop.processEvents(QEventLoop::AllEvents, milliseconds);
+            };
+            // wait hello ack from monkey
+            processEventsForSomeTime(procFunc, std::chrono::milliseconds(200));
+            for (const QString &event : events_)
+                client.sendCommand(PacketTypeForMonkey::NewUserAppEvent,
+                                   event);
+            processEventsForSomeTime(procFunc, std::chrono::milliseconds(200));
+        }
+
+    private:
+        QStringList events_;
+    } clientThread(events);
+    clientThread.start();
+    processEventsForSomeTime(
+        [](int milliseconds) {
+            qApp->processEvents(QEventLoop::AllEvents, milliseconds);
+        },
+        std::chrono::milliseconds(1000));
+    clientThread.wait();
+    ASSERT_EQ(0, serverErr.count());
+    EXPECT_NE(0u, server.commonCapabilities() & CapInternedIds);
+    ASSERT_EQ(events.size(), serverSpy.count());
+    for (int i = 0; i < events.size(); ++i)
+        EXPECT_EQ(events[i],
+                  QString::fromUtf8(serverSpy.at(i).at(0).toByteArray()));
+}
+
+//! packet in format of agent, that knows nothing about Hello
+static QByteArray oldAgentPacket(uint32_t type, const QByteArray &payload)
+{
+    const uint32_t header[]
+        = {0x12345678u, type, static_cast<uint32_t>(payload.size())};
+    return QByteArray(reinterpret_cast<const char *>(header), sizeof(header))
+           + payload;
+}
+
+TEST(QtMonkey, CommunicationOldAgent)
+{
+    using namespace qt_monkey_agent::Private;
+
+    // monkey would like to use shared memory, but agent can not
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", "shm"));
+    CommunicationMonkeyPart server;
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", QByteArray()));
+    const auto env = server.requiredProcessEnvironment();
+    ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
+    QSignalSpy serverSpy(&server, SIGNAL(newUserAppEvent(QByteArray)));
+    ASSERT_TRUE(serverSpy.isValid());
+    QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
+    ASSERT_TRUE(serverErr.isValid());
+
+    class OldAgentThread final : public QThread
+    {
+    public:
+        QByteArray received;
+        void run() override
+        {
+            QTcpSocket sock;
+            sock.connectToHost(QHostAddress::LocalHost,
+                               qgetenv("QTMONKEY_PORT").toUShort());
+            ASSERT_TRUE(sock.waitForConnected(3000 /*ms*/));
+            sock.write(oldAgentPacket(
+                static_cast<uint32_t>(PacketTypeForMonkey::NewUserAppEvent),
+                "Test.log('old');"));
+            sock.flush();
+            const auto startTime = std::chrono::steady_clock::now();
+            while ((std::chrono::steady_clock::now() - startTime)
+                   < std::chrono::milliseconds(2500))
+                if (sock.waitForReadyRead(50 /*ms*/))
+                    received.append(sock.readAll());
+        }
+    } agentThread;
+    agentThread.start();
+    auto procFunc = [](int milliseconds) {
+        qApp->processEvents(QEventLoop::AllEvents, milliseconds);
+    };
+    processEventsForSomeTime(procFunc, std::chrono::milliseconds(1000));
+    server.sendCommand(PacketTypeForAgent::RunScript, "Test.log('hi');");
+    processEventsForSomeTime(procFunc, std::chrono::milliseconds(1000));
+    agentThread.wait();
+
+    ASSERT_EQ(0, serverErr.count());
+    EXPECT_EQ(0u, server.agentProtocolVersion());
+    EXPECT_EQ(0u, server.commonCapabilities());
+    ASSERT_EQ(1, serverSpy.count());
+    EXPECT_EQ(QByteArray("Test.log('old');"),
+              serverSpy.at(0).at(0).toByteArray());
+    // only packet, that old agent knows
+    EXPECT_EQ(oldAgentPacket(
+                  static_cast<uint32_t>(PacketTypeForAgent::RunScript),
+                  "Test.log('hi');"),
+              agentThread.received);
+}
+
+static void checkBigMessage(bool viaSharedMemory)
+{
+    using namespace qt_monkey_agent::Private;
+
+    CommunicationMonkeyPart server;
+    const auto env = server.requiredProcessEnvironment();
+    ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
+    QSignalSpy serverSpy(&server, SIGNAL(newUserAppEvent(QByteArray)));
+    ASSERT_TRUE(serverSpy.isValid());
+    QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
+    ASSERT_TRUE(serverErr.isValid());
+    // bigger then limit of one packet, and characters in UTF-8 take
+    // different number of bytes, so some of them split between packets
+    QString bigMsg;
+    for (int i = 0; i < 1024 * 1024; ++i)
+        bigMsg.append(QChar(i % 2 == 0 ? 0x43F : 'a'));
+
+    class ClientThread final : public QThread
+    {
+    public:
+        ClientThread(const QString &msg, bool waitHello)
+            : msg_(msg), waitHello_(waitHello)
+        {
+        }
+        void run() override
+        {
+            CommunicationAgentPart client;
+            ASSERT_TRUE(client.connectToMonkey());
+            QEventLoop loop;
+            auto procFunc = [&loop](int milliseconds) {
+                loop.processEvents(QEventLoop::AllEvents, milliseconds);
+            };
+            // to send via shared memory, it should be attached
+            if (waitHello_)
+                processEventsForSomeTime(procFunc,
+                                         std::chrono::milliseconds(200));
+            client.sendCommand(PacketTypeForMonkey::NewUserAppEvent, msg_);
+            client.sendCommand(PacketTypeForMonkey::NewUserAppEvent, "small");
+            processEventsForSomeTime(procFunc, std::chrono::milliseconds(1000));
+        }
+
+    private:
+        QString msg_;
+        bool waitHello_;
+    } clientThread(bigMsg, viaSharedMemory);
+    clientThread.start();
+    processEventsForSomeTime(
+        [](int milliseconds) {
+            qApp->processEvents(QEventLoop::AllEvents, milliseconds);
+        },
+        std::chrono::milliseconds(1000));
+    clientThread.wait();
+    ASSERT_EQ(0, serverErr.count());
+    EXPECT_EQ(viaSharedMemory, server.agentUsedSharedMemory());
+    ASSERT_EQ(2, serverSpy.count());
+    EXPECT_TRUE(bigMsg
+                == QString::fromUtf8(serverSpy.at(0).at(0).toByteArray()));
+    EXPECT_EQ(QByteArray("small"), serverSpy.at(1).at(0).toByteArray());
+}
+
+TEST(QtMonkey, CommunicationBigMessage) { checkBigMessage(false); }
+
+TEST(QtMonkey, CommunicationSharedMemoryBigMessage)
+{
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", "shm"));
+    // message is bigger then ring, so writer waits for free space
+    checkBigMessage(true);
+    ASSERT_TRUE(qputenv("QTMONKEY_TRANSPORT", QByteArray()));
+}
+
+TEST(QtMonkey, CommunicationBackpressure)
+{
+    using namespace qt_monkey_agent::Private;
+    static constexpr int nLogs = 200 * 1000;
+    static constexpr int nEvents = 10;
+
+    CommunicationMonkeyPart server;
+    const auto env = server.requiredProcessEnvironment();
+    ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
+    QSignalSpy logSpy(&server, SIGNAL(scriptLog(QByteArray)));
+    ASSERT_TRUE(logSpy.isValid());
+    QSignalSpy endSpy(&server, SIGNAL(scriptEnd()));
+    ASSERT_TRUE(endSpy.isValid());
+    QSignalSpy eventSpy(&server, SIGNAL(newUserAppEvent(QByteArray)));
+    ASSERT_TRUE(eventSpy.isValid());
+    QSignalSpy scriptErrSpy(&server, SIGNAL(scriptError(QByteArray)));
+    ASSERT_TRUE(scriptErrSpy.isValid());
+    QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
+    ASSERT_TRUE(serverErr.isValid());
+
+    class ClientThread final : public QThread
+    {
+    public:
+        std::atomic<bool> flooded{false};
+        std::atomic<bool> timeToExit{false};
+        uint64_t blockedByEvents = 0;
+        SendQueueStats stats;
+        void run() override
+        {
+            CommunicationAgentPart client;
+            client.setWatermarks(64 * 1024, 256 * 1024);
+            ASSERT_TRUE(client.connectToMonkey());
+            QEventLoop loop;
+            auto procFunc = [&loop](int milliseconds) {
+                loop.processEvents(QEventLoop::AllEvents, milliseconds);
+            };
+            processEventsForSomeTime(procFunc, std::chrono::milliseconds(200));
+            // monkey not read anything, so buffers overflow
+            const QString log(100, QLatin1Char('x'));
+            for (int i = 0; i < nLogs; ++i)
+                client.sendCommand(PacketTypeForMonkey::ScriptLog, log);
+            // not thread of client, like GUI thread it should queue
+            // events, and like script thread it should wait until monkey
+            // read something before sending result of script
+            std::thread sender([this, &client] {
+                for (int i = 0; i < nEvents; ++i)
+                    client.sendCommand(PacketTypeForMonkey::NewUserAppEvent,
+                                       QStringLiteral("Test.log('%1');")
+                                           .arg(i));
+                blockedByEvents = client.sendQueueStats().blockedSends;
+                client.sendCommand(PacketTypeForMonkey::ScriptError,
+                                   "my bad");
+                client.sendCommand(PacketTypeForMonkey::ScriptEnd,
+                                   QString());
+            });
+            while (client.sendQueueStats().blockedSends == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            flooded = true;
+            while (!timeToExit)
+                loop.processEvents(QEventLoop::AllEvents, 50 /*ms*/);
+            sender.join();
+            stats = client.sendQueueStats();
+        }
+    } clientThread;
+    clientThread.start();
+    // accept connection
+    processEventsForSomeTime(
+        [](int milliseconds) {
+            qApp->processEvents(QEventLoop::AllEvents, milliseconds);
+        },
+        std::chrono::milliseconds(100));
+    while (!clientThread.flooded)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const auto startTime = std::chrono::steady_clock::now();
+    while (endSpy.count() == 0
+           && (std::chrono::steady_clock::now() - startTime)
+                  < std::chrono::seconds(30))
+        qApp->processEvents(QEventLoop::AllEvents, 50 /*ms*/);
+    // wait report about dropped logs
+    processEventsForSomeTime(
+        [](int milliseconds) {
+            qApp->processEvents(QEventLoop::AllEvents, milliseconds);
+        },
+        std::chrono::milliseconds(500));
+    clientThread.timeToExit = true;
+    clientThread.wait();
+    ASSERT_EQ(0, serverErr.count());
+    ASSERT_EQ(1, endSpy.count());
+    ASSERT_EQ(1, scriptErrSpy.count());
+    ASSERT_EQ(nEvents, eventSpy.count());
+    for (int i = 0; i < nEvents; ++i)
+        EXPECT_EQ(QByteArray("Test.log('") + QByteArray::number(i) + "');",
+                  eventSpy.at(i).at(0).toByteArray());
+    const SendQueueStats &stats = clientThread.stats;
+    EXPECT_EQ(0u, clientThread.blockedByEvents);
+    EXPECT_GT(stats.blockedSends, 0u);
+    EXPECT_GT(stats.droppedLogs, 0u);
+    EXPECT_EQ(stats.droppedLogs * 100, stats.droppedLogChars);
+    EXPECT_LT(stats.maxQueuedBytes, 256u * 1024 + 1024);
+    ASSERT_EQ(static_cast<int>(nLogs - stats.droppedLogs + 1),
+              logSpy.count());
+    EXPECT_TRUE(logSpy.last().at(0).toByteArray().contains(
+        QByteArray::number(static_cast<qulonglong>(stats.droppedLogs))));
+}
+
+TEST(QtMonkey, ShmRing)
+{
+    using qt_monkey_common::ShmRing;
+    static constexpr uint32_t capacity = 64;
+    std::vector<char> mem(ShmRing::memorySize(capacity));
+    ShmRing writer(mem.data(), capacity, true);
+    ShmRing reader(mem.data(), capacity, false);
+    char next = 0, nextRead = 0;
+    for (size_t i = 1; i < 1000; ++i) {
+        const size_t n = i % 100 + 1;
+        std::vector<char> data(n);
+        for (char &c : data)
+            c = next++;
+        bool wakeUpReader;
+        const size_t written = writer.write(data.data(), n, wakeUpReader);
+        // reader always read all, so it waits new data
+        ASSERT_EQ(written > 0, wakeUpReader);
+        ASSERT_EQ(std::min<size_t>(n, capacity), written);
+        next -= static_cast<char>(n - written);
+        std::vector<char> buf(capacity + 1);
+        bool wakeUpWriter;
+        const size_t nRead = reader.read(buf.data(), buf.size(), wakeUpWriter);
+        ASSERT_EQ(written, nRead);
+        ASSERT_EQ(written < n, wakeUpWriter);
+        for (size_t j = 0; j < nRead; ++j)
+            ASSERT_EQ(nextRead++, buf[j]);
+    }
+}
+
+TEST(QtMonkey, GuiIdle)
+{
+    using qt_monkey_agent::Private::GuiIdleTracker;
+    using Clock = std::chrono::steady_clock;
+
+    GuiIdleTracker tracker;
+    tracker.setIdleWindowMs(30);
+    const auto never = [] { return false; };
+    QObject obj;
+    // emulate event loop, which sleeps between ticks of timer
+    auto runLoop = [&tracker, &obj](int timerId, int sleepMs) {
+        const auto end = Clock::now() + std::chrono::milliseconds(300);
+        while (Clock::now() < end) {
+            tracker.aboutToBlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+            QTimerEvent event(timerId);
+            tracker.eventSeen(&obj, &event);
+        }
+    };
+    QEvent update(QEvent::UpdateRequest);
+    auto idleDuringLoop = [&](int timerId, int sleepMs) {
+        tracker.eventSeen(&obj, &update);
+        bool idle = false;
+        std::thread waiter([&tracker, &never, &idle] {
+            idle = tracker.waitForIdle(200, never);
+        });
+        runLoop(timerId, sleepMs);
+        waiter.join();
+        return idle;
+    };
+
+    tracker.eventSeen(&obj, &update);
+    // event loop was not going to wait after event
+    EXPECT_FALSE(tracker.waitForIdle(100, never));
+    tracker.aboutToBlock();
+    EXPECT_TRUE(tracker.waitForIdle(1000, never));
+    tracker.eventSeen(&obj, &update);
+    // for example, script halted
+    EXPECT_FALSE(tracker.waitForIdle(1000, [] { return true; }));
+
+    // ticks of periodic timer, like animation, are not activity
+    const int periodicTimer = obj.startTimer(5);
+    EXPECT_TRUE(idleDuringLoop(periodicTimer, 5));
+    obj.killTimer(periodicTimer);
+    const int zeroTimer = obj.startTimer(0);
+    EXPECT_FALSE(idleDuringLoop(zeroTimer, 0));
+    obj.killTimer(zeroTimer);
+}
+
+TEST(QtMonkey, MpscQueue)
+{
+    static constexpr int nThreads = 4;
+    static constexpr int nItems = 100 * 1000;
+    qt_monkey_common::MpscQueue<std::pair<int, int>> queue;
+    std::vector<std::thread> producers;
+    for (int t = 0; t < nThreads; ++t)
+        producers.emplace_back([&queue, t] {
+            for (int i = 0; i < nItems; ++i)
+                queue.push(std::make_pair(t, i));
+        });
+    // order of items from the same producer should be kept
+    std::vector<int> next(nThreads, 0);
+    std::pair<int, int> item;
+    for (int n = 0; n < nThreads * nItems;) {
+        if (!queue.pop(item))
+            continue;
+        ASSERT_EQ(next[item.first], item.second);
+        ++next[item.first];
+        ++n;
+    }
+    for (std::thread &producer : producers)
+        producer.join();
+    EXPECT_FALSE(queue.pop(item));
+}
+
+TEST(QtMonkey, RecvBuffer)
+{
+    using qt_monkey_agent::Private::RecvBuffer;
+    RecvBuffer buf;
+    EXPECT_TRUE(buf.isEmpty());
+    char next = 0, nextRead = 0;
+    for (size_t i = 1; i < 1000; ++i) {
+        const size_t n = i % 37 + 1;
+        char *p = buf.prepareWrite(n);
+        for (size_t j = 0; j < n; ++j)
+            p[j] = next++;
+        buf.commitWrite(n);
+        // leave some data unread, so buffer should move it
+        const size_t toRead = buf.size() > 5 ? buf.size() - i % 5 : 0;
+        for (size_t j = 0; j < toRead; ++j)
+            ASSERT_EQ(nextRead++, buf.data()[j]);
+        buf.consume(toRead);
+    }
+    buf.consume(buf.size());
+    EXPECT_TRUE(buf.isEmpty());
+    EXPECT_EQ(0u, buf.size());
+}
+
+TEST(QtMonkey, MessageAssembler)
+{
+    using qt_monkey_agent::Private::MessageAssembler;
+    MessageAssembler message;
+    EXPECT_TRUE(message.isEmpty());
+    EXPECT_TRUE(message.append("ab", 2));
+    EXPECT_TRUE(message.append("c", 1));
+    EXPECT_EQ(QByteArray("abc"), message.take());
+    EXPECT_TRUE(message.isEmpty());
+
+    const std::vector<char> chunk(MessageAssembler::maxMessageSize / 2 + 1,
+                                  'x');
+    EXPECT_TRUE(message.append(chunk.data(), chunk.size()));
+    EXPECT_FALSE(message.append(chunk.data(), chunk.size()));
+    EXPECT_TRUE(message.isSkipped());
+    // the rest of too big message is ignored, without new error
+    EXPECT_TRUE(message.append(chunk.data(), chunk.size()));
+    EXPECT_TRUE(message.take().isEmpty());
+    EXPECT_FALSE(message.isSkipped());
+    EXPECT_TRUE(message.append("d", 1));
+    EXPECT_EQ(QByteArray("d"), message.take());
+}
+
+TEST(QtMonkey, CommunicationThroughput)
+{
+    using namespace qt_monkey_agent::Private;
+    static constexpr int nPackets = 1000 * 1000;
+
+    CommunicationMonkeyPart server;
+    const auto env = server.requiredProcessEnvironment();
+    ASSERT_TRUE(qputenv(env.first.toUtf8().data(), env.second.toUtf8()));
+    // signal without arguments, so spy not eat too much memory
+    QSignalSpy serverSpy(&server, SIGNAL(scriptEnd()));
+    ASSERT_TRUE(serverSpy.isValid());
+    QSignalSpy serverErr(&server, SIGNAL(error(const QString &)));
+    ASSERT_TRUE(serverErr.isValid());
+
+    class ClientThread final : public QThread
+    {
+    public:
+        std::atomic<bool> timeToExit{false};
+        void run() override
+        {
+            CommunicationAgentPart client;
+            ASSERT_TRUE(client.connectToMonkey());
+            for (int i = 0; i < nPackets; ++i)
+                client.sendCommand(PacketTypeForMonkey::ScriptEnd, QString());
+            QEventLoop loop;
+            while (!timeToExit)
+                loop.processEvents(QEventLoop::AllEvents, 50 /*ms*/);
+        }
+    } clientThread;
+    const auto startTime = std::chrono::steady_clock::now();
+    clientThread.start();
+    const auto maxTime = std::chrono::seconds(60);
+    while (serverSpy.count() < nPackets && serverErr.count() == 0
+           && (std::chrono::steady_clock::now() - startTime) < maxTime)
+        qApp->processEvents(QEventLoop::AllEvents, 50 /*ms*/);
+    const double elapsedSec
+        = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                        - startTime)
+              .count();
+    clientThread.timeToExit = true;
+    clientThread.wait();
+    ASSERT_EQ(0, serverErr.count());
+    ASSERT_EQ(nPackets, serverSpy.count());
+    std::cout << "[          ] " << nPackets << " packets in " << elapsedSec
+              << " s, " << static_cast<long long>(nPackets / elapsedSec)
+              << " packets/s\n";
+}
+
 TEST(QtMonkey, app_api)
 {
     using namespace qt_monkey_app;
@@ -109,6 +650,8 @@ TEST(QtMonkey, app_api)
     data.append(createPacketFromScriptEnd());
     QString logMsg = "Hi!";
     data.append(createPacketFromUserAppScriptLog(logMsg));
+    // should be skipped by old parsers
+    data.append(createPacketFromAgentReady(1500000000000, 150));
 
     size_t pos;
     size_t eventsCnt = 0, errMsgsCnt = 0, endCnt = 0, logCnt = 0;
@@ -143,7 +686,8 @@ TEST(QtMonkey, app_api)
 
     QString scriptFile{"aaa.txt"};
     data = createPacketFromRunScript(script, scriptFile);
-    size_t runScriptCnt = 0;
+    data.append(createPacketFromHaltScript());
+    size_t runScriptCnt = 0, haltCnt = 0;
     errs = 0;
     parseOutputFromGui(data, pos,
                        [&script, &scriptFile, &runScriptCnt](
@@ -152,6 +696,7 @@ TEST(QtMonkey, app_api)
                            EXPECT_EQ(script, scriptCode);
                            EXPECT_EQ(scriptFile, scriptFileName);
                        },
+                       [&haltCnt]() { ++haltCnt; },
                        [&errs](QString data) {
                            qWarning("%s: data %s", Q_FUNC_INFO,
                                     qPrintable(data));
@@ -159,9 +704,169 @@ TEST(QtMonkey, app_api)
                        });
     EXPECT_EQ(0u, errs);
     EXPECT_EQ(1u, runScriptCnt);
+    EXPECT_EQ(1u, haltCnt);
     EXPECT_EQ(static_cast<size_t>(data.size()), pos);
 }
 
+TEST(QtMonkey, app_api_stream)
+{
+    using namespace qt_monkey_app;
+    const QString script = QStringLiteral("Test.log(\"{[\\\"\"); ")
+                           + QString(10000, QChar(0x43f));
+    const QString logMsg = QStringLiteral("}]\"\n");
+    std::string data = createPacketFromUserAppEvent(script);
+    data.append("\n");
+    data.append(createPacketFromUserAppScriptLog(logMsg));
+    data.append(createPacketFromScriptEnd());
+    data.append(createPacketFromAgentReady(1500000000000, 150));
+    data.append(createPacketFromUserAppEvent(script));
+
+    for (size_t chunkSize : {size_t(1), size_t(7), size_t(4096), data.size()}) {
+        size_t eventsCnt = 0, endCnt = 0, logCnt = 0, errs = 0;
+        MonkeyAppStreamParser parser(
+            [&script, &eventsCnt](QString data) {
+                ++eventsCnt;
+                EXPECT_EQ(script, data);
+            },
+            [&errs](QString) { ++errs; }, [&endCnt]() { ++endCnt; },
+            [&logCnt, &logMsg](QString scriptLog) {
+                ++logCnt;
+                EXPECT_EQ(logMsg, scriptLog);
+            },
+            [&errs](QString) { ++errs; });
+        const size_t lastByte = data.size() - 1;
+        for (size_t pos = 0; pos < lastByte; pos += chunkSize)
+            parser.feed(data.data() + pos, std::min(chunkSize, lastByte - pos));
+        // message reported as soon as its last byte arrives
+        EXPECT_EQ(1u, eventsCnt);
+        parser.feed(data.data() + lastByte, 1);
+        EXPECT_EQ(2u, eventsCnt);
+        EXPECT_EQ(1u, endCnt);
+        EXPECT_EQ(1u, logCnt);
+        EXPECT_EQ(0u, errs);
+    }
+
+    const QString scriptFile{"aaa.txt"};
+    data = createPacketFromRunScript(script, scriptFile);
+    data.append(createPacketFromHaltScript());
+    size_t runScriptCnt = 0, haltCnt = 0, errs = 0;
+    GuiStreamParser parser(
+        [&script, &scriptFile, &runScriptCnt](QString scriptCode,
+                                              QString scriptFileName) {
+            ++runScriptCnt;
+            EXPECT_EQ(script, scriptCode);
+            EXPECT_EQ(scriptFile, scriptFileName);
+        },
+        [&haltCnt]() { ++haltCnt; }, [&errs](QString) { ++errs; });
+    for (char c : data)
+        parser.feed(&c, 1);
+    parser.feed("{bad}", 5);
+    EXPECT_EQ(1u, runScriptCnt);
+    EXPECT_EQ(1u, haltCnt);
+    EXPECT_EQ(1u, errs);
+}
+
+TEST(QtMonkey, app_api_cbor)
+{
+    using namespace qt_monkey_app;
+    const QString script = QStringLiteral("Test.log(\"\\n\"); ")
+                           + QString(300, QChar(0x43f));
+    const QString logMsg = QStringLiteral("}]\"\n");
+    std::string data;
+    appendPacketFromUserAppEvent(data, script.toUtf8(), Protocol::Cbor);
+    appendPacketFromUserAppScriptLog(data, logMsg, Protocol::Cbor);
+    appendPacketFromUserAppErrors(data, logMsg.toUtf8(), Protocol::Cbor);
+    appendPacketFromScriptEnd(data, Protocol::Cbor);
+    appendPacketFromAgentReady(data, 1500000000000, 150, Protocol::Cbor);
+    // big endian length of frame before data item
+    EXPECT_EQ(0, data[0]);
+
+    size_t eventsCnt = 0, endCnt = 0, logCnt = 0, errOutCnt = 0, errs = 0;
+    MonkeyAppStreamParser parser(
+        [&script, &eventsCnt](QString data) {
+            ++eventsCnt;
+            EXPECT_EQ(script, data);
+        },
+        [&errOutCnt, &logMsg](QString errOut) {
+            ++errOutCnt;
+            EXPECT_EQ(logMsg, errOut);
+        },
+        [&endCnt]() { ++endCnt; },
+        [&logCnt, &logMsg](QString scriptLog) {
+            ++logCnt;
+            EXPECT_EQ(logMsg, scriptLog);
+        },
+        [&errs](QString) { ++errs; }, Protocol::Cbor);
+    for (char c : data)
+        parser.feed(&c, 1);
+    EXPECT_EQ(1u, eventsCnt);
+    EXPECT_EQ(1u, errOutCnt);
+    EXPECT_EQ(1u, endCnt);
+    EXPECT_EQ(1u, logCnt);
+    EXPECT_EQ(0u, errs);
+
+    const QString scriptFile{"aaa.txt"};
+    data.clear();
+    appendPacketFromRunScript(data, script, scriptFile, Protocol::Cbor);
+    appendPacketFromHaltScript(data, Protocol::Cbor);
+    size_t runScriptCnt = 0, haltCnt = 0;
+    GuiStreamParser guiParser(
+        [&script, &scriptFile, &runScriptCnt](QString scriptCode,
+                                              QString scriptFileName) {
+            ++runScriptCnt;
+            EXPECT_EQ(script, scriptCode);
+            EXPECT_EQ(scriptFile, scriptFileName);
+        },
+        [&haltCnt]() { ++haltCnt; }, [&errs](QString) { ++errs; },
+        Protocol::Cbor);
+    guiParser.feed(data.data(), data.size());
+    // frame with map, which has key, but not value
+    guiParser.feed("\0\0\0\2\xa1\x60", 6);
+    EXPECT_EQ(1u, runScriptCnt);
+    EXPECT_EQ(1u, haltCnt);
+    EXPECT_EQ(1u, errs);
+
+    std::string cbor;
+    appendCborInt(cbor, -1500000000000);
+    json11::Json res;
+    std::string err;
+    ASSERT_TRUE(parseCbor(cbor.data(), cbor.size(), res, err)) << err;
+    EXPECT_EQ(-1500000000000., res.number_value());
+    cbor += '\0';
+    EXPECT_FALSE(parseCbor(cbor.data(), cbor.size(), res, err));
+}
+
+TEST(QtMonkey, json_writer)
+{
+    using namespace qt_monkey_app;
+    QString str = QStringLiteral("\"\\/\b\f\n\r\t") + QChar(1) + QChar(0x1f)
+                  + QString(40, QLatin1Char('a')) + QChar(0x43f)
+                  + QChar(0xd83d) + QChar(0xde00) + QStringLiteral("end");
+    // all positions of special characters relative to 8/16 bytes blocks
+    for (int i = 0; i < 17; ++i) {
+        std::string out;
+        appendJsonString(out, str);
+        std::string err;
+        const json11::Json res = json11::Json::parse(out, err);
+        ASSERT_TRUE(err.empty()) << err << " in " << out;
+        ASSERT_TRUE(res.is_string());
+        EXPECT_EQ(str, QString::fromUtf8(res.string_value().c_str()));
+
+        const QByteArray utf8 = str.toUtf8();
+        std::string out2;
+        appendJsonString(out2, utf8.constData(),
+                         static_cast<size_t>(utf8.size()));
+        EXPECT_EQ(out, out2);
+        str.prepend(QLatin1Char('b'));
+    }
+    std::string out;
+    appendJsonString(out, QString() + QChar(0xdc00));
+    EXPECT_EQ(std::string("\"\xef\xbf\xbd\""), out);
+    out.clear();
+    appendJsonNumber(out, -1500000000000);
+    EXPECT_EQ(std::string("-1500000000000"), out);
+}
+
 TEST(Script, basic)
 {
     using qt_monkey_agent::Private::Script;
@@ -194,6 +899,245 @@ TEST(Script, basic)
     ASSERT_EQ(0u, res.size());
 }
 
+namespace
+{
+class IndexUpdater final : public QObject
+{
+public:
+    explicit IndexUpdater(qt_monkey_agent::Private::WidgetsIndex &index)
+        : index_(index)
+    {
+    }
+    bool eventFilter(QObject *obj, QEvent *event) override
+    {
+        index_.handleEvent(obj, event);
+        return QObject::eventFilter(obj, event);
+    }
+
+private:
+    qt_monkey_agent::Private::WidgetsIndex &index_;
+};
+} // namespace
+
+TEST(WidgetsIndex, basic)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+
+    QWidget top;
+    top.setObjectName("top");
+    EXPECT_EQ(&top, index.findByName("top"));
+
+    auto label1 = new QLabel(&top);
+    auto label2 = new QLabel(&top);
+    label2->setObjectName("label2");
+    QApplication::sendPostedEvents();
+    // index built before widgets were named, so should see them via events
+    EXPECT_EQ(label2, index.findChild(top, "label2", QString(), 0, false));
+    EXPECT_EQ(label1, index.findChild(top, QString(), "QLabel", 0, false));
+    EXPECT_EQ(label2, index.findChild(top, QString(), "QLabel", 1, false));
+    EXPECT_EQ(nullptr, index.findChild(top, QString(), "QLabel", 2, false));
+
+    // rename do not generate any event
+    label2->setObjectName("label3");
+    EXPECT_EQ(nullptr, index.findChild(top, "label2", QString(), 0, false));
+    EXPECT_EQ(label2, index.findChild(top, "label3", QString(), 0, false));
+
+    delete label1;
+    EXPECT_EQ(label2, index.findChild(top, QString(), "QLabel", 0, false));
+
+    {
+        QWidget another;
+        another.setObjectName("top");
+        index.addNamed(another);
+        // two widgets with the same name, result depend on search order
+        EXPECT_EQ(nullptr, index.findByName("top"));
+    }
+    EXPECT_EQ(&top, index.findByName("top"));
+    qApp->removeEventFilter(&updater);
+}
+
+TEST(WidgetsIndex, paths)
+{
+    using namespace qt_monkey_agent::Private;
+
+    const WidgetPath path = parseWidgetId(
+        "main.<class_name=QLineEdit,2>.<class_name=QLabel>.<class_name=>");
+    ASSERT_EQ(4u, path.size());
+    EXPECT_EQ(QString("main"), path[0].name);
+    EXPECT_TRUE(path[0].className.isEmpty());
+    EXPECT_EQ(QString("QLineEdit"), path[1].className);
+    EXPECT_EQ(2, path[1].order);
+    EXPECT_EQ(QString("QLabel"), path[2].className);
+    EXPECT_EQ(0, path[2].order);
+    EXPECT_TRUE(path[3].className.isEmpty());
+
+    WidgetsIndex index;
+    QWidget top;
+    top.setObjectName("top");
+    auto label1 = new QLabel(&top);
+    auto label2 = new QLabel(&top);
+    const QString id = "top.<class_name=QLabel,1>";
+    EXPECT_EQ(nullptr, index.cachedWidget(id, false));
+    index.cacheWidget(id, false, *label2);
+    EXPECT_EQ(label2, index.cachedWidget(id, false));
+    // widget that not satisfy id is not cached
+    index.cacheWidget(id, false, *label1);
+    EXPECT_EQ(nullptr, index.cachedWidget(id, false));
+    index.cacheWidget(id, false, *label2);
+    delete label1;
+    EXPECT_EQ(nullptr, index.cachedWidget(id, false));
+}
+
+TEST(WidgetsIndex, classOrder)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+    QWidget top;
+    auto label1 = new QLabel(&top);
+    new QWidget(&top);
+    auto label2 = new QLabel(&top);
+    int order = -1, count = -1;
+    EXPECT_FALSE(index.classOrder(top, order, count));
+    ASSERT_TRUE(index.classOrder(*label2, order, count));
+    EXPECT_EQ(1, order);
+    EXPECT_EQ(2, count);
+    EXPECT_EQ(label2, index.findChild(top, QString(), "QLabel", 1, false));
+    delete label1;
+    ASSERT_TRUE(index.classOrder(*label2, order, count));
+    EXPECT_EQ(0, order);
+    EXPECT_EQ(1, count);
+    qApp->removeEventFilter(&updater);
+}
+
+TEST(WidgetsIndex, zOrder)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+    QWidget top;
+    auto label1 = new QLabel(&top);
+    auto label2 = new QLabel(&top);
+    int order = -1, count = -1;
+    ASSERT_TRUE(index.classOrder(*label1, order, count));
+    EXPECT_EQ(0, order);
+    // raise, lower reorder children of parent, without ChildAdded/Removed
+    label1->raise();
+    ASSERT_TRUE(index.classOrder(*label1, order, count));
+    EXPECT_EQ(1, order);
+    ASSERT_TRUE(index.classOrder(*label2, order, count));
+    EXPECT_EQ(0, order);
+    EXPECT_EQ(label1, index.findChild(top, QString(), "QLabel", 1, false));
+    label1->lower();
+    ASSERT_TRUE(index.classOrder(*label1, order, count));
+    EXPECT_EQ(0, order);
+    EXPECT_EQ(2, count);
+    EXPECT_EQ(label1, index.findChild(top, QString(), "QLabel", 0, false));
+    EXPECT_EQ(label2, index.findChild(top, QString(), "QLabel", 1, false));
+    qApp->removeEventFilter(&updater);
+}
+
+static QString testObjectId(const QObject &obj)
+{
+    return obj.objectName().isEmpty()
+               ? QString::fromLatin1(obj.metaObject()->className())
+               : obj.objectName();
+}
+
+TEST(WidgetsIndex, fullId)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+    QWidget top;
+    top.setObjectName("top");
+    QWidget another;
+    another.setObjectName("another");
+    auto middle = new QWidget(&top);
+    auto label = new QLabel(middle);
+    EXPECT_EQ(QString("top.QWidget.QLabel"), index.fullId(*label, testObjectId));
+    middle->setObjectName("middle");
+    EXPECT_EQ(QString("top.middle.QLabel"), index.fullId(*label, testObjectId));
+    middle->setParent(&another);
+    EXPECT_EQ(QString("another.middle.QLabel"),
+              index.fullId(*label, testObjectId));
+    label->setObjectName("label");
+    EXPECT_EQ(QString("another.middle.label"),
+              index.fullId(*label, testObjectId));
+    qApp->removeEventFilter(&updater);
+}
+
+static QString orderObjectId(const QObject &obj)
+{
+    const QObject *parent = obj.parent();
+    if (parent == nullptr)
+        return QStringLiteral("0");
+    return QString::number(
+        parent->children().indexOf(const_cast<QObject *>(&obj)));
+}
+
+TEST(WidgetsIndex, fullIdZOrder)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+    QWidget top;
+    auto w1 = new QWidget(&top);
+    auto w2 = new QWidget(&top);
+    auto label = new QLabel(w1);
+    EXPECT_EQ(QString("0.0.0"), index.fullId(*label, orderObjectId));
+    EXPECT_EQ(QString("0.1"), index.fullId(*w2, orderObjectId));
+    w1->raise();
+    EXPECT_EQ(QString("0.1.0"), index.fullId(*label, orderObjectId));
+    EXPECT_EQ(QString("0.0"), index.fullId(*w2, orderObjectId));
+    qApp->removeEventFilter(&updater);
+}
+
+TEST(WidgetsIndex, waiters)
+{
+    using qt_monkey_agent::Private::WidgetsIndex;
+    using qt_monkey_common::Semaphore;
+
+    WidgetsIndex index;
+    IndexUpdater updater(index);
+    qApp->installEventFilter(&updater);
+
+    std::shared_ptr<Semaphore> byName{new Semaphore{0}};
+    std::shared_ptr<Semaphore> byClass{new Semaphore{0}};
+    std::shared_ptr<Semaphore> removed{new Semaphore{0}};
+    index.addWaiter("button", QString(), byName);
+    index.addWaiter(QString(), "QLabel", byClass);
+    index.addWaiter("button", QString(), removed);
+    index.removeWaiter(*removed);
+
+    QWidget top;
+    auto button = new QWidget(&top);
+    button->setObjectName("button");
+    auto label = new QLabel(&top);
+    label->setEnabled(false);
+    top.show();
+    EXPECT_TRUE(byName->tryAcquire(1, std::chrono::milliseconds(0)));
+    EXPECT_FALSE(removed->tryAcquire(1, std::chrono::milliseconds(0)));
+
+    byClass->tryAcquire(1, std::chrono::milliseconds(0));
+    index.addWaiter(QString(), "QLabel", byClass);
+    label->setEnabled(true);
+    EXPECT_TRUE(byClass->tryAcquire(1, std::chrono::milliseconds(0)));
+    qApp->removeEventFilter(&updater);
+}
+
 #if QT_VERSION >= 0x050000
 static void msgHandler(QtMsgType type, const QMessageLogContext &,
                        const QString &msg)
@@ -19,17 +19,22 @@
 #include <QTableView>
 #include <QTreeWidget>
 #include <QWidget>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
 
 #include "agent.hpp"
 #include "common.hpp"
+#include "widgets_index.hpp"
 
 using qt_monkey_agent::CustomEventAnalyzer;
 using qt_monkey_agent::EventInfo;
 using qt_monkey_agent::GenerateCommand;
+using qt_monkey_agent::Agent;
 using qt_monkey_agent::UserEventsAnalyzer;
 using qt_monkey_agent::Private::MacMenuActionWatcher;
 using qt_monkey_agent::Private::TreeViewWatcher;
 using qt_monkey_agent::Private::TreeWidgetWatcher;
+using qt_monkey_agent::Private::WidgetsIndex;
 
 #ifdef DEBUG_ANALYZER
 #define DBGPRINT(fmt, ...) qDebug(fmt, __VA_ARGS__)
@@ -44,12 +49,27 @@ namespace
 
 static constexpr int repeatEventTimeoutMs = 100;
 
+//! index is not thread-safe, and functions can be used by custom analyzers
+static WidgetsIndex *guiThreadWidgetsIndex()
+{
+    Agent *agent = Agent::instance();
+    if (agent == nullptr || QThread::currentThread() != qApp->thread())
+        return nullptr;
+    return &agent->widgetsIndex();
+}
+
 static QString numAmongOthersWithTheSameClass(const QObject &w)
 {
     QObject *p = w.parent();
     if (p == nullptr)
         return QString();
 
+    if (WidgetsIndex *index = guiThreadWidgetsIndex()) {
+        int order, count;
+        if (index->classOrder(w, order, count))
+            return order == 0 ? QString() : QString(",%1").arg(order);
+    }
+
     const QObjectList &childs = p->children();
     int order = 0;
     for (QObject *obj : childs) {
@@ -162,6 +182,12 @@ static bool isOnlyOneChildWithSuchClass(QObject &w)
     if (w.parent() == nullptr)
         return false;
 
+    if (WidgetsIndex *index = guiThreadWidgetsIndex()) {
+        int order, count;
+        if (index->classOrder(w, order, count))
+            return count == 1;
+    }
+
     const QObjectList &childs = w.parent()->children();
 
     for (QObject *obj : childs)
@@ -737,15 +763,16 @@ QString qt_monkey_agent::mouseButtonEnumToString(Qt::MouseButton b)
 
 QString qt_monkey_agent::fullQtWidgetId(const QObject &w)
 {
-    QString res = qtObjectId(w);
+    if (WidgetsIndex *index = guiThreadWidgetsIndex())
+        return index->fullId(w, qtObjectId);
+
+    QStringList ids;
+    for (const QObject *cur_obj = &w; cur_obj != nullptr;
+         cur_obj = cur_obj->parent())
+        ids.prepend(qtObjectId(*cur_obj));
     DBGPRINT("%s: class name %s, id %s", Q_FUNC_INFO,
-             w.metaObject()->className(), qPrintable(res));
-    QObject *cur_obj = w.parent();
-    while (cur_obj != nullptr) {
-        res = qtObjectId(*cur_obj) + "." + res;
-        cur_obj = cur_obj->parent();
-    }
-    return res;
+             w.metaObject()->className(), qPrintable(ids.last()));
+    return ids.join(".");
 }
 
 UserEventsAnalyzer::UserEventsAnalyzer(
@@ -845,6 +872,11 @@ bool UserEventsAnalyzer::alreadySawSuchMouseEvent(const QString &widgetName,
 
 bool UserEventsAnalyzer::eventFilter(QObject *obj, QEvent *event)
 {
+    agent_.guiActivity(obj, event);
+    agent_.widgetsIndex().handleEvent(obj, event);
+    if (event->type() == QEvent::Show && obj->isWidgetType()
+        && static_cast<QWidget *>(obj)->isModal())
+        agent_.nestedEventLoopStarted();
     switch (event->type()) {
     case QEvent::KeyPress:
     case QEvent::KeyRelease: {
@@ -0,0 +1,467 @@
+//#define DEBUG_WIDGETS_INDEX
+#include "widgets_index.hpp"
+
+#include <cassert>
+
+#include <QApplication>
+#include <QWidget>
+#include <QtCore/QEvent>
+#include <QtCore/QMetaObject>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
+
+using qt_monkey_agent::Private::WidgetIdPart;
+using qt_monkey_agent::Private::WidgetPath;
+using qt_monkey_agent::Private::WidgetsIndex;
+using qt_monkey_common::Semaphore;
+
+#ifdef DEBUG_WIDGETS_INDEX
+#define DBGPRINT(fmt, ...) qDebug(fmt, __VA_ARGS__)
+#else
+#define DBGPRINT(fmt, ...)                                                     \
+    do {                                                                       \
+    } while (false)
+#endif
+
+namespace
+{
+// names like qt_scrollarea_viewport used by thousands of widgets,
+// there is no sense to track them, lookup result depend on search order
+static constexpr int maxWidgetsWithTheSameName = 8;
+// process pending objects without lookup, to not grow without limit
+static constexpr int maxPendingObjects = 16 * 1024;
+// scripts usually use not so many different ids
+static constexpr int maxCachedPaths = 512;
+// remove ids of deleted objects after that
+static constexpr int maxCachedIds = 16 * 1024;
+} // namespace
+
+WidgetPath qt_monkey_agent::Private::parseWidgetId(const QString &id)
+{
+    const QString classNamePrefix(QLatin1String("<class_name="));
+    WidgetPath path;
+    const QStringList names = id.split('.');
+    path.reserve(static_cast<size_t>(names.size()));
+    for (const QString &el : names) {
+        WidgetIdPart part;
+        part.name = el;
+        if (el.startsWith(classNamePrefix) && el.endsWith('>')
+            && el.size() > classNamePrefix.size() + 1) {
+            const QStringList res
+                = el.mid(classNamePrefix.size(),
+                         el.size() - classNamePrefix.size() - 1)
+                      .split(",", QString::SkipEmptyParts);
+            if (res.size() > 0)
+                part.className = res[0];
+            if (res.size() > 1) {
+                bool ok = false;
+                part.order = res[1].toInt(&ok);
+                if (!ok)
+                    part.order = 0;
+            }
+        }
+        path.push_back(std::move(part));
+    }
+    return path;
+}
+
+void WidgetsIndex::handleEvent(QObject *obj, QEvent *event)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    if (!waiters_.empty())
+        switch (event->type()) {
+        case QEvent::Show:
+        case QEvent::EnabledChange:
+        case QEvent::Polish:
+            wakeUpWaiters(obj);
+            break;
+        case QEvent::WindowActivate:
+            // widget may be found, but not on the screen yet
+            wakeUpWaiters(nullptr);
+            break;
+        default:
+            break;
+        }
+    switch (event->type()) {
+    case QEvent::ChildAdded:
+    case QEvent::ChildRemoved: {
+        childrenIndexes_.remove(obj);
+        // at the time of ChildAdded child not yet constructed,
+        // so check its name later
+        QObject *child = static_cast<QChildEvent *>(event)->child();
+        if (namesIndexBuilt_ && event->type() == QEvent::ChildAdded
+            && child != nullptr)
+            pending_.append(child);
+        break;
+    }
+    case QEvent::ParentChange:
+        ids_.remove(obj);
+        return;
+    case QEvent::ZOrderChange:
+        // raise, lower and stackUnder reorder children of parent,
+        // new index has new version, so ids of siblings recalculated
+        if (obj->parent() != nullptr)
+            childrenIndexes_.remove(obj->parent());
+        return;
+    case QEvent::Polish:
+    case QEvent::Show:
+        if (namesIndexBuilt_)
+            pending_.append(obj);
+        break;
+    default:
+        return;
+    }
+    if (pending_.size() > maxPendingObjects)
+        processPending();
+}
+
+void WidgetsIndex::addNamed(QWidget &w)
+{
+    const QString name = w.objectName();
+    if (name.isEmpty())
+        return;
+    NamedWidgets &named = namesIndex_[name];
+    if (named.ambiguous || named.widgets.contains(&w))
+        return;
+    if (named.widgets.size() >= maxWidgetsWithTheSameName) {
+        for (auto it = named.widgets.begin(); it != named.widgets.end();) {
+            if (it->isNull() || (*it)->objectName() != name)
+                it = named.widgets.erase(it);
+            else
+                ++it;
+        }
+        if (named.widgets.size() >= maxWidgetsWithTheSameName) {
+            DBGPRINT("%s: too many widgets with name %s", Q_FUNC_INFO,
+                     qPrintable(name));
+            named.ambiguous = true;
+            named.widgets.clear();
+            return;
+        }
+    }
+    named.widgets.append(&w);
+}
+
+void WidgetsIndex::buildNamesIndex()
+{
+    namesIndex_.clear();
+    pending_.clear();
+    const QWidgetList allWdg = QApplication::allWidgets();
+    for (QWidget *w : allWdg)
+        addNamed(*w);
+    namesIndexBuilt_ = true;
+    DBGPRINT("%s: index of %d widgets built, %d names", Q_FUNC_INFO,
+             allWdg.size(), namesIndex_.size());
+}
+
+void WidgetsIndex::processPending()
+{
+    const ObjectsList pending = pending_;
+    pending_.clear();
+    for (const QPointer<QObject> &obj : pending)
+        if (!obj.isNull() && obj->isWidgetType())
+            addNamed(*static_cast<QWidget *>(obj.data()));
+}
+
+QWidget *WidgetsIndex::findByName(const QString &name)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    if (!namesIndexBuilt_)
+        buildNamesIndex();
+    else
+        processPending();
+
+    auto it = namesIndex_.find(name);
+    if (it == namesIndex_.end() || it->ambiguous)
+        return nullptr;
+    QWidget *res = nullptr;
+    for (auto jt = it->widgets.begin(); jt != it->widgets.end();) {
+        if (jt->isNull() || (*jt)->objectName() != name) {
+            jt = it->widgets.erase(jt);
+            continue;
+        }
+        if (res != nullptr)
+            return nullptr;
+        res = jt->data();
+        ++jt;
+    }
+    return res;
+}
+
+const WidgetsIndex::ChildrenIndex &WidgetsIndex::childrenIndex(QObject &parent,
+                                                               bool &rebuilt)
+{
+    auto it = childrenIndexes_.find(&parent);
+    // owner is null if parent was destroyed and address reused
+    if (it != childrenIndexes_.end() && it->owner == &parent) {
+        rebuilt = false;
+        return *it;
+    }
+    rebuilt = true;
+    ChildrenIndex &idx = childrenIndexes_[&parent];
+    idx.owner = &parent;
+    idx.byName.clear();
+    idx.byClass.clear();
+    idx.classOrder.clear();
+    idx.version = ++lastVersion_;
+    const QObjectList &clist = parent.children();
+    for (QObject *child : clist) {
+        const QString name = child->objectName();
+        if (!name.isEmpty())
+            idx.byName[name].append(child);
+        ObjectsList &sameClass
+            = idx.byClass[canonicalMetaObject(child->metaObject())];
+        idx.classOrder.insert(child, sameClass.size());
+        sameClass.append(child);
+    }
+    return idx;
+}
+
+const QMetaObject *WidgetsIndex::canonicalMetaObject(const QMetaObject *mo)
+{
+    auto it = canonicalMetaObjects_.find(mo);
+    if (it != canonicalMetaObjects_.end())
+        return *it;
+    const QMetaObject *&canonical
+        = metaObjectsByName_[QString::fromLatin1(mo->className())];
+    if (canonical == nullptr)
+        canonical = mo;
+    canonicalMetaObjects_.insert(mo, canonical);
+    return canonical;
+}
+
+bool WidgetsIndex::classOrder(const QObject &obj, int &order, int &count)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    QObject *parent = obj.parent();
+    if (parent == nullptr)
+        return false;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool rebuilt;
+        const ChildrenIndex &idx = childrenIndex(*parent, rebuilt);
+        const ObjectsList lst
+            = idx.byClass.value(canonicalMetaObject(obj.metaObject()));
+        order = idx.classOrder.value(&obj, -1);
+        if (order >= 0 && order < lst.size() && lst[order] == &obj) {
+            count = lst.size();
+            return true;
+        }
+        childrenIndexes_.remove(parent);
+        if (rebuilt)
+            break;
+    }
+    qWarning("%s: can not find %s among children of its parent", Q_FUNC_INFO,
+             obj.metaObject()->className());
+    return false;
+}
+
+QWidget *WidgetsIndex::findChild(QObject &parent, const QString &name,
+                                 const QString &className, int order,
+                                 bool shouldBeEnabled)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool rebuilt;
+        const ChildrenIndex &idx = childrenIndex(parent, rebuilt);
+        ObjectsList lst;
+        if (className.isEmpty())
+            lst = idx.byName.value(name);
+        else if (const QMetaObject *mo = metaObjectsByName_.value(className))
+            lst = idx.byClass.value(mo);
+        bool stale = false;
+        int n = 0;
+        for (const QPointer<QObject> &child : lst) {
+            if (child.isNull() || child->parent() != &parent
+                || (className.isEmpty() && child->objectName() != name)) {
+                stale = true;
+                break;
+            }
+            QWidget *w = qobject_cast<QWidget *>(child.data());
+            if (w == nullptr)
+                continue;
+            if (shouldBeEnabled && !(w->isVisible() && w->isEnabled()))
+                continue;
+            if (n++ == order)
+                return w;
+        }
+        // child may be renamed without any event, so check not only stale
+        if (rebuilt && !stale)
+            return nullptr;
+        DBGPRINT("%s: rebuild index for %s", Q_FUNC_INFO,
+                 qPrintable(parent.objectName()));
+        childrenIndexes_.remove(&parent);
+    }
+    return nullptr;
+}
+
+void WidgetsIndex::addWaiter(const QString &name, const QString &className,
+                             std::shared_ptr<Semaphore> sem)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    waiters_.push_back(Waiter{name, className, std::move(sem)});
+}
+
+void WidgetsIndex::removeWaiter(const Semaphore &sem)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    for (auto it = waiters_.begin(); it != waiters_.end();)
+        if (it->sem.get() == &sem)
+            it = waiters_.erase(it);
+        else
+            ++it;
+}
+
+void WidgetsIndex::wakeUpWaiters(QObject *obj)
+{
+    if (obj != nullptr && !obj->isWidgetType())
+        return;
+    const QString name = obj != nullptr ? obj->objectName() : QString();
+    const QLatin1String className(
+        obj != nullptr ? obj->metaObject()->className() : "");
+    for (auto it = waiters_.begin(); it != waiters_.end();) {
+        const bool match
+            = obj == nullptr
+              || (it->className.isEmpty() ? it->name == name
+                                          : it->className == className);
+        if (match) {
+            DBGPRINT("%s: wake up waiter for %s%s", Q_FUNC_INFO,
+                     qPrintable(it->name), qPrintable(it->className));
+            it->sem->release();
+            it = waiters_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+WidgetsIndex::CachedPath &WidgetsIndex::cachedPath(const QString &id)
+{
+    auto it = pathsCache_.find(id);
+    if (it != pathsCache_.end()) {
+        pathsLru_.splice(pathsLru_.begin(), pathsLru_, it->lruPos);
+        return *it;
+    }
+    if (pathsCache_.size() >= maxCachedPaths) {
+        pathsCache_.remove(pathsLru_.back());
+        pathsLru_.pop_back();
+    }
+    pathsLru_.push_front(id);
+    CachedPath &cached = pathsCache_[id];
+    cached.lruPos = pathsLru_.begin();
+    cached.path = parseWidgetId(id);
+    // the same class names appear in many ids, so share them
+    for (WidgetIdPart &part : cached.path)
+        if (!part.className.isEmpty()) {
+            auto cit = classNames_.find(part.className);
+            if (cit == classNames_.end())
+                classNames_.insert(part.className, part.className);
+            else
+                part.className = *cit;
+        }
+    return cached;
+}
+
+const WidgetPath &WidgetsIndex::widgetPath(const QString &id)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    return cachedPath(id).path;
+}
+
+bool WidgetsIndex::isOnPath(QWidget &w, const WidgetPath &path,
+                            bool shouldBeEnabled)
+{
+    if (path.empty())
+        return false;
+    QObject *cur = &w;
+    for (size_t i = path.size() - 1; i > 0; --i) {
+        QObject *parent = cur->parent();
+        if (parent == nullptr
+            || findChild(*parent, path[i].name, path[i].className,
+                         path[i].order, shouldBeEnabled)
+                   != cur)
+            return false;
+        cur = parent;
+    }
+    // first part searched by name in the whole application
+    return path[0].className.isEmpty()
+           && findByName(path[0].name) == cur;
+}
+
+QWidget *WidgetsIndex::cachedWidget(const QString &id, bool shouldBeEnabled)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    CachedPath &cached = cachedPath(id);
+    QWidget *w = cached.widget.data();
+    if (w == nullptr || cached.shouldBeEnabled != shouldBeEnabled)
+        return nullptr;
+    if (!isOnPath(*w, cached.path, shouldBeEnabled)) {
+        DBGPRINT("%s: cached widget for %s is stale", Q_FUNC_INFO,
+                 qPrintable(id));
+        cached.widget = nullptr;
+        return nullptr;
+    }
+    return w;
+}
+
+void WidgetsIndex::cacheWidget(const QString &id, bool shouldBeEnabled,
+                               QWidget &w)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    CachedPath &cached = cachedPath(id);
+    // widget found by brute force search can not be validated via parents
+    if (!isOnPath(w, cached.path, shouldBeEnabled)) {
+        cached.widget = nullptr;
+        return;
+    }
+    cached.widget = &w;
+    cached.shouldBeEnabled = shouldBeEnabled;
+}
+
+const WidgetsIndex::CachedId &WidgetsIndex::cachedId(const QObject &obj,
+                                                     ObjectIdFunc objectId)
+{
+    QObject *parent = obj.parent();
+    // copy, reference to value of ids_ is not valid after insert
+    QString parentId;
+    quint64 parentVersion = 0;
+    if (parent != nullptr) {
+        const CachedId &parentCached = cachedId(*parent, objectId);
+        parentId = parentCached.id;
+        parentVersion = parentCached.version;
+    }
+    const QString name = obj.objectName();
+    quint64 siblingsVersion = 0;
+    if (name.isEmpty() && parent != nullptr) {
+        bool rebuilt;
+        siblingsVersion = childrenIndex(*parent, rebuilt).version;
+    }
+    CachedId &cached = ids_[&obj];
+    if (cached.obj == &obj && cached.parent == parent && cached.name == name
+        && cached.siblingsVersion == siblingsVersion
+        && cached.parentVersion == parentVersion)
+        return cached;
+
+    cached.obj = const_cast<QObject *>(&obj);
+    cached.parent = parent;
+    cached.name = name;
+    cached.siblingsVersion = siblingsVersion;
+    cached.parentVersion = parentVersion;
+    cached.version = ++lastVersion_;
+    if (parent != nullptr)
+        cached.id = parentId + QLatin1Char('.') + objectId(obj);
+    else
+        cached.id = objectId(obj);
+    return cached;
+}
+
+QString WidgetsIndex::fullId(const QObject &obj, ObjectIdFunc objectId)
+{
+    assert(QThread::currentThread() == qApp->thread());
+    if (ids_.size() > maxCachedIds) {
+        for (auto it = ids_.begin(); it != ids_.end();)
+            if (it->obj.isNull())
+                it = ids_.erase(it);
+            else
+                ++it;
+    }
+    return cachedId(obj, objectId).id;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QPointer>
+#include <QtCore/QString>
+
+#include "semaphore.hpp"
+
+class QEvent;
+class QObject;
+struct QMetaObject;
+class QWidget;
+
+namespace qt_monkey_agent
+{
+namespace Private
+{
+//! part of widget id, separated by '.'
+struct WidgetIdPart final {
+    //! object name or whole part if it is not in form <class_name=...>
+    QString name;
+    //! class name if part in form <class_name=className,order>
+    QString className;
+    int order = 0;
+};
+using WidgetPath = std::vector<WidgetIdPart>;
+//! split widget id to parts and parse them
+WidgetPath parseWidgetId(const QString &id);
+
+/**
+ * Index of application's widgets by object name and of children
+ * by object name and class name, so widget lookup by id
+ * not require walk through all widgets of application.
+ * It is updated from events catched by application's event filter,
+ * and it is not thread-safe, so should be used only in GUI thread.
+ * There is no event for QObject::setObjectName, so all results
+ * are validated before return, and the index is only hint:
+ * if it gives nothing, caller should use slow path.
+ */
+class WidgetsIndex final
+{
+public:
+    WidgetsIndex() = default;
+    WidgetsIndex(const WidgetsIndex &) = delete;
+    WidgetsIndex &operator=(const WidgetsIndex &) = delete;
+
+    //! should be called for every event that application's filter see
+    void handleEvent(QObject *obj, QEvent *event);
+    /**
+     * Search widget with such object name in the whole application
+     * @return nullptr if there is no such widget or there are several
+     * widgets with such name, so result depend on search order
+     */
+    QWidget *findByName(const QString &name);
+    //! remember result of slow search
+    void addNamed(QWidget &w);
+    /**
+     * Search child of parent with such object name or class name
+     * @param name object name of child, used if className is empty
+     * @param className class name of child
+     * @param order number among suitable children
+     * @param shouldBeEnabled count only visible and enabled children
+     */
+    QWidget *findChild(QObject &parent, const QString &name,
+                       const QString &className, int order,
+                       bool shouldBeEnabled);
+    /**
+     * Register waiter for widget, it is released from GUI thread,
+     * when widget with such name or class name shown, enabled
+     * or some window activated, and removed after that
+     * @param name object name of widget, used if className is empty
+     * @param className class name of widget
+     * @param sem semaphore to release
+     */
+    void addWaiter(const QString &name, const QString &className,
+                   std::shared_ptr<qt_monkey_common::Semaphore> sem);
+    void removeWaiter(const qt_monkey_common::Semaphore &sem);
+
+    /**
+     * Get parsed widget id from cache of recently used ids
+     * @param id widget id
+     */
+    const WidgetPath &widgetPath(const QString &id);
+    /**
+     * Get cached result of search of widget with such id,
+     * it is checked that widget still satisfy all parts of id
+     * @return nullptr if there is no cached result or it is not valid anymore
+     */
+    QWidget *cachedWidget(const QString &id, bool shouldBeEnabled);
+    //! remember result of search widget with such id
+    void cacheWidget(const QString &id, bool shouldBeEnabled, QWidget &w);
+    /**
+     * Get order of object among its siblings with the same class
+     * @param order number of siblings with the same class before object
+     * @param count number of siblings with the same class, including object
+     * @return false if object has no parent
+     */
+    bool classOrder(const QObject &obj, int &order, int &count);
+
+    using ObjectIdFunc = QString (*)(const QObject &);
+    /**
+     * Get full id of object in form parent of parent id.parent id.object id,
+     * ids of object and all its parents are cached, and recalculated only
+     * if object renamed, reparented or set of its siblings changed
+     * @param objectId function to calculate id of one object,
+     * should be the same for all calls
+     */
+    QString fullId(const QObject &obj, ObjectIdFunc objectId);
+
+private:
+    using ObjectsList = QList<QPointer<QObject>>;
+    struct ChildrenIndex final {
+        QPointer<QObject> owner;
+        QHash<QString, ObjectsList> byName;
+        QHash<const QMetaObject *, ObjectsList> byClass;
+        QHash<const QObject *, int> classOrder;
+        //! changed every time when index rebuilt
+        quint64 version = 0;
+    };
+    struct NamedWidgets final {
+        QList<QPointer<QWidget>> widgets;
+        //! too many widgets with such name to track them
+        bool ambiguous = false;
+    };
+
+    struct Waiter final {
+        QString name;
+        QString className;
+        std::shared_ptr<qt_monkey_common::Semaphore> sem;
+    };
+
+    struct CachedPath final {
+        WidgetPath path;
+        QPointer<QWidget> widget;
+        bool shouldBeEnabled = false;
+        std::list<QString>::iterator lruPos;
+    };
+
+    struct CachedId final {
+        //! to detect reuse of address of deleted object
+        QPointer<QObject> obj;
+        const QObject *parent = nullptr;
+        QString name;
+        //! version of parent's children index, if id depend on siblings
+        quint64 siblingsVersion = 0;
+        quint64 parentVersion = 0;
+        quint64 version = 0;
+        QString id;
+    };
+
+    bool namesIndexBuilt_ = false;
+    QHash<QString, NamedWidgets> namesIndex_;
+    //! objects which name should be checked on next lookup
+    ObjectsList pending_;
+    QHash<const QObject *, ChildrenIndex> childrenIndexes_;
+    std::vector<Waiter> waiters_;
+    QHash<QString, QString> classNames_;
+    //! different QMetaObject may have the same class name,
+    //! so for each name there is one QMetaObject to compare with
+    QHash<QString, const QMetaObject *> metaObjectsByName_;
+    QHash<const QMetaObject *, const QMetaObject *> canonicalMetaObjects_;
+    QHash<QString, CachedPath> pathsCache_;
+    //! ids in pathsCache_, recently used first
+    std::list<QString> pathsLru_;
+    QHash<const QObject *, CachedId> ids_;
+    quint64 lastVersion_ = 0;
+
+    void buildNamesIndex();
+    void processPending();
+    void wakeUpWaiters(QObject *obj);
+    CachedPath &cachedPath(const QString &id);
+    bool isOnPath(QWidget &w, const WidgetPath &path, bool shouldBeEnabled);
+    const QMetaObject *canonicalMetaObject(const QMetaObject *mo);
+    const CachedId &cachedId(const QObject &obj, ObjectIdFunc objectId);
+    const ChildrenIndex &childrenIndex(QObject &parent, bool &rebuilt);
+};
+} // namespace Private
+} // namespace qt_monkey_agent